@@ -34,4 +34,23 @@ abstract class Application {
 	public function initializeSandbox( Sandbox $sb ) {
 		// no-op, a subclass can override this if it wishes to do something here
 	}
+
+	// Only called if the Zygote configuration option is set. Should return the next job to run,
+	// or null if there are none left (which shuts the sandbox down). Any other value can be used
+	// to identify the job; the filesystem (e.g. the user script node) should be updated for it
+	// before returning.
+	public function getNextJob( Sandbox $sb ) {
+		return null;
+	}
+
+	// Called in zygote mode once the job returned by getNextJob() has exited
+	public function jobCompleted( Sandbox $sb, $job, $status ) {
+		// no-op, a subclass can override this if it wishes to do something here
+	}
+
+	// Called with the call statistics of a sandboxed process as it exits (once per job in zygote
+	// mode), see Sandbox::getStats() for what they contain
+	public function statsReceived( Sandbox $sb, $stats ) {
+		// no-op, a subclass can override this if it wishes to do something here
+	}
 }
@@ -7,9 +7,34 @@ class Configuration {
 
 	protected $config = [
 		'MaxFDs' => 64,
+		// largest read of a file served from here, except for the blocks read ahead below
 		'MaxReadLength' => 8192,
+		// the sandbox reads regular files it opens read-only ahead in blocks of up to this
+		// size (capped at 128 KiB), or not at all if 0; this includes files served from here
+		'ReadAheadLength' => 131072,
 		'MemoryLimit' => 0,
 		'CPULimit' => 0,
+		// initialize python once and fork it for each job handed out by Application::getNextJob()
+		'Zygote' => false,
+		// SandboxPool: number of sandboxes kept ready, and when to replace one (0 for never):
+		// after this many jobs, or once it uses this many more bytes than when it was new
+		'PoolSize' => 4,
+		'PoolMaxUses' => 0,
+		'PoolMaxMemoryGrowth' => 0,
+		// SandboxPool: seconds a sandbox running a job may go without calling us before it is
+		// killed, or null for CPULimit (5 if that is 0) plus 5
+		'PoolReadTimeout' => null,
+		// directory (ideally on tmpfs) where sandboxes on this host share copies of the
+		// read-only files they are handed, or null to disable
+		'ContentCacheDir' => null,
+		// archive of precompiled stdlib modules made by mkbundle.py, which the sandbox
+		// imports from instead of the stdlib directories, or null to disable
+		'StdlibArchive' => null,
+		// directory where sandboxes on this host find compiled bytecode for the sources they
+		// import, kept filled by running mkpycache.py on it, or null to disable
+		'BytecodeCacheDir' => null,
+		// wire protocol to use with the sandbox, 'json' or 'binary'
+		'RPCProtocol' => 'json',
 		'RPCHandlers' => [
 			NS_SYS => 'PythonSandbox\SyscallHandler',
 			NS_SB => 'PythonSandbox\SandboxHandler',
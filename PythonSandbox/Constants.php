@@ -41,6 +41,7 @@ const EISDIR    = 21; // Is a directory
 const EINVAL    = 22; // Invalid argument
 const EMFILE    = 24; // Too many open files
 const ENOSPC    = 28; // No space left on device
+const ESPIPE    = 29; // Illegal seek
 const EROFS     = 30; // Read-only file system
 const ENOSYS    = 38; // Function not implemented
 const ELOOP     = 40; // Too many symbolic links encountered
@@ -0,0 +1,6 @@
+<?php
+
+namespace PythonSandbox;
+
+// thrown by an RPC handler to leave the call unanswered until RPCServer::resume() is called
+class DeferredCallException extends \RuntimeException { }
@@ -5,7 +5,8 @@ namespace PythonSandbox;
 class DirFD extends FDBase {
 	protected $realpath;
 	protected $fh = null;
-	protected $off = 0;
+	protected $off = 0; // cursor into $entries
+	protected $entries = null; // filtered listing, read when getdents() is first called
 
 	public function __construct( Node $node, $realpath, $mode ) {
 		parent::__construct( $node, $mode );
@@ -27,6 +28,14 @@ class DirFD extends FDBase {
 		throw new SyscallException( EISDIR );
 	}
 
+	public function pread( $length, $offset ) {
+		if ( $this->fh === null ) {
+			throw new SyscallException( EBADF );
+		}
+
+		throw new SyscallException( EISDIR );
+	}
+
 	public function stat() {
 		return stat( $this->realpath );
 	}
@@ -46,7 +55,8 @@ class DirFD extends FDBase {
 		}
 
 		if ( $offset === 0 && $whence === SEEK_SET ) {
-			rewinddir( $this->fh );
+			// the next getdents() sees the directory as it is now
+			$this->entries = null;
 			$this->off = 0;
 			return 0;
 		}
@@ -54,57 +64,71 @@ class DirFD extends FDBase {
 		throw new SyscallException( EINVAL, 'Invalid directory seek' );
 	}
 
-	public function getdents( $bufsize, $structBytes ) {
-		if ( $this->fh === null ) {
-			throw new SyscallException( EBADF );
-		}
-
-		$arr = [];
-		$used = 0;
-
-		// init: the previous call to this advances the directory
-		// one beyond where we start, so rewind it.
+	/**
+	 * Reads and filters the whole directory in one pass. Each entry is kept
+	 * already packed for getdents() (see there for the layout).
+	 */
+	protected function materialize() {
+		$this->entries = [];
 		rewinddir( $this->fh );
-		for ( $i = 0; $i < $this->off; ++$i ) {
-			readdir( $this->fh );
-		}
 
-		while ( true ) {
-			$next = readdir( $this->fh );
-			if ( $next === false ) {
-				// nothing left to get
-				break;
+		while ( ( $next = readdir( $this->fh ) ) !== false ) {
+			$stat = @stat( "{$this->realpath}/{$next}" );
+			if ( $stat === false ) {
+				// removed since we read the name, or a dangling symlink
+				continue;
 			}
 
-			$stat = stat( "{$this->realpath}/{$next}" );
 			// check if we're allowed to view this file/directory before
 			// returning that it exists
-			if ( ( $stat['mode'] & S_IFMT ) === S_IFDIR ) {
+			$type = $stat['mode'] & S_IFMT;
+			if ( $type === S_IFDIR ) {
 				if ( !$this->node->checkSubdir( $next ) ) {
-					++$this->off;
-					continue;
-				}
-			} else {
-				if ( !$this->node->checkFile( $next ) ) {
-					++$this->off;
 					continue;
 				}
+			} elseif ( !$this->node->checkFile( $next ) ) {
+				continue;
 			}
 
-			$len = strlen( $next );
-			if ( $used + $structBytes + $len > $bufsize ) {
+			$this->entries[] = SandboxUtil::packInt64( $stat['ino'] ) . pack( 'Cv', $type >> 12, strlen( $next ) ) . $next;
+		}
+	}
+
+	/**
+	 * Returns as many of the remaining entries as fit into $bufsize bytes of linux_dirent
+	 * structures whose fixed part is $structBytes long, continuing where the previous call left off.
+	 * The entries are packed into a single string: each is the inode as a 64-bit integer, d_type
+	 * as a byte and the length of the name as a 16-bit integer (all little-endian), then the name.
+	 */
+	public function getdents( $bufsize, $structBytes ) {
+		if ( $this->fh === null ) {
+			throw new SyscallException( EBADF );
+		}
+
+		if ( $this->entries === null ) {
+			$this->materialize();
+		}
+
+		$packed = '';
+		$used = 0;
+		$count = count( $this->entries );
+
+		for ( ; $this->off < $count; ++$this->off ) {
+			$entry = $this->entries[$this->off];
+			// the name is all but the first 11 bytes; records are aligned to 8 bytes like the kernel does
+			$reclen = ( $structBytes + strlen( $entry ) - 11 + 7 ) & ~7;
+			if ( $used + $reclen > $bufsize ) {
 				break;
 			}
 
-			$arr[] = [
-				'd_ino' => $stat['ino'],
-				'd_type' => ($stat['mode'] & S_IFMT) >> 12,
-				'd_name' => $next,
-			];
-			$used += $structBytes + $len;
-			++$this->off;
+			$packed .= $entry;
+			$used += $reclen;
+		}
+
+		if ( $packed === '' && $this->off < $count ) {
+			throw new SyscallException( EINVAL, 'Result buffer is too small' );
 		}
 
-		return $arr;
+		return $packed;
 	}
 }
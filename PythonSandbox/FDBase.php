@@ -38,6 +38,11 @@ abstract class FDBase {
 		throw new SyscallException( ENOTDIR );
 	}
 
+	// reads at $offset without moving the file position; only seekable fds support this
+	public function pread( $length, $offset ) {
+		throw new SyscallException( ESPIPE );
+	}
+
 	public function getNode() {
 		return $this->node;
 	}
@@ -3,31 +3,43 @@
 namespace PythonSandbox;
 
 class RPCServer {
-	protected $sb;
+	// binary frame types and value tags, these must match sbcontext.h
+	const FRAME_CALL = 1;
+	const FRAME_RESULT = 2;
+	const FRAME_ERROR = 3;
+	const FRAME_NOTIFY = 4;
+	const FRAME_HEADER_LEN = 12;
+
+	protected $sandboxes = []; // every sandbox served over these pipes, by child index
 	protected $rpipe;
 	protected $wpipe;
+	protected $protocol = 'json';
+	protected $handlerSets = []; // handlers of each sandbox, by child index
+	protected $handlers = []; // handlers of the sandbox calls are currently about, see sb.select
+	protected $selected = 0; // index of that sandbox
+	protected $parked = []; // calls deferred by their handler by sandbox index, see resume()
 
 	public function __construct( Sandbox $sb, $rpipe, $wpipe ) {
-		$this->sb = $sb;
+		$this->sandboxes[] = $sb;
 		$this->rpipe = $rpipe;
 		$this->wpipe = $wpipe;
 	}
 
+	/**
+	 * Serves another sandbox over the same pipes, for a process started with several children.
+	 * Sandboxes are numbered in the order they were given to us, starting at 0 for the one
+	 * passed to the constructor. This must be called before start().
+	 */
+	public function addSandbox( Sandbox $sb ) {
+		$this->sandboxes[] = $sb;
+	}
+
 	public function run() {
-		$config = Configuration::singleton();
-		$mappings = $config->get( 'RPCHandlers' );
-		// TODO: run a hook to allow extensions to manipulate the mappings
-		foreach ( $mappings as &$handler ) {
-			$handler = new $handler( $this->sb );
-		}
+		$this->start();
 
 		// this function loops until the child proc finishes or we get an exception
 		// (other than RPCException which indicate we should pass error down to child).
 		while ( true ) {
-			// marshal format is line based, each line has one json object
-			// input: {"name": "fname", "args": [...]}
-			// response: {"code": 0, "errno": 0, "data": ...}
-
 			$r = [ $this->rpipe ];
 			$w = [];
 			$x = [];
@@ -37,109 +49,413 @@ class RPCServer {
 				break;
 			}
 
-			$line = fgets( $this->rpipe );
-			if ( $line === false ) {
+			if ( !$this->serveOne() ) {
 				break;
 			}
+		}
+	}
 
-			if ( $config->get( 'Verbose' ) ) {
-				echo "<<< $line";
+	/**
+	 * Sets up the handlers for a new sandbox, this must be called before serveOne().
+	 * run() does this itself.
+	 */
+	public function start() {
+		$config = Configuration::singleton();
+		$this->handlerSets = [];
+		foreach ( $this->sandboxes as $sb ) {
+			$handlers = $config->get( 'RPCHandlers' );
+			// TODO: run a hook to allow extensions to manipulate the mappings
+			foreach ( $handlers as &$handler ) {
+				$handler = new $handler( $sb );
 			}
 
-			$call = json_decode( $line, false, 32, JSON_BIGINT_AS_STRING );
-			if ( $call === null || !isset( $call->ns ) || !isset( $call->name )
-					|| !isset( $call->args ) || !is_array( $call->args ) ) {
-				echo "Invalid JSON.\n";
-				break;
-			} elseif ( !preg_match( '/^[a-z0-9_]{1,32}$/i', $call->name ) ) {
-				// paranoia check. Just in case there's some weird exploit with Reflection that could allow
-				// a carefully crafted method name to call arbitrary code, we ensure that whatever name
-				// we receive will form a valid PHP method name.
-				echo "Invalid name.\n";
-				break;
-			} elseif ( !array_key_exists( $call->ns, $mappings ) ) {
-				echo "Invalid namespace.\n";
-				break;
+			unset( $handler );
+			$this->handlerSets[] = $handlers;
+		}
+
+		// calls are about the first sandbox until we are told otherwise
+		$this->handlers = $this->handlerSets[0];
+		$this->selected = 0;
+
+		// every sandbox starts out speaking JSON, it may switch to binary frames
+		// with an sb.negotiate call
+		$this->protocol = 'json';
+		$this->parked = [];
+	}
+
+	/**
+	 * Reads and answers a single call, blocking until one arrives. Callers multiplexing several
+	 * sandboxes should only call this once the read pipe is readable.
+	 * Calls need not be answered in the order they arrive: the sandbox process keeps sending
+	 * calls for other sandboxes while one of them waits for a deferred call (see resume()),
+	 * and matches our responses to its calls by id.
+	 *
+	 * @return bool False if the sandbox should be shut down
+	 */
+	public function serveOne() {
+		$config = Configuration::singleton();
+
+		if ( $this->protocol === 'binary' ) {
+			$call = $this->readFrame();
+		} else {
+			$call = $this->readJson();
+		}
+
+		if ( $call === false ) {
+			return false;
+		} elseif ( !preg_match( '/^[a-z0-9_]{1,32}$/i', $call->name ) ) {
+			// paranoia check. Just in case there's some weird exploit with Reflection that could allow
+			// a carefully crafted method name to call arbitrary code, we ensure that whatever name
+			// we receive will form a valid PHP method name.
+			echo "Invalid name.\n";
+			return false;
+		} elseif ( $call->ns === NS_SB && $call->name === 'negotiate' && $this->protocol === 'json' ) {
+			// handled here rather than in SandboxHandler since it changes how we talk to the sandbox
+			$offered = isset( $call->args[0] ) && is_array( $call->args[0] ) ? $call->args[0] : [];
+			$wanted = $config->get( 'RPCProtocol', 'json' );
+			$protocol = in_array( $wanted, $offered, true ) ? $wanted : 'json';
+
+			if ( !$this->writeResponse( $call, 0, 0, $protocol ) ) {
+				return false;
+			}
+
+			$this->protocol = $protocol;
+			return true;
+		} elseif ( $call->ns === NS_SB && $call->name === 'select' ) {
+			// everything up to the next sb.select is on behalf of the given child
+			$index = isset( $call->args[0] ) ? $call->args[0] : null;
+			if ( !is_int( $index ) || !isset( $this->handlerSets[$index] ) ) {
+				echo "Invalid child.\n";
+				return false;
+			}
+
+			$this->handlers = $this->handlerSets[$index];
+			$this->selected = $index;
+			return $this->writeResponse( $call, 0, 0, null );
+		} elseif ( !array_key_exists( $call->ns, $this->handlers ) ) {
+			echo "Invalid namespace.\n";
+			return false;
+		}
+
+		$obj = $this->handlers[$call->ns];
+		$handler = new \ReflectionObject( $obj );
+		if ( !$handler->hasMethod( $call->name ) ) {
+			echo "No such method {$handler->getName()}::{$call->name}().\n";
+			return false;
+		}
+
+		try {
+			$m = $handler->getMethod( $call->name );
+			$ret = $m->invokeArgs( $obj, $call->args );
+			$errno = 0;
+			$data = null;
+
+			if ( $call->ns === NS_SYS ) {
+				if ( is_array( $ret ) ) {
+					list( $ret, $data ) = $ret;
+				}
+			} else {
+				$data = $ret;
+				$ret = 0;
+			}
+		} catch ( DeferredCallException $e ) {
+			// answered later with resume(); the sandbox waits for it meanwhile
+			// but others sharing the process carry on
+			$this->parked[$this->selected] = $call;
+			return true;
+		} catch ( RPCException $e ) {
+			$ret = $e->getCode();
+			$data = $e->getMessage();
+			$errno = $e->getErrno();
+		}
+
+		return $this->writeResponse( $call, $ret, $errno, $data );
+	}
+
+	/**
+	 * Whether a call from $sb (by default, the sandbox given to the constructor) was deferred
+	 * by its handler and is still waiting for resume()
+	 *
+	 * @return bool
+	 */
+	public function isParked( Sandbox $sb = null ) {
+		return isset( $this->parked[$this->indexOf( $sb )] );
+	}
+
+	/**
+	 * Answers the deferred call of $sb with $data, as though its handler had returned it.
+	 *
+	 * @return bool False if the response could not be written
+	 */
+	public function resume( $data, Sandbox $sb = null ) {
+		$index = $this->indexOf( $sb );
+		$call = $this->parked[$index];
+		unset( $this->parked[$index] );
+
+		return $this->writeResponse( $call, 0, 0, $data );
+	}
+
+	protected function indexOf( Sandbox $sb = null ) {
+		return $sb === null ? 0 : array_search( $sb, $this->sandboxes, true );
+	}
+
+	/**
+	 * Reads a JSON-RPC 2.0 request (one per line).
+	 *
+	 * @return object|bool Object with ns, name, args, id and notify keys, or false on error/EOF
+	 */
+	protected function readJson() {
+		$line = fgets( $this->rpipe );
+		if ( $line === false ) {
+			return false;
+		}
+
+		if ( Configuration::singleton()->get( 'Verbose' ) ) {
+			echo "<<< $line";
+		}
+
+		// requests without an id are notifications, which are not answered
+		$req = json_decode( $line, false, 32, JSON_BIGINT_AS_STRING );
+		if ( $req === null || !isset( $req->jsonrpc ) || $req->jsonrpc !== '2.0'
+				|| !isset( $req->method ) || !is_string( $req->method ) ) {
+			echo "Invalid JSON.\n";
+			return false;
+		}
+
+		$params = isset( $req->params ) ? $req->params : [];
+		if ( !is_array( $params ) ) {
+			echo "Invalid JSON.\n";
+			return false;
+		}
+
+		if ( !preg_match( '/^(sys|sb|app|-?[0-9]+)\.(.*)$/', $req->method, $matches ) ) {
+			echo "Invalid namespace.\n";
+			return false;
+		}
+
+		$namespaces = [ 'sys' => NS_SYS, 'sb' => NS_SB, 'app' => NS_APP ];
+		$ns = isset( $namespaces[$matches[1]] ) ? $namespaces[$matches[1]] : (int)$matches[1];
+
+		return (object)[
+			'ns' => $ns,
+			'name' => $matches[2],
+			'args' => $params,
+			'id' => property_exists( $req, 'id' ) ? $req->id : null,
+			'notify' => !property_exists( $req, 'id' )
+		];
+	}
+
+	/**
+	 * Reads a binary SBF_CALL or SBF_NOTIFY frame.
+	 *
+	 * @return object|bool Object with ns, name, args, id and notify keys, or false on error/EOF
+	 */
+	protected function readFrame() {
+		$hdr = $this->readExact( self::FRAME_HEADER_LEN );
+		if ( $hdr === false ) {
+			return false;
+		}
+
+		$frame = unpack( 'Vlen/Vid/Ctype/Cns/vnamelen', $hdr );
+		$notify = $frame['type'] === self::FRAME_NOTIFY;
+		if ( ( $frame['type'] !== self::FRAME_CALL && !$notify ) || $frame['namelen'] > $frame['len'] ) {
+			echo "Invalid frame.\n";
+			return false;
+		}
+
+		$payload = $frame['len'] > 0 ? $this->readExact( $frame['len'] ) : '';
+		if ( $payload === false ) {
+			return false;
+		}
+
+		$pos = $frame['namelen'];
+		$args = [];
+		while ( $pos < $frame['len'] ) {
+			if ( !$this->unpackValue( $payload, $pos, $value ) ) {
+				echo "Invalid frame.\n";
+				return false;
 			}
 
-			$raw = isset( $call->raw ) && $call->raw;
-			$nargs = count( $call->args );
-			$obj = $mappings[$call->ns];
-			$handler = new \ReflectionObject( $obj );
-			if ( $handler->hasMethod( $call->name ) ) {
-				try {
-					$m = $handler->getMethod( $call->name );
-					$ret = $m->invokeArgs( $obj, $call->args );
-					$errno = 0;
-					$data = null;
-
-					if ( $call->ns === NS_SYS ) {
-						if ( is_array( $ret ) ) {
-							list( $ret, $data ) = $ret;
-						}
-					} else {
-						$data = $ret;
-						$ret = 0;
-					}
-				} catch ( RPCException $e ) {
-					$ret = $e->getCode();
-					$data = $e->getMessage();
-					$errno = $e->getErrno();
+			$args[] = $value;
+		}
+
+		$call = (object)[
+			'ns' => $frame['ns'],
+			'name' => substr( $payload, 0, $frame['namelen'] ),
+			'args' => $args,
+			'id' => $frame['id'],
+			'notify' => $notify
+		];
+
+		if ( Configuration::singleton()->get( 'Verbose' ) ) {
+			echo "<<< #{$call->id} {$call->ns}.{$call->name}" . substr( json_encode( $args ), 0, 250 ) . "\n";
+		}
+
+		return $call;
+	}
+
+	/**
+	 * Decodes one tagged value out of a frame payload.
+	 *
+	 * @param string $payload Frame payload
+	 * @param int &$pos Offset into payload, advanced past the value
+	 * @param mixed &$value Decoded value
+	 * @return bool False if the value is malformed
+	 */
+	protected function unpackValue( $payload, &$pos, &$value ) {
+		$tag = substr( $payload, $pos++, 1 );
+
+		switch ( $tag ) {
+			case 'n':
+				$value = null;
+				return true;
+			case 'i':
+				if ( strlen( $payload ) < $pos + 8 ) {
+					return false;
 				}
 
-				if ( $raw ) {
-					if ( $data instanceOf StatResult ) {
-						$ret = "$ret $errno {$data->getRaw()}";
-					} else {
-						$data = base64_encode( $data );
-						$ret = "$ret $errno $data";
-					}
-				} else {
-					if ( $data instanceOf StatResult ) {
-						$data = $data->getArray();
-					}
-
-					$json = json_encode( [
-						'code' => $ret,
-						'errno' => $errno,
-						'data' => $data
-					] );
-
-					if ( $json === false ) {
-						// $data is a binary string
-						$json = json_encode( [
-							'code' => $ret,
-							'errno' => $errno,
-							'data' => base64_encode( $data ),
-							'base64' => true
-						] );
-					}
-
-					$ret = $json;
+				$value = SandboxUtil::unpackInt64( substr( $payload, $pos, 8 ) );
+				$pos += 8;
+				return true;
+			case 's':
+			case 'j':
+				if ( strlen( $payload ) < $pos + 4 ) {
+					return false;
 				}
 
-				if ( $config->get( 'Verbose' ) ) {
-					if ( strlen( $ret ) > 250 ) {
-						echo ">>> " . substr( $ret, 0, 250 ) . "...\n";
-					} else {
-						echo ">>> $ret\n";
-					}
+				$len = unpack( 'V', substr( $payload, $pos, 4 ) )[1];
+				$pos += 4;
+				if ( strlen( $payload ) < $pos + $len ) {
+					return false;
+				}
+
+				$value = (string)substr( $payload, $pos, $len );
+				$pos += $len;
+
+				if ( $tag === 'j' ) {
+					$value = json_decode( $value, false, 32, JSON_BIGINT_AS_STRING );
 				}
 
-				$r = [];
-				$w = [ $this->wpipe ];
-				$x = [];
+				return true;
+		}
+
+		return false;
+	}
+
+	protected function packValue( $value ) {
+		if ( $value === null ) {
+			return 'n';
+		} elseif ( is_int( $value ) || is_bool( $value ) ) {
+			return 'i' . SandboxUtil::packInt64( (int)$value );
+		} elseif ( is_string( $value ) ) {
+			// binary safe, so no base64 needed here
+			return 's' . pack( 'V', strlen( $value ) ) . $value;
+		} elseif ( $value instanceOf StatResult ) {
+			return 't' . $value->getRecord();
+		}
+
+		$json = json_encode( $value );
+		return 'j' . pack( 'V', strlen( $json ) ) . $json;
+	}
 
-				if ( !stream_select( $r, $w, $x, 5 ) ) {
-					echo "Write timeout.\n";
-					break;
+	/**
+	 * Sends the result of a call back to the sandbox in whichever protocol is active.
+	 * Syscall failures (code -1) are sent as errors carrying errno as their code,
+	 * everything else is sent as a result. Nothing is sent for notifications.
+	 *
+	 * @return bool False if the response could not be written
+	 */
+	protected function writeResponse( $call, $ret, $errno, $data ) {
+		if ( $call->notify ) {
+			return true;
+		}
+
+		if ( $this->protocol === 'binary' ) {
+			if ( $ret === -1 ) {
+				$payload = pack( 'V', $errno ) . $this->packValue( (string)$data );
+				$type = self::FRAME_ERROR;
+			} else {
+				$payload = pack( 'VV', $ret, $errno ) . $this->packValue( $data );
+				$type = self::FRAME_RESULT;
+			}
+
+			$msg = pack( 'VVCCv', strlen( $payload ), $call->id, $type, 0, 0 ) . $payload;
+			$log = "#{$call->id} $ret $errno " . json_encode( $data instanceOf StatResult ? $data->getArray() : $data );
+		} else {
+			$resp = [ 'jsonrpc' => '2.0', 'id' => $call->id ];
+
+			if ( $ret === -1 ) {
+				$resp['error'] = [ 'code' => $errno, 'message' => (string)$data ];
+			} else {
+				if ( $data instanceOf StatResult ) {
+					$data = $data->getArray();
 				}
 
-				fprintf( $this->wpipe, "%s\n", $ret );
+				$resp['result'] = [ 'code' => $ret, 'errno' => $errno, 'data' => $data ];
+			}
+
+			$msg = json_encode( $resp );
+			if ( $msg === false ) {
+				// $data is a binary string
+				$resp['result']['data'] = base64_encode( $data );
+				$resp['result']['base64'] = true;
+				$msg = json_encode( $resp );
+			}
+
+			$log = $msg;
+			$msg .= "\n";
+		}
+
+		if ( Configuration::singleton()->get( 'Verbose' ) ) {
+			if ( strlen( $log ) > 250 ) {
+				echo ">>> " . substr( $log, 0, 250 ) . "...\n";
 			} else {
-				echo "No such method {$handler->getName()}::{$call->name}().\n";
-				return;
+				echo ">>> $log\n";
+			}
+		}
+
+		while ( $msg !== '' ) {
+			$r = [];
+			$w = [ $this->wpipe ];
+			$x = [];
+
+			if ( !stream_select( $r, $w, $x, 5 ) ) {
+				echo "Write timeout.\n";
+				return false;
+			}
+
+			$written = fwrite( $this->wpipe, $msg );
+			if ( $written === false || $written === 0 ) {
+				return false;
+			}
+
+			$msg = (string)substr( $msg, $written );
+		}
+
+		return true;
+	}
+
+	protected function readExact( $len ) {
+		$buf = '';
+
+		while ( strlen( $buf ) < $len ) {
+			$r = [ $this->rpipe ];
+			$w = [];
+			$x = [];
+
+			if ( !stream_select( $r, $w, $x, 5 ) ) {
+				echo "Read timeout.\n";
+				return false;
 			}
+
+			$chunk = fread( $this->rpipe, $len - strlen( $buf ) );
+			if ( $chunk === false || ( $chunk === '' && feof( $this->rpipe ) ) ) {
+				return false;
+			}
+
+			$buf .= $chunk;
 		}
+
+		return $buf;
 	}
 }
@@ -29,6 +29,22 @@ class RealFD extends FDBase {
 		return fread( $this->fh, $length );
 	}
 
+	public function pread( $length, $offset ) {
+		if ( $this->fh === null ) {
+			throw new SyscallException( EBADF );
+		}
+
+		$pos = ftell( $this->fh );
+		if ( $pos === false || fseek( $this->fh, $offset, SEEK_SET ) === -1 ) {
+			throw new SyscallException( ESPIPE );
+		}
+
+		$ret = fread( $this->fh, $length );
+		fseek( $this->fh, $pos, SEEK_SET );
+
+		return $ret;
+	}
+
 	public function seek( $offset, $whence ) {
 		if ( $this->fh === null ) {
 			throw new SyscallException( EBADF );
@@ -12,12 +12,38 @@ class Sandbox {
 	protected $sandboxPath = '';
 	protected $proc = false;
 	protected $pipes = [];
+	protected $server = null;
+	protected $pool = null;
+	protected $job = null;
+	protected $uses = 0;
+	protected $peers = []; // sandboxes sharing our process, see setPeers()
+	protected $exitStatus = null;
+	protected $stats = null;
 
 	public static function runNewSandbox( Application $app ) {
 		$sb = new Sandbox( $app );
 		return $sb->run();
 	}
 
+	/**
+	 * Runs $count sandboxes at once, all served by a single sandbox process
+	 *
+	 * @return array Exit status of each sandbox
+	 */
+	public static function runNewSandboxGroup( Application $app, $count ) {
+		$sandboxes = [];
+		for ( $i = 0; $i < $count; ++$i ) {
+			$sandboxes[] = new Sandbox( $app );
+		}
+
+		$sandboxes[0]->setPeers( array_slice( $sandboxes, 1 ) );
+		$sandboxes[0]->run();
+
+		return array_map( function ( $sb ) {
+			return $sb->getExitStatus();
+		}, $sandboxes );
+	}
+
 	public function __construct( Application $app ) {
 		$this->app = $app;
 		$this->fs = $app->getFilesystemInstance();
@@ -51,6 +77,13 @@ class Sandbox {
 	}
 
 	public function __destruct() {
+		$this->kill();
+	}
+
+	/**
+	 * Kills the child process if it is still running, so that finish() does not wait for it
+	 */
+	public function kill() {
 		if ( $this->proc !== false && proc_get_status( $this->proc )['running'] ) {
 			// send SIGKILL to child proc; this should be safe as the sandbox does not ever
 			// write to the filesystem. If needed, we can SIGTERM first to allow for a more graceful
@@ -61,13 +94,40 @@ class Sandbox {
 	}
 
 	public function run() {
+		if ( !$this->start() ) {
+			return false;
+		}
+
+		try {
+			// this loops until an error is encountered or the child process finishes
+			$this->server->run();
+		} catch ( SandboxException $e ) {
+			// no-op; we throw SandboxException whenever we encounter a condition wherein we wish
+			// to immediately close the sandbox without also raising an exception in our parent process.
+		} finally {
+			$status = $this->finish();
+		}
+
+		return $status;
+	}
+
+	/**
+	 * Spawns the sandbox process without waiting for it. The caller is then responsible for
+	 * calling serve() whenever getReadPipe() is readable, and finish() once that returns false.
+	 * run() does all of this for a single sandbox.
+	 *
+	 * @return bool False if the process could not be started
+	 */
+	public function start() {
 		// proc_open spawns the subproc in a shell, which is not desirable here, so we use exec
 		// the child proc only has direct access to stdin/stdout/stderr during init, once the
 		// sandbox is established it can only read from 3 and write to 4.
 		$config = $this->app->getConfigurationInstance();
 		$memLimit = $config->get( 'MemoryLimit' );
 		$cpuLimit = $config->get( 'CPULimit' );
-		$this->proc = proc_open( "exec \"{$this->sandboxPath}\" /usr/bin/python $memLimit $cpuLimit",
+		// our peers run in the same process, with our environment
+		$children = count( $this->peers ) > 0 ? '-n ' . ( count( $this->peers ) + 1 ) . ' ' : '';
+		$this->proc = proc_open( "exec \"{$this->sandboxPath}\" $children/usr/bin/python $memLimit $cpuLimit",
 			[
 				0 => STDIN,
 				1 => STDOUT,
@@ -83,25 +143,150 @@ class Sandbox {
 
 		stream_set_blocking( $this->pipes[3], false );
 		stream_set_blocking( $this->pipes[4], false );
-		$server = new RPCServer( $this, $this->pipes[4], $this->pipes[3] );
+		$this->server = new RPCServer( $this, $this->pipes[4], $this->pipes[3] );
+		foreach ( $this->peers as $peer ) {
+			$this->server->addSandbox( $peer );
+		}
+
+		$this->server->start();
 
+		return true;
+	}
+
+	/**
+	 * Answers one call from the sandbox, see start()
+	 *
+	 * @return bool False once the sandbox should be shut down
+	 */
+	public function serve() {
 		try {
-			// this loops until an error is encountered or the child process finishes
-			$server->run();
+			return $this->server->serveOne();
 		} catch ( SandboxException $e ) {
-			// no-op; we throw SandboxException whenever we encounter a condition wherein we wish
-			// to immediately close the sandbox without also raising an exception in our parent process.
-		} finally {
-			fclose( $this->pipes[3] );
-			fclose( $this->pipes[4] );
-			$status = proc_close( $this->proc );
-			echo "Child exited with $status.\n";
-			$this->proc = false;
+			return false;
+		}
+	}
+
+	/**
+	 * Waits for the sandbox process to exit and cleans up after it
+	 *
+	 * @return int Exit status of the sandbox process
+	 */
+	public function finish() {
+		fclose( $this->pipes[3] );
+		fclose( $this->pipes[4] );
+		$status = proc_close( $this->proc );
+		echo "Child exited with $status.\n";
+		$this->proc = false;
+		$this->server = null;
+
+		// with peers, our own status was reported by the process before it exited
+		if ( count( $this->peers ) === 0 ) {
+			$this->exitStatus = $status;
 		}
 
 		return $status;
 	}
 
+	public function getReadPipe() {
+		return $this->pipes[4];
+	}
+
+	public function getPid() {
+		if ( $this->proc === false ) {
+			return null;
+		}
+
+		return proc_get_status( $this->proc )['pid'];
+	}
+
+	/**
+	 * Resident memory of the sandbox process and everything it forked, in bytes
+	 *
+	 * @return int
+	 */
+	public function getMemoryUsage() {
+		$pid = $this->getPid();
+		return $pid === null ? 0 : SandboxUtil::getTreeRss( $pid );
+	}
+
+	public function getPool() {
+		return $this->pool;
+	}
+
+	public function setPool( SandboxPool $pool = null ) {
+		$this->pool = $pool;
+	}
+
+	/**
+	 * Whether the sandbox is waiting for a job (pooled sandboxes only)
+	 *
+	 * @return bool
+	 */
+	public function isIdle() {
+		return $this->server !== null && $this->server->isParked( $this );
+	}
+
+	/**
+	 * Hands a job to a sandbox waiting for one (see isIdle()), null shuts it down instead
+	 *
+	 * @return bool False if the sandbox could not be told
+	 */
+	public function deliverJob( $job ) {
+		$this->job = $job;
+		if ( $job !== null ) {
+			++$this->uses;
+		}
+
+		return $this->server->resume( $job, $this );
+	}
+
+	public function getJob() {
+		return $this->job;
+	}
+
+	public function setJob( $job ) {
+		$this->job = $job;
+	}
+
+	// number of jobs this sandbox has been handed
+	public function getUses() {
+		return $this->uses;
+	}
+
+	/**
+	 * Has this sandbox share its process with the given sandboxes, which are not started
+	 * themselves (see runNewSandboxGroup()). This must be called before start().
+	 */
+	public function setPeers( array $peers ) {
+		$this->peers = $peers;
+	}
+
+	public function getExitStatus() {
+		return $this->exitStatus;
+	}
+
+	public function setExitStatus( $status ) {
+		$this->exitStatus = $status;
+	}
+
+	/**
+	 * Call statistics sent by the sandbox when its (last) process exited: "child" holds what
+	 * the sandboxed process recorded about the syscalls it made (missing if it died before
+	 * sending them), "supervisor" what the sandbox process recorded about the syscalls it
+	 * served and the calls it made to us. Each has "syscalls" and "calls" keyed by name, with
+	 * count, bytes, total_ns, max_ns, p50_ns, p90_ns, p99_ns and hist (a list of
+	 * [highest latency in ns, count] for every latency bucket in use).
+	 *
+	 * @return object|null
+	 */
+	public function getStats() {
+		return $this->stats;
+	}
+
+	public function setStats( $stats ) {
+		$this->stats = $stats;
+	}
+
 	public function getenv( $var, $default = null ) {
 		if ( isset( $this->env[$var] ) ) {
 			return $this->env[$var];
@@ -121,6 +306,10 @@ class Sandbox {
 		return $this->fs;
 	}
 
+	public function getApp() {
+		return $this->app;
+	}
+
 	public function isInitialized() {
 		return $this->initialized;
 	}
@@ -9,7 +9,49 @@ class SandboxHandler {
 		$this->sb = $sb;
 	}
 
+	public function getlimits() {
+		$config = $this->sb->getApp()->getConfigurationInstance();
+
+		return [
+			'mem' => (int)$config->get( 'MemoryLimit' ),
+			'cpu' => (int)$config->get( 'CPULimit' ),
+			'zygote' => (bool)$config->get( 'Zygote' ),
+			'cachedir' => $config->get( 'ContentCacheDir' ),
+			'archive' => $config->get( 'StdlibArchive' ),
+			'pycachedir' => $config->get( 'BytecodeCacheDir' ),
+			'readahead' => (int)$config->get( 'ReadAheadLength' )
+		];
+	}
+
 	public function complete_init() {
 		$this->sb->setInitialized();
 	}
+
+	// zygote mode: a null job shuts the sandbox down, anything else runs main.py once more
+	public function getjob() {
+		if ( $this->sb->getPool() !== null ) {
+			// pooled sandboxes sit here until SandboxPool hands them a job
+			throw new DeferredCallException();
+		}
+
+		$this->sb->setJob( $this->sb->getApp()->getNextJob( $this->sb ) );
+		return $this->sb->getJob();
+	}
+
+	public function jobdone( $status ) {
+		$this->sb->getApp()->jobCompleted( $this->sb, $this->sb->getJob(), $status );
+		$this->sb->setJob( null );
+	}
+
+	// call statistics, sent as each sandboxed process exits
+	public function stats( $stats ) {
+		$this->sb->setStats( $stats );
+		$this->sb->getApp()->statsReceived( $this->sb, $stats );
+	}
+
+	// sandboxes sharing a process: this one has exited, the others keep running
+	public function exited( $status ) {
+		echo "Child exited with $status.\n";
+		$this->sb->setExitStatus( $status );
+	}
 }
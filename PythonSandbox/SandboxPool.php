@@ -0,0 +1,163 @@
+<?php
+
+namespace PythonSandbox;
+
+/**
+ * Keeps PoolSize sandboxes started ahead of time, initialized and waiting for their next job,
+ * so that running a job does not wait for process creation and interpreter startup.
+ *
+ * Pooled sandboxes always run in zygote mode. Whenever one of them is idle it is handed the next
+ * job given to submit(), or failing that whatever Application::getNextJob() returns; unlike with
+ * a single sandbox, null from there only means that there is nothing to do right now.
+ * Sandboxes are replaced after PoolMaxUses jobs, or once they have grown by more than
+ * PoolMaxMemoryGrowth bytes since they first became idle (0 disables either check).
+ */
+class SandboxPool {
+	protected $app;
+	protected $size;
+	protected $maxUses;
+	protected $maxGrowth;
+	protected $timeout; // seconds a busy sandbox may go without calling us
+	protected $sandboxes = []; // keyed by spl_object_hash
+	protected $baseline = []; // memory usage of each sandbox when it was first idle
+	protected $lastActive = []; // when we last heard from each sandbox
+	protected $jobs = [];
+	protected $stopping = false;
+
+	public function __construct( Application $app ) {
+		$config = $app->getConfigurationInstance();
+		$this->app = $app;
+		$this->size = max( 1, (int)$config->get( 'PoolSize' ) );
+		$this->maxUses = (int)$config->get( 'PoolMaxUses' );
+		$this->maxGrowth = (int)$config->get( 'PoolMaxMemoryGrowth' );
+
+		// by default, long enough for a job to use up its CPU limit (DEF_CPU in the sandbox if unset)
+		$this->timeout = $config->get( 'PoolReadTimeout' );
+		if ( $this->timeout === null ) {
+			$cpuLimit = (int)$config->get( 'CPULimit' );
+			$this->timeout = ( $cpuLimit > 0 ? $cpuLimit : 5 ) + 5;
+		}
+
+		// jobs are run by forking the initialized interpreter
+		$config->set( 'Zygote', true );
+	}
+
+	/**
+	 * Queues a job for the next idle sandbox, ahead of anything Application::getNextJob() has
+	 */
+	public function submit( $job ) {
+		$this->jobs[] = $job;
+	}
+
+	/**
+	 * Lets running jobs finish, then shuts every sandbox down; run() returns once that is done
+	 */
+	public function stop() {
+		$this->stopping = true;
+	}
+
+	/**
+	 * Runs the pool until stop() is called (from a job callback, for instance)
+	 */
+	public function run() {
+		$this->refill();
+
+		while ( count( $this->sandboxes ) > 0 ) {
+			$this->dispatch();
+
+			$r = [];
+			foreach ( $this->sandboxes as $key => $sb ) {
+				$r[$key] = $sb->getReadPipe();
+			}
+
+			$w = [];
+			$x = [];
+			if ( stream_select( $r, $w, $x, 1 ) === false ) {
+				break;
+			}
+
+			foreach ( $r as $key => $pipe ) {
+				$sb = $this->sandboxes[$key];
+				$this->lastActive[$key] = microtime( true );
+				if ( !$sb->serve() ) {
+					$this->retire( $key );
+				}
+			}
+
+			// sandboxes waiting on us are never timed out
+			foreach ( $this->sandboxes as $key => $sb ) {
+				if ( !$sb->isIdle() && microtime( true ) - $this->lastActive[$key] > $this->timeout ) {
+					echo "Read timeout.\n";
+					$this->retire( $key );
+				}
+			}
+
+			$this->refill();
+		}
+
+		// anything queued after the last sandbox went away
+		$this->jobs = [];
+	}
+
+	// starts new sandboxes until there are enough of them again
+	protected function refill() {
+		while ( !$this->stopping && count( $this->sandboxes ) < $this->size ) {
+			$sb = new Sandbox( $this->app );
+			$sb->setPool( $this );
+			if ( !$sb->start() ) {
+				echo "Unable to start sandbox.\n";
+				return;
+			}
+
+			$key = spl_object_hash( $sb );
+			$this->sandboxes[$key] = $sb;
+			$this->lastActive[$key] = microtime( true );
+		}
+	}
+
+	// hands jobs to idle sandboxes, and shuts down the ones that are due for replacement
+	protected function dispatch() {
+		foreach ( $this->sandboxes as $key => $sb ) {
+			if ( !$sb->isIdle() ) {
+				continue;
+			}
+
+			$usage = 0;
+			if ( $this->maxGrowth > 0 ) {
+				$usage = $sb->getMemoryUsage();
+				if ( !isset( $this->baseline[$key] ) ) {
+					$this->baseline[$key] = $usage;
+				}
+			}
+
+			if ( $this->stopping
+				|| ( $this->maxUses > 0 && $sb->getUses() >= $this->maxUses )
+				|| ( $this->maxGrowth > 0 && $usage - $this->baseline[$key] > $this->maxGrowth )
+			) {
+				// it exits on its own, refill() starts its replacement once it has
+				$job = null;
+			} elseif ( count( $this->jobs ) > 0 ) {
+				$job = array_shift( $this->jobs );
+			} else {
+				$job = $this->app->getNextJob( $sb );
+				if ( $job === null ) {
+					continue;
+				}
+			}
+
+			$this->lastActive[$key] = microtime( true );
+			if ( !$sb->deliverJob( $job ) ) {
+				$this->retire( $key );
+			}
+		}
+	}
+
+	// drops a sandbox that failed or went quiet, without waiting for it to exit on its own
+	protected function retire( $key ) {
+		$sb = $this->sandboxes[$key];
+		unset( $this->sandboxes[$key], $this->baseline[$key], $this->lastActive[$key] );
+		$sb->setPool( null );
+		$sb->kill();
+		$sb->finish();
+	}
+}
@@ -48,4 +48,40 @@ final class SandboxUtil {
 
 		return $path;
 	}
+
+	// 64-bit little-endian integers for the binary protocol; done as two 32-bit
+	// halves since the 'P' pack format is not available everywhere
+	public static function packInt64( $value ) {
+		return pack( 'VV', $value & 0xFFFFFFFF, ( $value >> 32 ) & 0xFFFFFFFF );
+	}
+
+	public static function unpackInt64( $data ) {
+		$parts = unpack( 'Vlo/Vhi', $data );
+		return ( $parts['hi'] << 32 ) | $parts['lo'];
+	}
+
+	/**
+	 * Sums the resident memory of $pid and all of its descendants, in bytes.
+	 * Relies on /proc/<pid>/task/<tid>/children, processes we cannot read count as 0.
+	 */
+	public static function getTreeRss( $pid ) {
+		$rss = 0;
+		$status = @file_get_contents( "/proc/$pid/status" );
+		if ( $status !== false && preg_match( '/^VmRSS:\s+(\d+) kB/m', $status, $matches ) ) {
+			$rss = (int)$matches[1] * 1024;
+		}
+
+		foreach ( glob( "/proc/$pid/task/*/children" ) ?: [] as $file ) {
+			$children = @file_get_contents( $file );
+			if ( $children === false ) {
+				continue;
+			}
+
+			foreach ( preg_split( '/\s+/', trim( $children ), -1, PREG_SPLIT_NO_EMPTY ) as $child ) {
+				$rss += self::getTreeRss( (int)$child );
+			}
+		}
+
+		return $rss;
+	}
 }
@@ -11,6 +11,10 @@ class StatOnlyFD extends RealFD {
 		throw new SyscallException( EPERM );
 	}
 
+	public function pread( $length, $offset ) {
+		throw new SyscallException( EPERM );
+	}
+
 	public function seek( $offset, $whence ) {
 		throw new SyscallException( EPERM );
 	}
@@ -3,32 +3,32 @@
 namespace PythonSandbox;
 
 class StatResult {
+	// field names in the order of PHP's stat(), which is also the order of the binary record
+	protected static $keys = [
+		'st_dev', 'st_ino', 'st_mode', 'st_nlink', 'st_uid', 'st_gid', 'st_rdev',
+		'st_size', 'st_atime', 'st_mtime', 'st_ctime', 'st_blksize', 'st_blocks'
+	];
+
 	protected $raw = [];
-	protected $arr = [];
 
+	/**
+	 * @param array $data Result of stat() or Node::stat(); only the numeric keys 0-12 are used
+	 */
 	public function __construct( $data ) {
+		for ( $i = 0; $i < 13; ++$i ) {
+			$this->raw[$i] = (int)$data[$i];
+		}
+
 		// override the user/group with our own (fake) version
 		// this prevents minor information leaks about who owns what files
 		// in the filesystem that the sandbox is able to directly access
 		// we present a view that a file is either owned by root or the sandbox
-		if ( $data['uid'] !== 0 ) {
-			$data[4] = SB_UID;
-			$data[5] = SB_GID;
-			$data['uid'] = SB_UID;
-			$data['gid'] = SB_GID;
+		if ( $this->raw[4] !== 0 ) {
+			$this->raw[4] = SB_UID;
+			$this->raw[5] = SB_GID;
 		} else {
-			$data[4] = 0;
-			$data[5] = 0;
-			$data['uid'] = 0;
-			$data['gid'] = 0;
-		}
-
-		foreach ( $data as $key => $val ) {
-			if ( is_int( $key ) ) {
-				$this->raw[$key] = $val;
-			} else {
-				$this->arr["st_$key"] = $val;
-			}
+			$this->raw[4] = 0;
+			$this->raw[5] = 0;
 		}
 	}
 
@@ -36,7 +36,20 @@ class StatResult {
 		return implode( ' ', $this->raw );
 	}
 
+	// only needed by the JSON protocol, so the keyed form is built on demand
 	public function getArray() {
-		return $this->arr;
+		return array_combine( self::$keys, $this->raw );
+	}
+
+	// fixed-layout record for the binary protocol (struct sb_stat in sbcontext.h),
+	// PHP has no access to the nanosecond parts of the timestamps so those are 0
+	public function getRecord() {
+		$record = '';
+
+		foreach ( $this->raw as $val ) {
+			$record .= SandboxUtil::packInt64( $val );
+		}
+
+		return $record . str_repeat( "\0", 24 );
 	}
 }
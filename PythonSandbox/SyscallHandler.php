@@ -71,6 +71,12 @@ class SyscallHandler {
 		return [ strlen( $str ), $str ];
 	}
 
+	// pread64(), preadv() and preadv2(); readv() arrives as a plain read() of the total size
+	public function pread( $fd, $length, $offset, $readahead = false ) {
+		$str = $this->sb->getfs()->pread( $fd, $length, $offset, $readahead );
+		return [ strlen( $str ), $str ];
+	}
+
 	public function stat( $path ) {
 		$res = $this->sb->getfs()->stat( $path );
 		return [ 0, $res ];
@@ -108,12 +114,11 @@ class SyscallHandler {
 	}
 
 	public function getdents( $fd, $bufsize, $structBytes ) {
-		$arr = $this->sb->getfs()->getdents( $fd, $bufsize, $structBytes );
+		$packed = $this->sb->getfs()->getdents( $fd, $bufsize, $structBytes );
 
-		// the real getdents() syscall returns bytes whereas we report array size
-		// the child sandbox will correctly compute the actual return value, and only
-		// uses ours to check for error (below 0), end of directory (0), or data (above zero).
-		return [ count( $arr ), $arr ];
+		// the real getdents() syscall returns bytes whereas we report whether there are
+		// any entries; the child sandbox builds the actual records from $packed.
+		return [ $packed === '' ? 0 : 1, $packed ];
 	}
 
 	public function lseek( $fd, $offset, $whence ) {
@@ -22,21 +22,9 @@ class VirtualDir extends DirBase {
 	public function stat() {
 		$time = time();
 		$mode = S_IFDIR | $this->getPermissions();
+		// same order as stat(), see StatResult
 		return [
-			1, $this->inode, $mode, 0, SB_UID, SB_GID, 0, 0, $time, $time, $time, 512, 0,
-			'dev' => 1,
-			'ino' => $this->inode,
-			'mode' => $mode,
-			'nlink' => 0,
-			'uid' => SB_UID,
-			'gid' => SB_GID,
-			'rdev' => 0,
-			'size' => 0,
-			'atime' => $time,
-			'mtime' => $time,
-			'ctime' => $time,
-			'blksize' => 512,
-			'blocks' => 0
+			1, $this->inode, $mode, 0, SB_UID, SB_GID, 0, 0, $time, $time, $time, 512, 0
 		];
 	}
 
@@ -22,6 +22,14 @@ class VirtualFD extends FDBase {
 		return $ret;
 	}
 
+	public function pread( $length, $offset ) {
+		if ( $this->node === null ) {
+			throw new SyscallException( EBADF );
+		}
+
+		return $this->node->readInternal( $offset, $length );
+	}
+
 	public function write( $contents ) {
 		if ( $this->node === null ) {
 			throw new SyscallException( EBADF );
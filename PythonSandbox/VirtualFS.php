@@ -184,6 +184,27 @@ class VirtualFS {
 		return $this->fds[$fd]->read( $length );
 	}
 
+	public function pread( $fd, $length, $offset, $readahead = false ) {
+		$config = $this->app->getConfigurationInstance();
+		$maxlen = $config->get( 'MaxReadLength' );
+		// the sandbox fills its read-ahead buffer with these, the blocks may be larger
+		if ( $readahead ) {
+			$maxlen = max( $maxlen, $config->get( 'ReadAheadLength' ) );
+		}
+
+		if ( $length > $maxlen ) {
+			$length = $maxlen;
+		}
+
+		if ( $offset < 0 ) {
+			throw new SyscallException( EINVAL );
+		}
+
+		$this->validateFd( $fd );
+
+		return $this->fds[$fd]->pread( $length, $offset );
+	}
+
 	public function seek( $fd, $offset, $whence ) {
 		$this->validateFd( $fd );
 
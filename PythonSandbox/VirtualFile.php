@@ -43,21 +43,9 @@ class VirtualFile extends FileBase {
 		$mode = S_IFREG | $this->getPermissions();
 		$nblocks = (int)ceil( $this->len / 512 );
 
+		// same order as stat(), see StatResult
 		return [
-			1, $this->inode, $mode, 0, SB_UID, SB_GID, 0, $this->len, $time, $time, $time, 512, $nblocks,
-			'dev' => 1,
-			'ino' => $this->inode,
-			'mode' => $mode,
-			'nlink' => 0,
-			'uid' => SB_UID,
-			'gid' => SB_GID,
-			'rdev' => 0,
-			'size' => $this->len,
-			'atime' => $time,
-			'mtime' => $time,
-			'ctime' => $time,
-			'blksize' => 512,
-			'blocks' => $nblocks
+			1, $this->inode, $mode, 0, SB_UID, SB_GID, 0, $this->len, $time, $time, $time, 512, $nblocks
 		];
 	}
 
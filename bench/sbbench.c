@@ -0,0 +1,715 @@
+// sbbench: microbenchmarks for the sandbox's own overhead
+// stands in for the overall parent with just enough of it to get a sandbox going (getlimits, getfs,
+// getpythonpath and getcwd) and a filesystem made of the host's python installation plus a fixture
+// of our own under /bench. there are no virtual files, so every syscall the sandbox makes is served
+// by the sandbox process itself and what gets measured is the sandbox rather than us. the one
+// exception is /proxy, which we answer for, and which is only used by the tests.
+// cold startup (until sb.complete_init) is timed here over a number of fresh sandboxes; everything
+// else is timed inside the sandbox by workload.py, which runs as main.py and reports back to us.
+// each result is printed as one line of JSON:
+//   {"bench": name, "ops": count, "p50_ns": ..., "p99_ns": ..., "ops_per_sec": ..., ...}
+// followed by a {"bench": "sandbox_stats", "stats": ...} line with what the sandbox recorded
+// itself during the workload (see sbstats.c).
+// the tests under tests/ are run the same way (see `make check`), in place of the workload; they
+// report with app.check instead, {"test": name, "ok": bool, ...}, and we fail if any is not ok.
+// with -z the sandbox runs as a zygote and main.py runs as its one job. the job is expected to exit
+// with status 0 unless it calls app.expect_status first; we check its sb.jobdone status against that.
+// the sandbox refuses to run as root, so neither can we.
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <time.h>
+#include <json/json.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// these must match sbcontext.h
+#define PIPEIN 3
+#define PIPEOUT 4
+
+#define BENCH_FILES 1000 /* small files in /bench/files */
+#define BENCH_FILE_SIZE 4096
+#define BENCH_DATA_SIZE 67108864 /* size of /bench/data.bin (64 MiB) */
+
+#ifndef BENCH_PYTHON
+#define BENCH_PYTHON "/usr/bin/python3"
+#endif
+
+static struct {
+	const char *base; // directory holding sandbox, libsbpreload.so and lib/
+	const char *python; // path to python, which must be under /usr
+	const char *workload;
+	const char *so; // (virtual) path of the shared object to map, workload.py picks one if NULL
+	unsigned int iterations;
+	unsigned int runs; // fresh sandboxes started to time startup
+	unsigned int modules; // stdlib modules imported
+	unsigned int entries; // files in /bench/bigdir
+	unsigned int readahead;
+	bool passthrough; // hand /bench files to the sandbox as fds rather than serving reads
+	bool zygote; // run main.py as a job
+	bool keep; // leave the fixture behind
+} opts = {
+	.base = ".",
+	.python = BENCH_PYTHON,
+	.workload = NULL,
+	.so = NULL,
+	.iterations = 1000,
+	.runs = 20,
+	.modules = 50,
+	.entries = 10000,
+	.readahead = 262144,
+	.passthrough = false,
+	.zygote = false,
+	.keep = false
+};
+
+// the sandbox being served
+struct bench_run {
+	bool full; // run the workload, rather than exiting once initialized
+	uint64_t start;
+	uint64_t init_ns; // time until sb.complete_init, 0 if it never got that far
+	bool job_given; // sb.getjob handed out the job already
+	int job_status; // what sb.jobdone should report, see app.expect_status
+};
+
+static char base[PATH_MAX];
+static char workload[PATH_MAX];
+static char fixture[] = "/tmp/sbbench.XXXXXX";
+static json_object *created = NULL; // names app.mknode added to /proxy
+static bool failed = false; // a test reported that it is not ok
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int write_full(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		} else if (ret < 0) {
+			return -1;
+		}
+
+		buf += ret;
+		len -= (size_t)ret;
+	}
+
+	return 0;
+}
+
+static int make_file(const char *path, size_t size)
+{
+	char buf[65536];
+	size_t chunk;
+	int fd, ret = 0;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	for (size_t i = 0; i < sizeof(buf); ++i) {
+		buf[i] = (char)('a' + i % 26);
+	}
+
+	while (size > 0 && ret == 0) {
+		chunk = size < sizeof(buf) ? size : sizeof(buf);
+		ret = write_full(fd, buf, chunk);
+		size -= chunk;
+	}
+
+	close(fd);
+	return ret;
+}
+
+/* Creates the files the workload runs against:
+ * files/f00000... - BENCH_FILES files of BENCH_FILE_SIZE bytes
+ * bigdir/e00000... - opts.entries empty files
+ * data.bin - BENCH_DATA_SIZE bytes */
+static int make_fixture(void)
+{
+	char path[PATH_MAX];
+
+	if (mkdtemp(fixture) == NULL) {
+		fprintf(stderr, "Unable to create fixture directory: %s\n", strerror(errno));
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/files", fixture);
+	if (mkdir(path, 0755) != 0) {
+		fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < BENCH_FILES; ++i) {
+		snprintf(path, sizeof(path), "%s/files/f%05u", fixture, i);
+		if (make_file(path, BENCH_FILE_SIZE) != 0) {
+			return -1;
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/bigdir", fixture);
+	if (mkdir(path, 0755) != 0) {
+		fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < opts.entries; ++i) {
+		snprintf(path, sizeof(path), "%s/bigdir/e%05u", fixture, i);
+		if (make_file(path, 0) != 0) {
+			return -1;
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/data.bin", fixture);
+	return make_file(path, BENCH_DATA_SIZE);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	(void)st;
+	(void)type;
+	(void)ftw;
+
+	remove(path);
+	return 0;
+}
+
+static void remove_fixture(void)
+{
+	nftw(fixture, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// a getfs node pointing at a real file or directory
+static json_object *real_node(const char *name, const char *realpath, bool recurse)
+{
+	json_object *node = json_object_new_object();
+
+	json_object_object_add(node, "name", json_object_new_string(name));
+	json_object_object_add(node, "realpath", json_object_new_string(realpath));
+	json_object_object_add(node, "follow", json_object_new_boolean(1));
+	json_object_object_add(node, "recurse", json_object_new_boolean(recurse));
+	return node;
+}
+
+static void add_child(json_object *node, json_object *child)
+{
+	json_object *children;
+
+	if (!json_object_object_get_ex(node, "children", &children)) {
+		children = json_object_new_array();
+		json_object_object_add(node, "children", children);
+	}
+
+	json_object_array_add(children, child);
+}
+
+/* The filesystem we serve (see build_tree in sandbox-parent.c for the format); laid out like
+ * VirtualFS.php does it, but without its whitelists:
+ * /lib, /lib64, /usr - the host's (python is expected to be somewhere under /usr)
+ * /usr/lib/sandbox - our lib directory
+ * /tmp/main.py - workload.py
+ * /dev/urandom
+ * /bench - the fixture
+ * /proxy - writable, with the names in created (see sb.getnode) */
+static json_object *build_fs(void)
+{
+	json_object *fs = json_object_new_array();
+	json_object *usr, *usrlib, *node;
+	struct stat st;
+	char path[PATH_MAX];
+
+	if (stat("/lib", &st) == 0) {
+		json_object_array_add(fs, real_node("lib", "/lib", true));
+	}
+
+	if (stat("/lib64", &st) == 0) {
+		json_object_array_add(fs, real_node("lib64", "/lib64", true));
+	}
+
+	usr = real_node("usr", "/usr", true);
+	usrlib = real_node("lib", "/usr/lib", true);
+	snprintf(path, sizeof(path), "%s/lib", base);
+	add_child(usrlib, real_node("sandbox", path, true));
+	add_child(usr, usrlib);
+	json_object_array_add(fs, usr);
+
+	node = json_object_new_object();
+	json_object_object_add(node, "name", json_object_new_string("tmp"));
+	json_object_object_add(node, "dir", json_object_new_boolean(1));
+	add_child(node, real_node("main.py", workload, false));
+	json_object_array_add(fs, node);
+
+	node = real_node("dev", "/dev", false);
+	json_object *filter = json_object_new_array();
+	json_object_array_add(filter, json_object_new_string("urandom"));
+	json_object_object_add(node, "filter", filter);
+	json_object_array_add(fs, node);
+
+	node = real_node("bench", fixture, true);
+	json_object_object_add(node, "passthrough", json_object_new_boolean(opts.passthrough));
+	json_object_array_add(fs, node);
+
+	node = json_object_new_object();
+	json_object_object_add(node, "name", json_object_new_string("proxy"));
+	json_object_object_add(node, "dir", json_object_new_boolean(1));
+	json_object_object_add(node, "proxy", json_object_new_boolean(1));
+	json_object_object_add(node, "writable", json_object_new_boolean(1));
+	json_object_array_add(fs, node);
+
+	return fs;
+}
+
+// what the workload needs to know, see workload.py
+static json_object *bench_config(const struct bench_run *run)
+{
+	json_object *config = json_object_new_object();
+
+	json_object_object_add(config, "mode", json_object_new_string(run->full ? "full" : "startup"));
+	json_object_object_add(config, "iterations", json_object_new_int64(opts.iterations));
+	json_object_object_add(config, "modules", json_object_new_int64(opts.modules));
+	json_object_object_add(config, "so", opts.so != NULL ? json_object_new_string(opts.so) : NULL);
+	return config;
+}
+
+// a node app.mknode created in /proxy, which are all copies of the first fixture file
+static json_object *proxy_node(const char *name)
+{
+	char path[PATH_MAX];
+
+	for (int i = 0; name != NULL && i < (int)json_object_array_length(created); ++i) {
+		if (!strcmp(json_object_get_string(json_object_array_get_idx(created, i)), name)) {
+			snprintf(path, sizeof(path), "%s/files/f00000", fixture);
+			return real_node(name, path, false);
+		}
+	}
+
+	return NULL;
+}
+
+static void print_line(json_object *obj)
+{
+	printf("%s\n", json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN));
+	fflush(stdout);
+}
+
+/* Answers method, setting *err to an errno value for the calls we don't know. Notifications
+ * come through here as well, their return value is simply dropped. */
+static json_object *handle_call(struct bench_run *run, const char *method, json_object *params, int *err)
+{
+	json_object *result, *arg = params != NULL ? json_object_array_get_idx(params, 0) : NULL;
+
+	*err = 0;
+
+	if (!strcmp(method, "sb.negotiate")) {
+		// binary frames would be faster still, but are not worth implementing here
+		return json_object_new_string("json");
+	} else if (!strcmp(method, "sb.getlimits")) {
+		result = json_object_new_object();
+		// 0 makes the sandbox use its own defaults
+		json_object_object_add(result, "mem", json_object_new_int(0));
+		json_object_object_add(result, "cpu", json_object_new_int(0));
+		json_object_object_add(result, "zygote", json_object_new_boolean(opts.zygote));
+		json_object_object_add(result, "readahead", json_object_new_int64(opts.readahead));
+		return result;
+	} else if (!strcmp(method, "sb.getfs")) {
+		return build_fs();
+	} else if (!strcmp(method, "sb.getpythonpath")) {
+		return json_object_new_string(opts.python);
+	} else if (!strcmp(method, "sys.getcwd")) {
+		return json_object_new_string("/tmp");
+	} else if (!strcmp(method, "sb.complete_init")) {
+		run->init_ns = now_ns() - run->start;
+		return NULL;
+	} else if (!strcmp(method, "app.benchconfig")) {
+		return bench_config(run);
+	} else if (!strcmp(method, "app.report")) {
+		print_line(arg);
+		return NULL;
+	} else if (!strcmp(method, "sb.getnode")) {
+		// params are the proxy node's name and realpath, then the name looked up and the full path
+		result = proxy_node(json_object_get_string(json_object_array_get_idx(params, 2)));
+		if (result == NULL) {
+			*err = ENOENT;
+		}
+
+		return result;
+	} else if (!strcmp(method, "app.mknode")) {
+		json_object_array_add(created, json_object_get(arg));
+		return NULL;
+	} else if (!strcmp(method, "sb.getjob")) {
+		// a single job, null tells the zygote to exit
+		if (run->job_given) {
+			return NULL;
+		}
+
+		run->job_given = true;
+		return json_object_new_boolean(1);
+	} else if (!strcmp(method, "app.expect_status")) {
+		run->job_status = json_object_get_int(arg);
+		return NULL;
+	} else if (!strcmp(method, "sb.jobdone")) {
+		bool ok = json_object_get_int(arg) == run->job_status;
+
+		result = json_object_new_object();
+		json_object_object_add(result, "test", json_object_new_string("jobdone"));
+		json_object_object_add(result, "ok", json_object_new_boolean(ok));
+		json_object_object_add(result, "status", json_object_get(arg));
+		json_object_object_add(result, "expected", json_object_new_int(run->job_status));
+		print_line(result);
+		json_object_put(result);
+
+		failed = failed || !ok;
+		return NULL;
+	} else if (!strcmp(method, "app.check")) {
+		json_object *ok;
+
+		print_line(arg);
+		if (!json_object_object_get_ex(arg, "ok", &ok) || !json_object_get_boolean(ok)) {
+			failed = true;
+		}
+
+		return NULL;
+	} else if (!strcmp(method, "sb.stats")) {
+		if (run->full) {
+			result = json_object_new_object();
+			json_object_object_add(result, "bench", json_object_new_string("sandbox_stats"));
+			json_object_object_add(result, "stats", json_object_get(arg));
+			print_line(result);
+			json_object_put(result);
+		}
+
+		return NULL;
+	} else if (!strcmp(method, "sb.exited")) {
+		return NULL;
+	}
+
+	fprintf(stderr, "sbbench: %s is not implemented\n", method);
+	*err = ENOSYS;
+	return NULL;
+}
+
+static int send_response(int fd, json_object *id, json_object *data, int err)
+{
+	json_object *resp = json_object_new_object();
+	json_object *inner = json_object_new_object();
+	const char *json;
+	int ret;
+
+	json_object_object_add(resp, "jsonrpc", json_object_new_string("2.0"));
+	json_object_object_add(resp, "id", json_object_get(id));
+
+	if (err != 0) {
+		json_object_object_add(inner, "code", json_object_new_int(err));
+		json_object_object_add(inner, "message", json_object_new_string(strerror(err)));
+		json_object_object_add(resp, "error", inner);
+		json_object_put(data);
+	} else {
+		json_object_object_add(inner, "code", json_object_new_int(0));
+		json_object_object_add(inner, "errno", json_object_new_int(0));
+		json_object_object_add(inner, "data", data);
+		json_object_object_add(resp, "result", inner);
+	}
+
+	json = json_object_to_json_string_ext(resp, JSON_C_TO_STRING_PLAIN);
+	ret = write_full(fd, json, strlen(json));
+	if (ret == 0) {
+		ret = write_full(fd, "\n", 1);
+	}
+
+	json_object_put(resp);
+	return ret;
+}
+
+// moves fd out of the way of PIPEIN and PIPEOUT
+static int high_fd(int fd)
+{
+	int newfd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+
+	close(fd);
+	return newfd;
+}
+
+/* Starts a sandbox and serves it until it exits, returning its exit status
+ * (or -1 if it could not be started) */
+static int run_sandbox(struct bench_run *run)
+{
+	char sandbox[PATH_MAX + 16], preload[PATH_MAX + 32];
+	char *argv[] = { sandbox, (char *)opts.python, NULL };
+	char *envp[] = {
+		"PYTHONPATH=/usr/lib/sandbox",
+		"PYTHONDONTWRITEBYTECODE=1",
+		"PYTHONNOUSERSITE=1",
+		"PATH=/bin",
+		preload,
+		NULL
+	};
+	int topipe[2], frompipe[2], status;
+	char *line = NULL;
+	size_t linecap = 0;
+	FILE *in;
+	pid_t pid;
+
+	snprintf(sandbox, sizeof(sandbox), "%s/sandbox", base);
+	snprintf(preload, sizeof(preload), "LD_PRELOAD=%s/libsbpreload.so", base);
+
+	if (pipe(topipe) != 0 || pipe(frompipe) != 0) {
+		fprintf(stderr, "Unable to create pipes: %s\n", strerror(errno));
+		return -1;
+	}
+
+	topipe[0] = high_fd(topipe[0]);
+	topipe[1] = high_fd(topipe[1]);
+	frompipe[0] = high_fd(frompipe[0]);
+	frompipe[1] = high_fd(frompipe[1]);
+
+	run->init_ns = 0;
+	run->job_given = false;
+	run->job_status = 0;
+	run->start = now_ns();
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (pid == 0) {
+		// dup2() clears FD_CLOEXEC, so these are the only ends the sandbox gets
+		if (dup2(topipe[0], PIPEIN) < 0 || dup2(frompipe[1], PIPEOUT) < 0 || chdir("/tmp") != 0) {
+			_exit(127);
+		}
+
+		execve(sandbox, argv, envp);
+		fprintf(stderr, "Unable to run %s: %s\n", sandbox, strerror(errno));
+		_exit(127);
+	}
+
+	close(topipe[0]);
+	close(frompipe[1]);
+	in = fdopen(frompipe[0], "r");
+
+	while (getline(&line, &linecap, in) > 0) {
+		json_object *req = json_tokener_parse(line);
+		json_object *method, *params, *id, *data;
+		int err;
+
+		if (req == NULL || !json_object_object_get_ex(req, "method", &method)) {
+			fprintf(stderr, "sbbench: invalid request %s", line);
+			json_object_put(req);
+			break;
+		}
+
+		if (!json_object_object_get_ex(req, "params", &params)) {
+			params = NULL;
+		}
+
+		data = handle_call(run, json_object_get_string(method), params, &err);
+
+		// requests without an id are notifications, which are not answered
+		if (json_object_object_get_ex(req, "id", &id)) {
+			if (send_response(topipe[1], id, data, err) != 0) {
+				json_object_put(req);
+				break;
+			}
+		} else {
+			json_object_put(data);
+		}
+
+		json_object_put(req);
+	}
+
+	free(line);
+	fclose(in);
+	close(topipe[1]);
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t left = *(const uint64_t *)a, right = *(const uint64_t *)b;
+
+	return left < right ? -1 : left > right;
+}
+
+// nearest rank, the same as workload.py
+static uint64_t percentile(const uint64_t *sorted, size_t n, double fraction)
+{
+	size_t rank = (size_t)(fraction * n + 0.999999);
+
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void report(const char *name, uint64_t *samples, size_t n)
+{
+	json_object *result = json_object_new_object();
+	uint64_t total = 0;
+
+	qsort(samples, n, sizeof(uint64_t), compare_u64);
+	for (size_t i = 0; i < n; ++i) {
+		total += samples[i];
+	}
+
+	json_object_object_add(result, "bench", json_object_new_string(name));
+	json_object_object_add(result, "ops", json_object_new_int64((int64_t)n));
+	json_object_object_add(result, "p50_ns", json_object_new_int64((int64_t)percentile(samples, n, 0.5)));
+	json_object_object_add(result, "p99_ns", json_object_new_int64((int64_t)percentile(samples, n, 0.99)));
+	json_object_object_add(result, "ops_per_sec", json_object_new_double(total > 0 ? n * 1e9 / total : 0.0));
+	print_line(result);
+	json_object_put(result);
+}
+
+static void usage(const char *self)
+{
+	fprintf(stderr, "Usage: %s [-b base dir] [-p python] [-w workload.py] [-s shared object] [-n iterations]\n"
+		"\t[-r startup runs] [-m modules] [-e directory entries] [-a readahead] [-t] [-z] [-k]\n"
+		"  -b  directory holding sandbox, libsbpreload.so and lib/ (default .)\n"
+		"  -p  python the sandbox was built against, must be under /usr (default %s)\n"
+		"  -w  workload run as main.py (default <base>/bench/workload.py)\n"
+		"  -s  shared object to map, as seen from inside the sandbox (default: the largest\n"
+		"      extension module python has)\n"
+		"  -t  hand fixture files to the sandbox as fds (passthrough) instead of serving reads\n"
+		"  -z  run the sandbox as a zygote, with the workload as its only job\n"
+		"  -k  keep the fixture directory\n", self, BENCH_PYTHON);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_run run = { 0 };
+	uint64_t *samples;
+	size_t nsamples = 0;
+	int opt, ret = 1;
+
+	while ((opt = getopt(argc, argv, "b:p:w:s:n:r:m:e:a:tzk")) != -1) {
+		switch (opt) {
+		case 'b':
+			opts.base = optarg;
+			break;
+		case 'p':
+			opts.python = optarg;
+			break;
+		case 'w':
+			opts.workload = optarg;
+			break;
+		case 's':
+			opts.so = optarg;
+			break;
+		case 'n':
+			opts.iterations = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			opts.runs = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			opts.modules = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			opts.entries = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'a':
+			opts.readahead = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			opts.passthrough = true;
+			break;
+		case 'z':
+			opts.zygote = true;
+			break;
+		case 'k':
+			opts.keep = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (opts.iterations < 1 || opts.entries > 99999) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// the sandbox gets to see these, so they have to be absolute
+	if (realpath(opts.base, base) == NULL) {
+		fprintf(stderr, "Unable to find %s: %s\n", opts.base, strerror(errno));
+		return 1;
+	}
+
+	if (opts.workload == NULL) {
+		snprintf(workload, sizeof(workload), "%s/bench/workload.py", base);
+	} else if (realpath(opts.workload, workload) == NULL) {
+		fprintf(stderr, "Unable to find %s: %s\n", opts.workload, strerror(errno));
+		return 1;
+	}
+
+	if (make_fixture() != 0) {
+		goto cleanup;
+	}
+
+	created = json_object_new_array();
+
+	// cold startup: a fresh sandbox each time, which exits as soon as it is initialized
+	samples = (uint64_t *)calloc(opts.runs > 0 ? opts.runs : 1, sizeof(uint64_t));
+	for (unsigned int i = 0; i < opts.runs; ++i) {
+		run.full = false;
+		if (run_sandbox(&run) != 0 || run.init_ns == 0) {
+			fprintf(stderr, "Sandbox failed to start.\n");
+			free(samples);
+			goto cleanup;
+		}
+
+		samples[nsamples++] = run.init_ns;
+	}
+
+	if (nsamples > 0) {
+		report("startup", samples, nsamples);
+	}
+
+	free(samples);
+
+	// everything else is measured and reported by the workload itself
+	run.full = true;
+	ret = run_sandbox(&run);
+	if (ret != 0) {
+		fprintf(stderr, "Workload exited with %d.\n", ret);
+	} else if (failed) {
+		fprintf(stderr, "Some checks failed.\n");
+		ret = 1;
+	}
+
+cleanup:
+	if (opts.keep) {
+		fprintf(stderr, "Fixture left in %s\n", fixture);
+	} else {
+		remove_fixture();
+	}
+
+	json_object_put(created);
+	return ret;
+}
@@ -0,0 +1,163 @@
+# Benchmark workload, run as main.py by sbbench (see sbbench.c). Every benchmark times each
+# operation on its own and hands the results to sbbench with app.report, which prints them as a
+# line of JSON. /bench is the fixture sbbench creates for us.
+import math
+import os
+import sys
+import time
+
+from sandbox import trampoline
+
+FIXTURE = "/bench"
+CHUNK = 65536
+
+# stdlib modules to import, those already imported during startup are skipped
+MODULES = [
+    "argparse", "ast", "base64", "bisect", "calendar", "cmd", "colorsys", "configparser",
+    "contextlib", "copy", "csv", "datetime", "decimal", "difflib", "dis", "email.message",
+    "email.parser", "enum", "fnmatch", "fractions", "getopt", "gettext", "glob", "gzip",
+    "hashlib", "heapq", "hmac", "html", "html.parser", "inspect", "ipaddress", "json",
+    "logging", "mailbox", "mimetypes", "numbers", "optparse", "pathlib", "pickle", "pprint",
+    "queue", "quopri", "random", "shlex", "shutil", "statistics", "string", "stringprep",
+    "tarfile", "tempfile", "textwrap", "timeit", "tokenize", "trace", "urllib.parse", "uu",
+    "wave", "xml.dom.minidom", "xml.etree.ElementTree", "zipfile"
+]
+
+config = trampoline("benchconfig")
+clock = time.perf_counter
+
+# nearest rank, the same as sbbench.c
+def percentile(times, fraction):
+    return times[max(0, int(math.ceil(fraction * len(times))) - 1)]
+
+def report(name, times, elapsed, **extra):
+    times.sort()
+    result = {
+        "bench": name,
+        "ops": len(times),
+        "p50_ns": int(percentile(times, 0.5) * 1e9),
+        "p99_ns": int(percentile(times, 0.99) * 1e9),
+        "ops_per_sec": len(times) / elapsed if elapsed > 0 else 0.0
+    }
+    result.update(extra)
+    trampoline("report", result)
+
+# runs op(i) for every i in range(n), nbytes is how much each one reads
+def measure(name, n, op, nbytes=0, **extra):
+    times = []
+    start = clock()
+    for i in range(n):
+        t = clock()
+        op(i)
+        times.append(clock() - t)
+
+    elapsed = clock() - start
+    if nbytes:
+        extra["bytes_per_sec"] = nbytes * n / elapsed if elapsed > 0 else 0.0
+
+    report(name, times, elapsed, **extra)
+
+def bench_import(count):
+    import importlib
+
+    names = [name for name in MODULES if name not in sys.modules][:count]
+    times = []
+    failed = 0
+    start = clock()
+    for name in names:
+        t = clock()
+        try:
+            importlib.import_module(name)
+        except Exception:
+            failed += 1
+            continue
+
+        times.append(clock() - t)
+
+    elapsed = clock() - start
+    if times:
+        report("import", times, elapsed, failed=failed)
+
+# one trap through to the sandbox process and back, which answers it without touching the disk
+def bench_trap(n, files):
+    fd = os.open(files[0], os.O_RDONLY)
+    try:
+        measure("trap_fstat", n, lambda i: os.fstat(fd))
+    finally:
+        os.close(fd)
+
+def bench_open(n, files):
+    measure("open_close", n, lambda i: os.close(os.open(files[i % len(files)], os.O_RDONLY)))
+
+def bench_stat(n, files):
+    measure("stat", n, lambda i: os.stat(files[i % len(files)]))
+
+def bench_read(n, files):
+    size = os.stat(files[0]).st_size
+
+    def read_file(i):
+        fd = os.open(files[i % len(files)], os.O_RDONLY)
+        try:
+            while os.read(fd, CHUNK):
+                pass
+        finally:
+            os.close(fd)
+
+    measure("read_file", n, read_file, nbytes=size)
+
+    fd = os.open(os.path.join(FIXTURE, "data.bin"), os.O_RDONLY)
+
+    def read_chunk(i):
+        if len(os.read(fd, CHUNK)) < CHUNK:
+            os.lseek(fd, 0, os.SEEK_SET)
+
+    try:
+        measure("read_64k", n, read_chunk, nbytes=CHUNK)
+    finally:
+        os.close(fd)
+
+# listing the whole of a large directory, which is far slower than anything above
+def bench_getdents(n):
+    path = os.path.join(FIXTURE, "bigdir")
+    entries = len(os.listdir(path))
+    measure("getdents", max(10, n // 20), lambda i: os.listdir(path), entries=entries)
+
+# the largest extension module which is not loaded yet
+def find_so():
+    import sysconfig
+
+    libdir = sysconfig.get_config_var("DESTSHARED")
+    found, found_size = None, -1
+    for name in os.listdir(libdir):
+        if not name.endswith(".so") or name.split(".", 1)[0] in sys.modules:
+            continue
+
+        size = os.stat(os.path.join(libdir, name)).st_size
+        if size > found_size:
+            found, found_size = os.path.join(libdir, name), size
+
+    return found
+
+# loading a shared object the way the dynamic loader does it, which maps it from the file
+def bench_mmap(n):
+    import _ctypes
+
+    path = config["so"] or find_so()
+    if path is None:
+        return
+
+    mode = os.RTLD_NOW | os.RTLD_LOCAL
+    measure("mmap_so", max(10, n // 10), lambda i: _ctypes.dlclose(_ctypes.dlopen(path, mode)),
+            path=path, size=os.stat(path).st_size)
+
+if config["mode"] == "full":
+    n = config["iterations"]
+    # first, so that the other benchmarks don't import the modules for us
+    bench_import(config["modules"])
+    files = [os.path.join(FIXTURE, "files", name) for name in sorted(os.listdir(os.path.join(FIXTURE, "files")))]
+    bench_trap(n, files)
+    bench_open(n, files)
+    bench_stat(n, files)
+    bench_read(n, files)
+    bench_getdents(n)
+    bench_mmap(n)
@@ -1,7 +1,9 @@
 import json
-import base64
+import os
+import struct
 import sys
 import errno
+import _sandbox
 
 __all__ = []
 
@@ -33,23 +35,28 @@ EXCEPTION_MAP = {
     14: ZeroDivisionError
 }
 
-# Pipes to the parent process
-_pipein = open(3, mode="rt", buffering=1, closefd=False)
-_pipeout = open(4, mode="wt", buffering=1, closefd=False)
+# Socket to the parent process; each request and response is a single datagram
+RPCSOCK = 3
+_request_header = struct.Struct("=hHH")
+_response_header = struct.Struct("=iiI")
 
 # Function to send a request to the parent process and get the response back
-# We use JSON to serialize values back and forth
+# Requests are a header (namespace, name length, argument length) followed by the
+# NULL terminated name and a JSON array of arguments. Responses are the return code,
+# errno and our stat cache epoch followed by the returned data as JSON.
 def trampoline(name, *args, ns=NS_APP):
-    obj = {"ns": ns, "name": name, "args": list(args)}
-    serialized = json.dumps(obj, separators=(",", ":"))
-    _pipeout.write(serialized + "\n")
-    response = _pipein.readline()
-    if response == "":
+    fname = name.encode("utf-8") + b"\0"
+    serialized = json.dumps(list(args), separators=(",", ":")).encode("utf-8")
+    header = _request_header.pack(ns, len(fname), len(serialized))
+    os.write(RPCSOCK, header + fname + serialized)
+    response = os.read(RPCSOCK, _response_header.size + 65536)
+    if len(response) < _response_header.size:
         sys.exit(-errno.EIO)
-    obj = json.loads(response)
-    data = obj.get("data")
-    if obj.get("base64", False) is True:
-        data = base64.b64decode(data, validate=True)
+    code, err, epoch = _response_header.unpack_from(response)
+    # the parent moves it on when the call may have changed the files it answers for
+    _sandbox.epoch(epoch)
+    obj = {"code": code, "errno": err}
+    data = json.loads(response[_response_header.size:].decode("utf-8"))
     if ns == NS_SYS:
         if obj["code"] == -1 and obj.get("errno", 0) != 0:
             raise OSError(obj["errno"], data)
@@ -80,3 +87,12 @@ def trampoline(name, *args, ns=NS_APP):
 
 def complete_init():
     trampoline("complete_init", ns=NS_SB)
+
+# Call statistics the sandbox process recorded so far (for every process it serves): the
+# syscalls it answered and the calls it made to the overall parent, by name
+def getstats():
+    return trampoline("getstats", ns=NS_SB)
+
+# resolve imports from the parent's manifest from now on, see finder.py
+from sandbox import finder
+finder.install()
@@ -0,0 +1,88 @@
+# Meta path finder backed by a manifest of importable files supplied by the parent
+#
+# The regular path finder stats and lists every sys.path entry for every import, and each of
+# those calls is trapped and forwarded to the parent. The parent already knows what lives in
+# the directories it exposes to us, so instead we ask it for a listing of each directory once
+# (sb.manifest) and resolve imports from that; only the files actually loaded are touched.
+# Directories the parent cannot vouch for come back as None and are left to the regular
+# finder for that path entry.
+
+import sys
+from importlib.machinery import PathFinder, EXTENSION_SUFFIXES, SOURCE_SUFFIXES, BYTECODE_SUFFIXES
+from importlib.util import spec_from_file_location
+
+from sandbox import trampoline, NS_SB
+
+__all__ = ["ManifestFinder", "install"]
+
+# same order FileFinder tries them in
+_SUFFIXES = EXTENSION_SUFFIXES + SOURCE_SUFFIXES + BYTECODE_SUFFIXES
+
+class ManifestFinder:
+    def __init__(self):
+        # directory -> {name: 1 if directory else 0}, or None if unknown
+        self._listings = {}
+
+    def invalidate_caches(self):
+        self._listings.clear()
+
+    def _fetch(self, dirs):
+        missing = [d for d in dirs if d not in self._listings]
+        if not missing:
+            return
+        # relative entries ('' for the cwd) can change meaning, never ask about those
+        for d in missing:
+            self._listings[d] = None
+        remote = [d for d in missing if d.startswith("/")]
+        if remote:
+            self._listings.update(trampoline("manifest", remote, ns=NS_SB))
+
+    def _listing(self, d):
+        self._fetch([d])
+        return self._listings[d]
+
+    def find_spec(self, fullname, path=None, target=None):
+        if path is None:
+            path = sys.path
+        entries = [e for e in path if isinstance(e, str)]
+        self._fetch(entries)
+        tail = fullname.rpartition(".")[2]
+
+        for entry in entries:
+            listing = self._listings[entry]
+            if listing is None:
+                # we can't say what is in here (the stdlib archive, for one), so ask the finder
+                # PathFinder would use for just this entry and carry on with the rest if it
+                # doesn't know the module either
+                spec = PathFinder._get_spec(fullname, [entry], target)
+                if spec is not None and spec.loader is not None:
+                    return spec
+                continue
+
+            base = entry.rstrip("/") + "/" + tail
+            if listing.get(tail) == 1:
+                pkg = self._listing(base)
+                if pkg is None:
+                    return None
+                for suffix in _SUFFIXES:
+                    if pkg.get("__init__" + suffix) == 0:
+                        return spec_from_file_location(fullname, base + "/__init__" + suffix,
+                                                       submodule_search_locations=[base])
+                # possibly part of a namespace package, but a regular module further on still wins
+
+            for suffix in _SUFFIXES:
+                if listing.get(tail + suffix) == 0:
+                    return spec_from_file_location(fullname, base + suffix)
+
+        # a miss (or a namespace package) goes on to PathFinder, so that the answer is the
+        # same as it would have been without us; misses are rare compared to hits
+        return None
+
+def install():
+    """Inserts the manifest finder just ahead of PathFinder in sys.meta_path"""
+    for i, finder in enumerate(sys.meta_path):
+        if isinstance(finder, ManifestFinder):
+            return
+        if finder is PathFinder:
+            sys.meta_path.insert(i, ManifestFinder())
+            return
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+"""Builds a stdlib archive for the sandbox (see the StdlibArchive configuration option).
+
+Usage: mkbundle.py OUTPUT [DIR ...]
+
+Compiles the standard library of the interpreter running this script, along with any
+additional directories given (site-packages, for example), and stores the bytecode
+uncompressed in a zip file which zipimport can load. The sandbox serves the whole archive
+as a single file, so imports from it need no further lookups or reads from the parent.
+
+Run this with the same interpreter the sandbox embeds, bytecode is specific to its version.
+Extension modules (.so) cannot be imported from an archive and are left out; they are
+still found in lib-dynload as usual.
+"""
+
+import importlib.util
+import marshal
+import os
+import sys
+import sysconfig
+import zipfile
+
+# must match SB_ARCHIVE_NAME in sbcontext.h, this is where the child sees the archive
+ARCHIVE_PATH = "/sandbox-stdlib.zip"
+
+# parts of the stdlib which are of no use in the sandbox, or which are third party code
+SKIP_DIRS = {"__pycache__", "site-packages", "dist-packages", "test", "tests", "idle_test",
+             "idlelib", "tkinter", "turtledemo", "ensurepip", "venv"}
+
+def bytecode(code):
+    # the header zipimport expects: magic, then (3.7+) flags, then source mtime and size;
+    # there is no source in the archive so the last two are never checked
+    header = importlib.util.MAGIC_NUMBER
+    if sys.version_info >= (3, 7):
+        header += b"\0\0\0\0"
+    return header + b"\0\0\0\0\0\0\0\0" + marshal.dumps(code)
+
+def add_tree(archive, base, seen):
+    for dirpath, dirnames, filenames in os.walk(base):
+        dirnames[:] = sorted(d for d in dirnames if d not in SKIP_DIRS)
+        for filename in sorted(filenames):
+            if not filename.endswith(".py"):
+                continue
+
+            source = os.path.join(dirpath, filename)
+            arcname = os.path.relpath(source, base)[:-3] + ".pyc"
+            if arcname in seen:
+                # an earlier directory already provides this module, like on sys.path
+                continue
+
+            try:
+                with open(source, "rb") as f:
+                    code = compile(f.read(), os.path.join(ARCHIVE_PATH, arcname[:-1]), "exec",
+                                   dont_inherit=True)
+            except (SyntaxError, ValueError, UnicodeDecodeError) as e:
+                print("skipping {}: {}".format(source, e), file=sys.stderr)
+                continue
+
+            seen.add(arcname)
+            # a fixed timestamp keeps the archive identical across rebuilds
+            info = zipfile.ZipInfo(arcname, (1980, 1, 1, 0, 0, 0))
+            info.compress_type = zipfile.ZIP_STORED
+            archive.writestr(info, bytecode(code))
+
+def main(argv):
+    if len(argv) < 2:
+        print(__doc__.strip(), file=sys.stderr)
+        return 2
+
+    output = argv[1]
+    dirs = [sysconfig.get_paths()["stdlib"]] + argv[2:]
+    seen = set()
+
+    with zipfile.ZipFile(output + ".tmp", "w", zipfile.ZIP_STORED) as archive:
+        for d in dirs:
+            add_tree(archive, d, seen)
+
+    # sandboxes already running keep the archive they opened
+    os.replace(output + ".tmp", output)
+    print("{}: {} modules".format(output, len(seen)))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
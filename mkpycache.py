@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+"""Compiles queued entries for the sandbox bytecode cache (see the BytecodeCacheDir configuration option).
+
+Usage: mkpycache.py CACHEDIR [--watch SECONDS]
+
+Sandboxes cannot write bytecode, so the supervisor serves __pycache__ out of CACHEDIR and
+queues whatever it did not find there in CACHEDIR/queue. This compiles each queued source
+into its entry and removes it from the queue; with --watch it keeps doing so every SECONDS.
+
+Run this with the same interpreter the sandbox embeds and as a user the sandbox is not,
+since sandboxed code gets to run whatever ends up in the cache. Requests naming a different
+interpreter's cache tag are dropped, as are requests whose source no longer matches.
+
+CACHEDIR is created if needed. The supervisor refuses it unless it belongs to another user
+and is not writable by the sandbox user; queue/ is made writable by everyone (sticky, mode
+1733) so that sandboxes can queue requests. Make it 1730 and give it the sandbox user's
+group to limit that to the sandbox user, or 0755 to only serve what is compiled already.
+"""
+
+import importlib.util
+import marshal
+import os
+import struct
+import sys
+import time
+
+def cache_key(variant, source, st):
+    # must match pycache_key() in sbpycache.c: FNV-1a over the variant (NUL terminated),
+    # the mtime and size as they appear in the .pyc header, then the source itself
+    h = 14695981039346656037
+    data = variant.encode("utf-8") + b"\0"
+    data += struct.pack("<II", int(st.st_mtime) & 0xFFFFFFFF, st.st_size & 0xFFFFFFFF)
+    for b in data + source:
+        h = ((h ^ b) * 1099511628211) & 0xFFFFFFFFFFFFFFFF
+    return "{:016x}".format(h)
+
+def optimization(variant):
+    # cpython-35.pyc, cpython-35.opt-1.pyc, ...; None if not meant for this interpreter
+    parts = variant.split(".")
+    if parts[0] != sys.implementation.cache_tag or parts[-1] != "pyc":
+        return None
+    if len(parts) == 2:
+        return 0
+    if len(parts) == 3 and parts[1] in ("opt-1", "opt-2"):
+        return int(parts[1][-1])
+    return None
+
+def compile_entry(cachedir, key):
+    request = os.path.join(cachedir, "queue", key)
+    try:
+        with open(request, "r", encoding="utf-8") as f:
+            variant, path = f.read().split("\n")[:2]
+        with open(path, "rb") as f:
+            st = os.fstat(f.fileno())
+            source = f.read()
+    except (OSError, ValueError):
+        return False
+    finally:
+        try:
+            os.unlink(request)
+        except OSError:
+            pass
+
+    optimize = optimization(variant)
+    if optimize is None or cache_key(variant, source, st) != key:
+        return False
+
+    try:
+        code = compile(source, path, "exec", dont_inherit=True, optimize=optimize)
+    except (SyntaxError, ValueError):
+        # the sandbox reports the error itself when it compiles the source
+        return False
+
+    header = importlib.util.MAGIC_NUMBER
+    if sys.version_info >= (3, 7):
+        header += b"\0\0\0\0"
+    header += struct.pack("<II", int(st.st_mtime) & 0xFFFFFFFF, st.st_size & 0xFFFFFFFF)
+
+    # entries are replaced atomically, sandboxes only ever see complete ones
+    entry = os.path.join(cachedir, key + ".pyc")
+    tmp = "{}.{}.tmp".format(entry, os.getpid())
+    with open(tmp, "wb") as f:
+        f.write(header + marshal.dumps(code))
+    os.chmod(tmp, 0o444)
+    os.replace(tmp, entry)
+    return True
+
+# sets up CACHEDIR for a first run, leaving existing directories as they are
+def create(cachedir):
+    os.makedirs(cachedir, mode=0o755, exist_ok=True)
+    queue = os.path.join(cachedir, "queue")
+    try:
+        os.mkdir(queue)
+    except FileExistsError:
+        return
+    # mkdir applies the umask
+    os.chmod(queue, 0o1733)
+
+def run(cachedir):
+    compiled = 0
+    for key in os.listdir(os.path.join(cachedir, "queue")):
+        if compile_entry(cachedir, key):
+            compiled += 1
+    return compiled
+
+def main(argv):
+    if len(argv) not in (2, 4) or (len(argv) == 4 and argv[2] != "--watch"):
+        print(__doc__.strip(), file=sys.stderr)
+        return 2
+
+    cachedir = argv[1]
+    create(cachedir)
+    if len(argv) == 2:
+        print("{} entries compiled".format(run(cachedir)))
+        return 0
+
+    interval = float(argv[3])
+    while True:
+        run(cachedir)
+        time.sleep(interval)
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -7,6 +7,9 @@
 #include <sys/resource.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sched.h>
 #include <ucontext.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -16,16 +19,20 @@
 #include <execinfo.h>
 #include <dlfcn.h>
 #include <dirent.h>
+#include <json/json.h>
 
 #include "sbcontext.h"
 #include "sblibc.h"
 
 void sigsys_handler(int signal, siginfo_t *info, void *context);
+static int run_zygote(scmp_filter_ctx job_ctx);
+static void report_stats(void);
+static PyObject *init_sandbox_module(void);
 
 int run_child()
 {
 	int ret = -1;
-	unsigned long limits[2] = {0};
+	unsigned int limits[5] = {0};
 	int vpathsz = 0;
 	char *vpath = NULL;
 	struct rlimit rl;
@@ -33,6 +40,7 @@ int run_child()
 	size_t programlen = 0;
 	FILE *mainpy = NULL;
 	scmp_filter_ctx ctx = NULL;
+	scmp_filter_ctx job_ctx = NULL;
 
 #ifdef SB_DEBUG
 	// not used, it's here to force loading of the relevant .sos before the sandbox inits
@@ -48,7 +56,8 @@ int run_child()
 	if (ret != sizeof(limits))
 		goto cleanup;
 
-	debug_print("Got %lu memory and %lu cpu\n", limits[0], limits[1]);
+	debug_print("Got %u memory and %u cpu%s%s\n", limits[0], limits[1], limits[2] ? " (zygote)" : "",
+		limits[3] ? " (stdlib archive)" : "");
 
 	if (limits[0] == 0)
 		limits[0] = DEF_MEMORY;
@@ -56,6 +65,8 @@ int run_child()
 	if (limits[1] == 0)
 		limits[1] = DEF_CPU;
 
+	readahead_max = limits[4] < SB_READ_MAX ? limits[4] : SB_READ_MAX;
+
 	// set resource limits, we limit our address space and cpu, and disable core dumps
 	rl.rlim_cur = limits[0];
 	rl.rlim_max = limits[0];
@@ -75,12 +86,30 @@ int run_child()
 	if (ret < 0)
 		goto cleanup;
 
+	// fds granted by our parent live just below this limit
+	rl.rlim_cur = SB_GRANT_FD_MIN + SB_GRANT_FDS;
+	rl.rlim_max = SB_GRANT_FD_MIN + SB_GRANT_FDS;
+	ret = setrlimit(RLIMIT_NOFILE, &rl);
+	if (ret < 0)
+		goto cleanup;
+
+	// granted fds are received at the lowest free fd, which needs to be SB_TRANSIT_FD;
+	// make sure nothing below it is free and that it is free itself
+	for (int fd = 0; fd < RPCSOCK; ++fd) {
+		if (fcntl(fd, F_GETFD) < 0 && open("/dev/null", O_RDWR) != fd) {
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	close(SB_TRANSIT_FD);
+
 	// set up our SIGSYS handler; any disallowed syscalls are trapped by this handler
 	// and sent up to the parent to process.
 	struct sigaction sa;
 	sigset_t mask;
 	// Allow other signals to interrupt our signal handler, including signals from ourself in case we implement
-	// a syscall by making other syscalls (our mmap implementation operates this way).
+	// a syscall by making other syscalls.
 	// This means that if the handler tries to make an invalid syscall, it will recurse until it
 	// fills up the stack space and crashes.
 	sigemptyset(&mask);
@@ -94,25 +123,56 @@ int run_child()
 	 * - read(), readv() - fd 3 only
 	 * - write(), writev() - fd 3 only (also stdout and stderr if in debug mode)
 	 * - fstat(), fcntl(F_GETFD), fcntl(F_GETFL) - fd 3 only
+	 * - recvmsg() - fd 3 only, used to receive responses that may carry granted fds
+	 * - read(), readv(), pread64(), lseek(), fstat(), close(), fcntl(F_GETFD/F_SETFD/F_GETFL) -
+	 *   fds in the grant range, these are real read-only files opened by our parent
+	 * - dup3(), close() - moving a granted fd out of SB_TRANSIT_FD into the grant range
 	 * Memory:
 	 * - mmap(MAP_ANONYMOUS | MAP_PRIVATE) - new mappings that don't read from fds,
 	 *   this still allows the application to choose a memory address, but this is unfortunately required
 	 *   in order for dlopen() to work (as that makes use of MAP_FIXED)
+	 * - mmap(MAP_PRIVATE) - fds in the grant range, so shared libraries are mapped straight from the file
+	 *   (files our parent serves are granted to us for the duration of the mmap call, see SYS(mmap))
 	 * - brk() - memory allocation (we have setrlimit to keep this in check)
 	 * - munmap() - deallocation
-	 * - mprotect() - changing protection (used by our implementation of mmap for fds)
+	 * - mprotect() - changing protection (used by the dynamic loader)
 	 * Signal Handlers:
 	 * - sigreturn(), rt_sigreturn(), rt_sigprocmask(), sigaltstack()
 	 * - rt_sigaction() - can retrieve all signals (2nd param NULL), cannot set handler for SIGSYS
 	 * Misc:
 	 * - getrusage(RUSAGE_SELF) - used for profiling purposes
-	 * - tgkill() - Called by Python internals
+	 * - clock_gettime() - timing the syscalls we trap (see sbstats.c), normally the vDSO answers
+	 *   this without making a syscall, but not every clocksource allows that
+	 * - tgkill() - Called by Python internals, and by raise() and abort(); only to signal ourselves
+	 *   (in zygote mode the job filter pins it to the job instead, as it is forked after this is loaded)
+	 * - getpid(), gettid() - raise() and abort() look these up to signal themselves
 	 * - futex() - dlsym() needs this, python threading probably does too
 	 * - uname() - should be no harm in revealing kernel version info as it should be kept patched anyway,
 	 *   only info leak would be from the nodename/domainname fields. If hiding that is important,
 	 *   open an issue on github and I can supply a compiler flag to pass uname calls to the parent instead.
 	 * - exit(), exit_group() - so program can terminate
+	 * Zygote mode only:
+	 * - clone() - without CLONE_VM or CLONE_THREAD, i.e. fork() but not threads
+	 * - wait4() - waiting for a job to finish
+	 * - seccomp(), prctl(PR_SET_NO_NEW_PRIVS), prctl(PR_SET_SECCOMP) - each job loads
+	 *   an additional filter (built below, while we can still freely allocate) which traps all of
+	 *   the above, and tgkill() on anything but the job itself (added once its pid is known)
 	 */
+	if (limits[2]) {
+		job_ctx = seccomp_init(SCMP_ACT_ALLOW);
+		if (job_ctx == NULL)
+			goto cleanup;
+
+#define SB_JOB_TRAP(sys) ret = seccomp_rule_add(job_ctx, SCMP_ACT_TRAP, SCMP_SYS(sys), 0); if (ret < 0) goto cleanup
+
+		SB_JOB_TRAP(clone);
+		SB_JOB_TRAP(wait4);
+		SB_JOB_TRAP(seccomp);
+		SB_JOB_TRAP(prctl);
+
+#undef SB_JOB_TRAP
+	}
+
 	ctx = seccomp_init(SCMP_ACT_TRAP);
 
 	if (ctx == NULL)
@@ -127,6 +187,23 @@ int run_child()
 	SB_RULE(fstat, 1, SCMP_A0(SCMP_CMP_EQ, RPCSOCK));
 	SB_RULE(fcntl, 2, SCMP_A0(SCMP_CMP_EQ, RPCSOCK), SCMP_A1(SCMP_CMP_EQ, F_GETFD));
 	SB_RULE(fcntl, 2, SCMP_A0(SCMP_CMP_EQ, RPCSOCK), SCMP_A1(SCMP_CMP_EQ, F_GETFL));
+	SB_RULE(recvmsg, 1, SCMP_A0(SCMP_CMP_EQ, RPCSOCK));
+
+#define SB_GRANTED(arg) arg(SCMP_CMP_MASKED_EQ, ~(scmp_datum_t)(SB_GRANT_FDS - 1), SB_GRANT_FD_MIN)
+	SB_RULE(read, 1, SB_GRANTED(SCMP_A0));
+	SB_RULE(readv, 1, SB_GRANTED(SCMP_A0));
+	SB_RULE(pread64, 1, SB_GRANTED(SCMP_A0));
+	SB_RULE(preadv, 1, SB_GRANTED(SCMP_A0));
+	SB_RULE(lseek, 1, SB_GRANTED(SCMP_A0));
+	SB_RULE(fstat, 1, SB_GRANTED(SCMP_A0));
+	SB_RULE(close, 1, SB_GRANTED(SCMP_A0));
+	SB_RULE(fcntl, 2, SB_GRANTED(SCMP_A0), SCMP_A1(SCMP_CMP_EQ, F_GETFD));
+	SB_RULE(fcntl, 2, SB_GRANTED(SCMP_A0), SCMP_A1(SCMP_CMP_EQ, F_SETFD));
+	SB_RULE(fcntl, 2, SB_GRANTED(SCMP_A0), SCMP_A1(SCMP_CMP_EQ, F_GETFL));
+	SB_RULE(mmap, 2, SB_GRANTED(SCMP_A4), SCMP_A3(SCMP_CMP_MASKED_EQ, MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS, MAP_PRIVATE));
+	SB_RULE(dup3, 2, SCMP_A0(SCMP_CMP_EQ, SB_TRANSIT_FD), SB_GRANTED(SCMP_A1));
+	SB_RULE(close, 1, SCMP_A0(SCMP_CMP_EQ, SB_TRANSIT_FD));
+#undef SB_GRANTED
 
 #ifdef SB_DEBUG
 	// if debugging, allow sandbox to write to stdout and stderr
@@ -149,10 +226,26 @@ int run_child()
 	SB_RULE(futex, 0);
 	SB_RULE(uname, 0);
 	SB_RULE(getrusage, 1, SCMP_A0(SCMP_CMP_EQ, RUSAGE_SELF));
-	SB_RULE(tgkill, 1, SCMP_A0(SCMP_CMP_EQ, getpid()));
+	SB_RULE(clock_gettime, 0);
+	SB_RULE(getpid, 0);
+	SB_RULE(gettid, 0);
+	if (limits[2]) {
+		SB_RULE(tgkill, 0);
+	} else {
+		SB_RULE(tgkill, 1, SCMP_A0(SCMP_CMP_EQ, getpid()));
+	}
+
 	SB_RULE(exit_group, 0);
 	SB_RULE(exit, 0);
 
+	if (limits[2]) {
+		SB_RULE(clone, 1, SCMP_A0(SCMP_CMP_MASKED_EQ, CLONE_VM | CLONE_THREAD, 0));
+		SB_RULE(wait4, 0);
+		SB_RULE(seccomp, 0);
+		SB_RULE(prctl, 1, SCMP_A0(SCMP_CMP_EQ, PR_SET_NO_NEW_PRIVS));
+		SB_RULE(prctl, 1, SCMP_A0(SCMP_CMP_EQ, PR_SET_SECCOMP));
+	}
+
 	ret = seccomp_load(ctx);
 	if (ret < 0)
 		goto cleanup;
@@ -191,9 +284,36 @@ int run_child()
 		goto cleanup;
 	}
 
+	// the stdlib archive goes after whatever PYTHONPATH already has, so that those still win,
+	// but ahead of the stdlib directories python adds itself; everything it holds is then
+	// imported out of the one file instead of being looked up and read piece by piece
+	if (limits[3]) {
+		const char *pythonpath = getenv("PYTHONPATH");
+		char *newpath = NULL;
+
+		if (pythonpath != NULL && pythonpath[0] != '\0') {
+			ret = asprintf(&newpath, "%s:/%s", pythonpath, SB_ARCHIVE_NAME);
+		} else {
+			ret = asprintf(&newpath, "/%s", SB_ARCHIVE_NAME);
+		}
+
+		if (ret < 0 || setenv("PYTHONPATH", newpath, 1) != 0) {
+			ret = -1;
+			fprintf(stderr, "Cannot add stdlib archive to PYTHONPATH.\n");
+			free(newpath);
+			goto cleanup;
+		}
+
+		free(newpath);
+	}
+
 	Py_SetProgramName(program);
+	PyImport_AppendInittab("_sandbox", init_sandbox_module);
 	Py_Initialize();
 
+	// also run when main.py calls sys.exit(), which does not come back here
+	Py_AtExit(report_stats);
+
 	// optional user init code
 	mainpy = fopen("init.py", "r");
 	if (mainpy != NULL) {
@@ -239,6 +359,15 @@ int run_child()
 	Py_DECREF(complete_init);
 	Py_DECREF(sandbox);
 
+	// in zygote mode, we only continue past here in a freshly forked job process
+	if (limits[2]) {
+		ret = run_zygote(job_ctx);
+		if (ret != 0) {
+			ret = ret < 0 ? ret : 0;
+			goto cleanup;
+		}
+	}
+
 	// at this point, init is complete and we can begin to run user code.
 	// The parent is expected to provide a /tmp/main.py file for this.
 	mainpy = fopen("main.py", "r");
@@ -255,14 +384,139 @@ cleanup:
 	free(program);
 	free(vpath);
 	seccomp_release(ctx);
+	seccomp_release(job_ctx);
 
 	return -ret;
 }
 
+/* Hands out jobs until our parent says there are none left. Each job gets a fresh fork of
+ * the (already initialized) interpreter which goes on to run main.py. Returns 0 in the job
+ * process, 1 in the zygote once there are no jobs left, and -1 on error.
+ */
+static int run_zygote(scmp_filter_ctx job_ctx)
+{
+	struct sigaction sa;
+	json_object *job = NULL;
+	json_object *args = NULL;
+	pid_t pid;
+	int ret, status;
+
+	// the SIGCHLD handler from sandbox.c would reap our jobs before we can get their status
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	for (;;) {
+		// any value other than null means there is a job to run
+		job = NULL;
+		ret = sbcall(&job, NS_SB, "getjob", json_object_new_array());
+		if (ret != 0) {
+			json_object_put(job);
+			return -1;
+		}
+
+		if (job == NULL) {
+			return 1;
+		}
+
+		json_object_put(job);
+
+#if PY_VERSION_HEX >= 0x03070000
+		PyOS_BeforeFork();
+#endif
+		pid = fork();
+		if (pid == 0) {
+#if PY_VERSION_HEX >= 0x03070000
+			PyOS_AfterFork_Child();
+#else
+			PyOS_AfterFork();
+#endif
+			// jobs may not fork off anything of their own, nor signal anyone else
+			if (seccomp_rule_add(job_ctx, SCMP_ACT_TRAP, SCMP_SYS(tgkill), 1, SCMP_A0(SCMP_CMP_NE, getpid())) < 0
+				|| seccomp_load(job_ctx) < 0)
+			{
+				exit(EPERM);
+			}
+
+			// each job reports its own numbers, the zygote's are not part of them
+			stats_reset();
+
+			return 0;
+		}
+
+#if PY_VERSION_HEX >= 0x03070000
+		PyOS_AfterFork_Parent();
+#endif
+		if (pid < 0) {
+			return -1;
+		}
+
+		while (waitpid(pid, &status, 0) < 0) {
+			if (errno != EINTR) {
+				return -1;
+			}
+		}
+
+		// same encoding sandbox.c uses when reporting our own exit
+		if (WIFSIGNALED(status)) {
+			status = -WTERMSIG(status);
+		} else {
+			status = WEXITSTATUS(status);
+		}
+
+		args = json_object_new_array();
+		json_object_array_add(args, json_object_new_int(status));
+		ret = sbcall(NULL, NS_SB, "jobdone", args);
+		if (ret != 0) {
+			return -1;
+		}
+	}
+}
+
+/* Sends what we recorded about our syscalls to our parent on the way out, which passes it on
+ * to the overall parent (see sb.stats) */
+static void report_stats(void)
+{
+	json_object *args = json_object_new_array();
+
+	stats_print("child");
+	json_object_array_add(args, stats_json());
+	sbcall(NULL, NS_SB, "stats", args);
+}
+
+/* _sandbox.epoch(n), for sandbox.trampoline() which talks to our parent without going through
+ * sbcall: hands the stat cache the epoch that came with a response */
+static PyObject *sandbox_epoch(PyObject *self, PyObject *args)
+{
+	unsigned int epoch;
+
+	if (!PyArg_ParseTuple(args, "I", &epoch)) {
+		return NULL;
+	}
+
+	scache_epoch(epoch);
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef sandbox_methods[] = {
+	{ "epoch", sandbox_epoch, METH_VARARGS, NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef sandbox_module = {
+	PyModuleDef_HEAD_INIT, "_sandbox", NULL, -1, sandbox_methods
+};
+
+static PyObject *init_sandbox_module(void)
+{
+	return PyModule_Create(&sandbox_module);
+}
+
 void sigsys_handler(int signal, siginfo_t *siginfo, void *void_ctx)
 {
-	const char *name;
-	int found = 0, i;
+	const struct sys_arg_map *map;
+	uint64_t start;
+	int err;
 	// SB_P*(ctx) can be used to get first 6 params passed to syscall (P1-P6)
 	ucontext_t *ctx = (ucontext_t *)void_ctx;
 #ifdef SB_DEBUG
@@ -287,22 +541,21 @@ void sigsys_handler(int signal, siginfo_t *siginfo, void *void_ctx)
 		exit(SIGSYS);
 	}
 
-	name = syscalls[siginfo->si_syscall];
-	for (i = 0; arg_map[i].sys != NULL; ++i) {
-		if (!strcmp(name, arg_map[i].sys)) {
-			found = 1;
-			break;
-		}
-	}
+	map = &arg_map[siginfo->si_syscall];
+	if (map->func != NULL) {
+		start = stats_now();
+		stats_bytes = 0;
+		SB_RET(ctx) = dispatch(map->func, SB_P1(ctx), SB_P2(ctx), SB_P3(ctx), SB_P4(ctx), SB_P5(ctx), SB_P6(ctx));
 
-	if (found) {
-		SB_RET(ctx) = dispatch(arg_map[i].func, SB_P1(ctx), SB_P2(ctx), SB_P3(ctx), SB_P4(ctx), SB_P5(ctx), SB_P6(ctx));
+		err = errno;
+		stats_record(stats_syscall(siginfo->si_syscall), start, stats_bytes);
+		errno = err;
 		return;
 	}
 
 #ifdef SB_DEBUG	
 	fprintf(stderr, "Syscall not implemented %s(%lld, %lld, %lld, %lld, %lld, %lld)\n",
-		name, SB_P1(ctx), SB_P2(ctx), SB_P3(ctx), SB_P4(ctx), SB_P5(ctx), SB_P6(ctx));
+		syscalls[siginfo->si_syscall], SB_P1(ctx), SB_P2(ctx), SB_P3(ctx), SB_P4(ctx), SB_P5(ctx), SB_P6(ctx));
 	fputs("Backtrace:\n", stderr);
 	n = backtrace(buffer, 32);
 	backtrace_symbols_fd(buffer, n, STDERR_FILENO);
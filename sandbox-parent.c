@@ -1,4 +1,6 @@
+#include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
@@ -7,8 +9,12 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #include <dirent.h>
-#include <fnmatch.h>
 #include <errno.h>
 #include <signal.h>
 #include <fcntl.h>
@@ -18,25 +24,109 @@
 #include "sblibc.h"
 
 struct sbfs_node root;
-struct sbfs_node proxy;
-struct sbfs_fd fds[MAX_FDS];
-
-static struct sbfs_node sb_stdin = { "stdin", NULL, NULL, NULL, NULL, NULL, SBFS_NOCLOSE };
-static struct sbfs_node sb_stdout = { "stdout", NULL, NULL, NULL, NULL, NULL, SBFS_WRITABLE | SBFS_NOCLOSE };
-static struct sbfs_node sb_stderr = { "stderr", NULL, NULL, NULL, NULL, NULL, SBFS_WRITABLE | SBFS_NOCLOSE };
-
+struct sb_child *current_child = NULL;
+unsigned int nchildren = 0;
+int grant_fd = -1;
+int reply_cache = SB_CACHE_NONE;
+
+static struct sbfs_node sb_stdin = { .name = "stdin", .flags = SBFS_NOCLOSE };
+static struct sbfs_node sb_stdout = { .name = "stdout", .flags = SBFS_WRITABLE | SBFS_NOCLOSE };
+static struct sbfs_node sb_stderr = { .name = "stderr", .flags = SBFS_WRITABLE | SBFS_NOCLOSE };
+
+// used to sort declared children, see build_children
+struct child_ref {
+	const char *name;
+	json_object *json;
+	int index;
+};
+
+// linux_dirent is not in any userspace header, the layout is that of fs/readdir.c
+struct linux_dirent {
+	unsigned long d_ino;
+	unsigned long d_off;
+	unsigned short d_reclen;
+	char d_name[];
+	/* these fields are at the end of d_name
+	char pad;
+	char d_type;
+	*/
+};
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// the kernel pads records to a multiple of sizeof(long), we do the same
+#define DIRENT_ALIGN(len) (((len) + sizeof(long) - 1) & ~(sizeof(long) - 1))
+
+struct sbfs_dirent {
+	uint64_t ino;
+	unsigned char type; // DT_* constant
+	char *name;
+};
+
+// a real directory being read with getdents(), read in full and filtered on the first call
+// so that further calls only need to pick up where the previous one stopped
+struct sbfs_dirlist {
+	struct sbfs_dirent *entries;
+	size_t count;
+	size_t cap;
+	size_t pos; // next entry to return
+};
+
+// replies to sb.manifest are kept below the size of a response datagram
+#define MANIFEST_MAX 60000
+
+// waits for requests from our children and responses from our parent, see run_parent
+static int epfd = -1;
+
+// how long the child may keep the answer that a name does not exist, for the last lookup which
+// ran into one (see resolve_path)
+static int lookup_miss = SB_CACHE_NONE;
+
+static int serve_request(struct sb_child *child);
+static unsigned int reap_children(struct sb_child *children, unsigned int count, int *status);
+static void drop_child(struct sb_child *child);
+static int reply_json(struct sb_child *child, int ret, int sb_errno, json_object *out);
+static void forward_done(void *ctx, int code, int err, json_object *data);
 static struct sbfs_node *get_node(const char *path);
-static void build_tree(json_object *json, struct sbfs_node *parent);
-
-int run_parent(pid_t child_pid, int child_socket)
+static struct sbfs_node *resolve_path(struct sbfs_node *cur, const char *path);
+static struct sbfs_node *lookup_proxy(struct sbfs_node *cur, const char *name, const char *path);
+static struct sbfs_node *lookup_real(struct sbfs_node *cur, const char *name);
+static int node_cache(const struct sbfs_node *node, bool missing);
+static void fs_changed(void);
+static void build_children(json_object *json, struct sbfs_node *parent);
+static void build_tree(json_object *json, struct sbfs_node *node, bool declared);
+static int compare_child_ref(const void *a, const void *b);
+static int compare_node_name(const void *key, const void *node);
+static void free_dirlist(struct sbfs_dirlist *dirlist);
+static json_object *build_manifest(json_object *dirs);
+static json_object *list_dir(const char *path);
+static void begin_job(void);
+static void end_job(void);
+static void report_stats(json_object *child_stats);
+
+int run_parent(struct sb_child *children, unsigned int count)
 {
 	json_object *out = NULL;
 	json_object *temp = NULL;
-	unsigned int limits[3];
-	int ret;
+	unsigned int limits[5];
+	char *archive = NULL;
+	unsigned int i, live = count;
+	int ret, status = 0;
 
-	// The first thing our child expects is for us to stream the memory and cpu limits
-	// it expects this without first sending a request for them our way.
+	nchildren = count;
+	current_child = &children[0];
+
+	// settle on a wire protocol with our parent before making any other requests
+	negotiate_protocol();
+
+	// The first thing our children expect is for us to stream the memory and cpu limits
+	// they expect this without first sending a request for them our way.
 	// We request these limits from our parent and then forward them onwards.
 	ret = trampoline(&out, NS_SB, "getlimits", 0);
 	if (ret != 0) {
@@ -48,35 +138,72 @@ int run_parent(pid_t child_pid, int child_socket)
 	limits[0] = (unsigned int)json_object_get_int64(temp);
 	json_object_object_get_ex(out, "cpu", &temp);
 	limits[1] = (unsigned int)json_object_get_int64(temp);
+	// zygote mode: child initializes python once and then forks off a process per job
+	limits[2] = json_object_object_get_ex(out, "zygote", &temp) && json_object_get_boolean(temp);
+	// host-wide cache for file contents we hand to the child, disabled if not given
+	if (json_object_object_get_ex(out, "cachedir", &temp) && json_object_is_type(temp, json_type_string)) {
+		cache_init(json_object_get_string(temp));
+	}
+
+	// host-wide bytecode cache, which provides the contents of every __pycache__ if given
+	if (json_object_object_get_ex(out, "pycachedir", &temp) && json_object_is_type(temp, json_type_string)) {
+		pycache_init(json_object_get_string(temp));
+	}
+
+	// precompiled stdlib archive, which we add to the tree and the child puts on sys.path
+	if (json_object_object_get_ex(out, "archive", &temp) && json_object_is_type(temp, json_type_string)) {
+		archive = strdup(json_object_get_string(temp));
+	}
+
+	limits[3] = archive != NULL;
+	// how much the child reads ahead for files we serve, see sbio.c; one block has to fit a response
+	limits[4] = 0;
+	if (json_object_object_get_ex(out, "readahead", &temp)) {
+		limits[4] = (unsigned int)json_object_get_int64(temp);
+		if (limits[4] > SB_READ_MAX) {
+			limits[4] = SB_READ_MAX;
+		}
+	}
+
 	json_object_put(out);
 
-	ret = write(child_socket, limits, sizeof(limits));
-	if (ret != sizeof(limits)) {
-		debug_error("Unable to send limit data to child.\n");
-		return -1;
+	for (i = 0; i < count; ++i) {
+		ret = write(children[i].socket, limits, sizeof(limits));
+		if (ret != sizeof(limits)) {
+			debug_error("Unable to send limit data to child.\n");
+			return -1;
+		}
 	}
 
 	// Now, set up our virtualized filesystem; our parent tells us a mapping of real and
 	// virtual nodes to use (real nodes point at actual things in the filesystem,
 	// virtual nodes are stored on the parent and we send a request upstream whenever
 	// something needs to happen with them.
-	// out is intentionally not deallocated here, rather we leave it allocated until our
-	// process completes, as it contains the various string values used in our node tree
-	// (similarly, memory allocated for the node tree is not released by us)
+	// the node tree is built in the arena along with copies of all of its strings, so out
+	// can be released right away (memory allocated for the node tree is never released by us)
+	// every child is served from this one tree, which is never modified after this point;
+	// only the dentry cache grows underneath it.
 	ret = trampoline(&out, NS_SB, "getfs", 0);
 	if (ret != 0) {
 		json_object_put(out);
 		return ret;
 	}
 
-	root.parent = &root;
-
-	int len = json_object_array_length(out);
-	for (int i = 0; i < len; ++i) {
-		build_tree(json_object_array_get_idx(out, i), &root);
+	if (archive != NULL) {
+		// declared last so that it wins over anything else of the same name
+		json_object *node = json_object_new_object();
+		json_object_object_add(node, "name", json_object_new_string(SB_ARCHIVE_NAME));
+		json_object_object_add(node, "realpath", json_object_new_string(archive));
+		json_object_object_add(node, "passthrough", json_object_new_boolean(1));
+		json_object_array_add(out, node);
+		free(archive);
 	}
 
-	// Our child expects a string containing the virtual python path, so give that too
+	root.parent = &root;
+	build_children(out, &root);
+	json_object_put(out);
+
+	// Our children expect a string containing the virtual python path, so give that too
 	// it's prefixed by an int containing the string length.
 	ret = trampoline(&out, NS_SB, "getpythonpath", 0);
 	if (ret != 0) {
@@ -84,167 +211,448 @@ int run_parent(pid_t child_pid, int child_socket)
 		return ret;
 	}
 
-	struct iovec request[3];
-	len = json_object_get_string_len(out);
+	struct iovec request[2];
+	int len = json_object_get_string_len(out);
 	request[0].iov_base = &len;
 	request[0].iov_len = sizeof(len);
 	request[1].iov_base = (void *)json_object_get_string(out);
 	request[1].iov_len = (size_t)len;
 
-	ret = writev(child_socket, request, 2);
-	if ((size_t)ret != len + sizeof(len)) {
-		debug_error("Unable to send python path data to child.\n");
-		return -1;
+	for (i = 0; i < count; ++i) {
+		ret = writev(children[i].socket, request, 2);
+		if ((size_t)ret != len + sizeof(len)) {
+			debug_error("Unable to send python path data to child.\n");
+			json_object_put(out);
+			return -1;
+		}
+
+		// set up known fds (stdin/stdout/stderr)
+		// these are always forwarded to the parent to handle
+		// fd 3 is used by child to communicate with us, so nothing should ever happen on that fd
+		children[i].fds[0].realfd = -1;
+		children[i].fds[0].node = &sb_stdin;
+		children[i].fds[1].realfd = -2;
+		children[i].fds[1].node = &sb_stdout;
+		children[i].fds[2].realfd = -3;
+		children[i].fds[2].node = &sb_stderr;
+	}
+
+	json_object_put(out);
+
+	// each child can hold MAX_FDS real fds open through us, make room for all of them
+	if (count > 1) {
+		struct rlimit rlim;
+		if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+			rlim.rlim_cur = rlim.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rlim);
+		}
 	}
 
-	// set up known fds (stdin/stdout/stderr)
-	// these are always forwarded to the parent to handle
-	// fd 3 is used by child to communicate with us, so nothing should ever happen on that fd
-	fds[0].realfd = -1;
-	fds[0].node = &sb_stdin;
-	fds[1].realfd = -2;
-	fds[1].node = &sb_stdout;
-	fds[2].realfd = -3;
-	fds[2].flags = &sb_stderr;
-
-	/* run in loop until child terminates, handling requests from child and proxying to
-	 * our parent if necessary (note: child termination is handled via SIGCHLD handler).
-	 * child requests are sent matching the following structure:
-	 * struct child_request {
-	 *     int16_t namespace; -- NS_* constant (not NS_SYS, see below)
-	 *     uint16_t fnamelen;
-	 *     uint16_t arglen;
-	 *     char fname[]; -- Must be NULL terminated
-	 *     char args[]; -- JSON array of arguments
-	 * };
-	 * for NS_SYS:
-	 * struct child_request {
-	 *     int16_t namespace; -- NS_SYS
-	 *     uint16_t syscall;
-	 *     uint16_t arglen;
-	 *     char args[]; -- of length arglen, each arg is tightly packed; strings null terminated
-	 * };
+	/* run in loop until every child terminates, handling requests from whichever children
+	 * have one waiting (see serve_request) and responses from our parent to the requests we
+	 * forwarded for them. SIGCHLD is only let through while we wait, so that children are
+	 * reaped between requests rather than in the middle of one.
 	 */
-	int16_t namespace;
-	uint16_t fnamelen, length;
-	void *params[6];
-	char buf[65537];
-	for (;;) {
-		request[0].iov_base = &namespace;
-		request[0].iov_len = 2;
-		request[1].iov_base = &fnamelen;
-		request[1].iov_len = 2;
-		request[2].iov_base = &length;
-		request[2].iov_len = 2;
-		ret = readv(child_socket, request, 3);
-		if (ret != 4) {
-			debug_error("Unable to read request from child.\n");
+	sigset_t blocked, waitmask;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &blocked, &waitmask);
+	sigdelset(&waitmask, SIGCHLD);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		debug_error("Unable to create epoll instance: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	for (i = 0; i < count; ++i) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &children[i] };
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, children[i].socket, &ev) != 0) {
+			debug_error("Unable to watch child socket: %s\n", strerror(errno));
+			goto fail;
+		}
+	}
+
+	// our parent is the one without a child
+	struct epoll_event pipe_ev = { .events = EPOLLIN, .data.ptr = NULL };
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, PIPEIN, &pipe_ev) != 0) {
+		debug_error("Unable to watch pipe: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	// children which exited during setup
+	live -= reap_children(children, count, &status);
+
+	struct epoll_event events[SB_MAX_CHILDREN + 1];
+	while (live > 0) {
+		// responses which arrived along with one we waited for in trampoline() are already read,
+		// so PIPEIN won't tell us about them
+		while (trampoline_buffered()) {
+			trampoline_receive();
+		}
+
+		ret = epoll_pwait(epfd, events, SB_MAX_CHILDREN + 1, -1, &waitmask);
+		if (ret < 0 && errno != EINTR) {
+			debug_error("epoll_pwait failed: %s\n", strerror(errno));
 			goto fail;
 		}
 
-		memset(buf, 0, 65537);
-		if (namespace == NS_SYS) {
-			// this is something we are meant to handle ourselves, most likely
-			// fnamelen contains the syscall number (should be less than nsyscalls)
-			// and we can look up the handler in sys_arg_map.func
-			if (fnamelen >= nsyscalls) {
-				// invalid syscall number, likely malicious input
-				debug_error("Invalid syscall number.\n");
-				goto fail;
+		for (int n = 0; n < ret; ++n) {
+			struct sb_child *child = (struct sb_child *)events[n].data.ptr;
+
+			if (child == NULL) {
+				trampoline_receive();
+				continue;
 			}
 
-			// read argument data into buf
-			if (length > 0) {
-				ret = read(child_socket, buf, length);
-				if (ret != length) {
-					debug_error("Unable to read request from child.\n");
-					goto fail;
-				}
+			if (child->dropped) {
+				// while handling an earlier event in this batch, see drop_child
+				continue;
 			}
 
-			// find the handler function for this syscall and then call it
-			const char *syscall = syscalls[fnamelen];
-			const struct sys_arg_map *map;
-			for (map = arg_map; map->sys == NULL || !strcmp(map->sys, syscall); ++map)
-				/* nothing */;
-			if (map->sys == NULL) {
-				debug_error("Syscall %s not implemented.\n", syscall);
-				goto fail;
+			current_child = child;
+			if (serve_request(child) != 0) {
+				drop_child(child);
 			}
+		}
 
-			size_t arg_off = 0;
-			for (int i = 0; i < map->nargs; ++i) {
-				if (arg_off >= 65536) {
-					ret = -1;
-					debug_error("Ran out of space for arguments.\n");
-					goto fail;
-				}
+		live -= reap_children(children, count, &status);
+	}
+
+	close(epfd);
+
+	// with a single child we exit with its status, otherwise each one was reported by sb.exited
+	return count == 1 ? status : 0;
+
+fail:
+	// getting here means that we can't serve our children any longer, so kill them now
+	for (i = 0; i < count; ++i) {
+		if (!children[i].exited) {
+			kill(children[i].pid, SIGTERM);
+		}
+	}
+
+	return -1;
+}
+
+/* Collects the children that exited since the last call, releasing everything we held for them.
+ * status is set to the status of the last one found (its exit code, or minus the signal number
+ * that terminated it). Returns the number of children found.
+ */
+static unsigned int reap_children(struct sb_child *children, unsigned int count, int *status)
+{
+	unsigned int reaped = 0;
+	int wstatus;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+		for (unsigned int i = 0; i < count; ++i) {
+			if (children[i].pid != pid || children[i].exited) {
+				continue;
+			}
+
+			*status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -(WTERMSIG(wstatus));
+			children[i].exited = true;
+			++reaped;
+
+			epoll_ctl(epfd, EPOLL_CTL_DEL, children[i].socket, NULL);
+			close(children[i].socket);
+			trampoline_cancel(&children[i]);
 
-				params[i] = (void *)(buf + arg_off);
-				if (map->arglen[i] == 0) {
-					arg_off += strlen((char *)params[i]) + 1;
-				} else if (map->arglen[i] > 0) {
-					arg_off += map->arglen[i];
+			current_child = &children[i];
+			for (int fd = 0; fd < MAX_FDS; ++fd) {
+				if (current_child->fds[fd].realfd != 0) {
+					close_node(fd);
 				}
 			}
 
-			// dispatch rewrites buf (now leads with an int length followed by length bytes of output params)
-			// note that params[0] also points to the beginning of buf; used here since attempting to recast
-			// a char[] breaks strict-aliasing whereas casting void * does not.
-			ret = dispatch(map->func, params[0], params[1], params[2], params[3], params[4], params[5]);
-			struct iovec response[3];
-			response[0].iov_base = &ret;
-			response[0].iov_len = sizeof(int);
-			response[1].iov_base = &errno;
-			response[1].iov_len = sizeof(int);
-			response[2].iov_base = buf + sizeof(int);
-			response[2].iov_len = *((int *)params[0]);
-
-			ret = writev(child_socket, response, 3);
-			if ((size_t)ret != sizeof(int) + sizeof(int) + response[2].iov_len) {
-				debug_error("Unable to write response to child.\n");
-				goto fail;
+			// nothing else will be looked up on its behalf, so what it found in proxies can go
+			dcache_forget(current_child);
+
+			// a child that did not get around to sending its own still gets a summary of ours
+			if (!current_child->reported) {
+				report_stats(NULL);
 			}
-		} else {
-			// punt this up to our parent and then return the response (as a json blob)
-			if (fnamelen + length > 65536) {
-				debug_error("Ran out of space for arguments.\n");
-				goto fail;
+
+			if (count > 1) {
+				notify(NS_SB, "exited", 1, json_object_new_int(*status));
 			}
-			ret = read(child_socket, buf, fnamelen + length);
-			if (ret != fnamelen + length) {
-				ret = -1;
-				debug_error("Unable to read data from child.\n");
-				goto fail;
+		}
+	}
+
+	return reaped;
+}
+
+/* Stops serving a child which misbehaved, it is reaped like any other once it is gone */
+static void drop_child(struct sb_child *child)
+{
+	child->dropped = true;
+	kill(child->pid, SIGTERM);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, child->socket, NULL);
+}
+
+/* Reads and answers a single request from child, returns -1 if the child misbehaved.
+ * child requests are sent matching the following structure:
+ * struct child_request {
+ *     int16_t namespace; -- NS_* constant (not NS_SYS, see below)
+ *     uint16_t fnamelen;
+ *     uint16_t arglen;
+ *     char fname[]; -- Must be NULL terminated
+ *     char args[]; -- JSON array of arguments
+ * };
+ * for NS_SYS:
+ * struct child_request {
+ *     int16_t namespace; -- NS_SYS
+ *     uint16_t syscall;
+ *     uint16_t arglen;
+ *     char args[]; -- of length arglen, each arg is tightly packed; strings null terminated
+ * };
+ * Each request is a single datagram, so the header and data must be read in one go.
+ * Responses to NS_SYS requests are the return code, errno, the child's cache epoch and how long
+ * the child may keep the answer (SB_CACHE_*, from reply_cache) followed by the output data.
+ * They may carry a real fd (SCM_RIGHTS) if the handler set grant_fd. Responses to other requests
+ * are the return code, errno and cache epoch followed by JSON text (see reply_json).
+ */
+static int serve_request(struct sb_child *child)
+{
+	// requests are at most 65536 bytes, the responses to reads can be larger
+	static char buf[sizeof(int) + SB_READ_MAX];
+	json_object *out = NULL;
+	struct iovec request[4];
+	int16_t namespace;
+	uint16_t fnamelen, length;
+	void *params[6];
+	uint64_t start;
+	int ret;
+
+	memset(buf, 0, 65537);
+	request[0].iov_base = &namespace;
+	request[0].iov_len = 2;
+	request[1].iov_base = &fnamelen;
+	request[1].iov_len = 2;
+	request[2].iov_base = &length;
+	request[2].iov_len = 2;
+	request[3].iov_base = buf;
+	request[3].iov_len = 65536;
+	ret = readv(child->socket, request, 4);
+	if (ret < 6) {
+		debug_error("Unable to read request from child.\n");
+		return -1;
+	}
+
+	start = stats_now();
+	ret -= 6;
+	if (namespace == NS_SYS) {
+		// this is something we are meant to handle ourselves, most likely
+		// fnamelen contains the syscall number (should be less than nsyscalls)
+		// and indexes directly into arg_map to find the handler
+		if (fnamelen >= nsyscalls) {
+			// invalid syscall number, likely malicious input
+			debug_error("Invalid syscall number.\n");
+			return -1;
+		}
+
+		if (ret != length) {
+			debug_error("Unable to read request from child.\n");
+			return -1;
+		}
+
+		// find the handler function for this syscall and then call it
+		const struct sys_arg_map *map = &arg_map[fnamelen];
+		if (map->func == NULL) {
+			debug_error("Syscall %s not implemented.\n", syscalls[fnamelen]);
+			return -1;
+		}
+
+		size_t arg_off = 0;
+		for (int i = 0; i < map->nargs; ++i) {
+			if (arg_off >= 65536) {
+				debug_error("Ran out of space for arguments.\n");
+				return -1;
 			}
 
-			json_object *json_args = json_tokener_parse(buf + fnamelen);
-			if (!json_object_is_type(json_args, json_type_array)) {
-				debug_error("Argument data is not an array.\n");
-				goto fail;
+			params[i] = (void *)(buf + arg_off);
+			if (map->arglen[i] == 0) {
+				arg_off += strlen((char *)params[i]) + 1;
+			} else if (map->arglen[i] > 0) {
+				arg_off += map->arglen[i];
 			}
+		}
+
+		// dispatch rewrites buf (now leads with an int length followed by length bytes of output params)
+		// note that params[0] also points to the beginning of buf; used here since attempting to recast
+		// a char[] breaks strict-aliasing whereas casting void * does not.
+		ret = dispatch(map->func, params[0], params[1], params[2], params[3], params[4], params[5]);
+		int sys_errno = errno;
+		int cache = reply_cache;
+		reply_cache = SB_CACHE_NONE;
+		struct iovec response[5];
+		response[0].iov_base = &ret;
+		response[0].iov_len = sizeof(int);
+		response[1].iov_base = &sys_errno;
+		response[1].iov_len = sizeof(int);
+		response[2].iov_base = &child->epoch;
+		response[2].iov_len = sizeof(unsigned int);
+		response[3].iov_base = &cache;
+		response[3].iov_len = sizeof(int);
+		response[4].iov_base = buf + sizeof(int);
+		response[4].iov_len = *((int *)params[0]);
+
+		union {
+			struct cmsghdr hdr;
+			char buf[CMSG_SPACE(sizeof(int))];
+		} cmsgbuf;
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = response;
+		msg.msg_iovlen = 5;
+
+		if (grant_fd >= 0) {
+			msg.msg_control = cmsgbuf.buf;
+			msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &grant_fd, sizeof(int));
+		}
+
+		ret = sendmsg(child->socket, &msg, 0);
+
+		// the child has its own copy of the granted fd now (or failed to get one
+		// and will error out), either way we have no further use for ours
+		if (grant_fd >= 0) {
+			close(grant_fd);
+			grant_fd = -1;
+		}
+
+		if ((size_t)ret != sizeof(int) * 3 + sizeof(unsigned int) + response[4].iov_len) {
+			debug_error("Unable to write response to child.\n");
+			return -1;
+		}
+
+		stats_record(stats_syscall(fnamelen), start, 6 + length + ret);
+	} else {
+		// punt this up to our parent and then return the response (as a json blob)
+		if (ret != fnamelen + length) {
+			debug_error("Unable to read data from child.\n");
+			return -1;
+		}
+
+		if (fnamelen == 0 || buf[fnamelen - 1] != '\0') {
+			debug_error("Function name is not NULL terminated.\n");
+			return -1;
+		}
+
+		json_object *json_args = json_tokener_parse(buf + fnamelen);
+		if (!json_object_is_type(json_args, json_type_array)) {
+			debug_error("Argument data is not an array.\n");
+			json_object_put(json_args);
+			return -1;
+		}
+
+		// in zygote mode, anything a job opened goes away once that job is done
+		if (namespace == NS_SB && !strcmp(buf, "getjob")) {
+			begin_job();
+		} else if (namespace == NS_SB && !strcmp(buf, "jobdone")) {
+			end_job();
+		}
+
+		if (namespace == NS_SB && !strcmp(buf, "getstats")) {
+			// what we recorded so far, for all children (see sbstats.c)
+			json_object_put(json_args);
+			out = stats_json();
+			ret = reply_json(child, 0, 0, out);
+			json_object_put(out);
+			return ret;
+		}
+
+		if (namespace == NS_SB && !strcmp(buf, "stats")) {
+			// the child's own numbers, sent as it exits, are passed on along with ours
+			report_stats(json_object_get(json_object_array_get_idx(json_args, 0)));
+			json_object_put(json_args);
+			return reply_json(child, 0, 0, NULL);
+		}
 
-			ret = trampoline(&out, namespace, buf, -1, json_args);
+		if (namespace == NS_SB && !strcmp(buf, "manifest")) {
+			// answered from our own view of the filesystem, see build_manifest
+			out = build_manifest(json_object_array_get_idx(json_args, 0));
+			json_object_put(json_args);
+			ret = reply_json(child, 0, 0, out);
+			json_object_put(out);
+			return ret;
 		}
+
+		// our parent can do whatever it likes with its nodes while handling this
+		fs_changed();
+
+		// the child waits for the response, but nobody else has to; it is sent on by
+		// forward_done whenever our parent gets around to answering
+		trampoline_async(namespace, buf, json_args, forward_done, child);
 	}
 
-fail:
-	// getting here means that we aborted the loop before the child died, so kill the child now
-	kill(child_pid, SIGTERM);
-	return ret;
+	return 0;
+}
+
+/* Sends the response to a non-syscall request to child: the return code, errno and the
+ * child's cache epoch (which forwarded calls move on, see fs_changed) followed by data as JSON text */
+static int reply_json(struct sb_child *child, int ret, int sb_errno, json_object *out)
+{
+	const char *json = json_object_to_json_string_ext(out, JSON_C_TO_STRING_PLAIN);
+	struct iovec response[4];
+	response[0].iov_base = &ret;
+	response[0].iov_len = sizeof(int);
+	response[1].iov_base = &sb_errno;
+	response[1].iov_len = sizeof(int);
+	response[2].iov_base = &child->epoch;
+	response[2].iov_len = sizeof(unsigned int);
+	response[3].iov_base = (void *)json;
+	response[3].iov_len = strlen(json);
+
+	if (response[3].iov_len >= 65536) {
+		ret = -1;
+		sb_errno = E2BIG;
+		response[3].iov_base = "null";
+		response[3].iov_len = 4;
+	}
+
+	ret = writev(child->socket, response, 4);
+	if ((size_t)ret != sizeof(int) + sizeof(int) + sizeof(unsigned int) + response[3].iov_len) {
+		debug_error("Unable to write response to child.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+// our parent answered a request forwarded by serve_request
+static void forward_done(void *ctx, int code, int err, json_object *data)
+{
+	struct sb_child *child = (struct sb_child *)ctx;
+
+	if (reply_json(child, code, err, data) != 0) {
+		drop_child(child);
+	}
+
+	json_object_put(data);
 }
 
 /* Gets a node from the given path, which may be either relative or absolute.
  * If relative, it is retrived based on the current working directory.
  * (The current working directory is specified by our parent).
- * The node must not be free()d, and its values are not guaranteed to remain
- * the same after another call to get_node (e.g. it may be a static buffer) */
+ * The node must not be free()d, and is only guaranteed to remain valid
+ * until the next call to get_node (lookup results are cached, see sbdcache.c) */
 static struct sbfs_node *get_node(const char *path)
 {
 	struct sbfs_node *cur = &root;
 	json_object *out = NULL;
 	int ret;
 
+	// nodes from the previous lookup that we did not cache are freed here
+	dcache_begin();
+	lookup_miss = SB_CACHE_NONE;
+
 	if (path[0] != '/') {
 		// get cwd from parent
 		out = NULL;
@@ -254,13 +662,21 @@ static struct sbfs_node *get_node(const char *path)
 			return NULL;
 		}
 
-		cur = get_node(json_object_get_string(out));
+		cur = resolve_path(&root, json_object_get_string(out));
 		json_object_put(out);
 		if (cur == NULL) {
 			return NULL;
 		}
 	}
 
+	return resolve_path(cur, path);
+}
+
+static struct sbfs_node *resolve_path(struct sbfs_node *cur, const char *path)
+{
+	struct sbfs_node *next = cur;
+	bool pycache;
+
 	// make a copy of path so we can do stuff with it
 	char *ourpath = strdup(path);
 	for (char *name = strtok(ourpath, "/"); name != NULL; name = strtok(NULL, "/")) {
@@ -272,179 +688,250 @@ static struct sbfs_node *get_node(const char *path)
 			continue;
 		}
 
-		if (cur->flags & SBFS_PROXY) {
-			json_object *cur_name = json_object_new_string(cur->name);
-			json_object *cur_realpath = json_object_new_string(cur->realpath);
-			json_object *json_name = json_object_new_string(name);
-			json_object *json_path = json_object_new_string(path);
-			out = NULL;
-			ret = trampoline(&out, NS_SB, "getnode", 4, cur_name, cur_realpath, json_name, json_path);
-			if (ret != 0) {
-				json_object_put(out);
-				cur = NULL;
-				goto cleanup;
+		pycache = false;
+		if (dcache_lookup(cur, name, &next)) {
+			// seen before, next is NULL if it does not exist
+			errno = ENOENT;
+		} else if ((pycache = pycache_handles(cur, name))) {
+			// __pycache__ and its contents come from the bytecode cache, if there is one
+			next = pycache_lookup(cur, name);
+		} else if (cur->flags & SBFS_PROXY) {
+			next = lookup_proxy(cur, name, path);
+		} else {
+			// check for children with the given name, even if this is a real directory
+			// this allows for virtual nodes or other real nodes to shadow what the real fs has
+			next = NULL;
+			if (cur->nchildren > 0) {
+				next = (struct sbfs_node *)bsearch(name, cur->children, cur->nchildren,
+					sizeof(struct sbfs_node), compare_node_name);
 			}
 
-			if (proxy.child != NULL) {
-				free(proxy.child);
-				proxy.child = NULL;
+			// no children; check for a real file or directory with our name
+			if (next == NULL) {
+				if (cur->realpath != NULL && (cur->flags & SBFS_RECURSE)) {
+					next = lookup_real(cur, name);
+				} else {
+					errno = ENOENT;
+				}
 			}
+		}
 
-			// using build_tree is a convenience so we don't replicate code, out should NOT contain
-			// any children, as that would cause memory leaks if it did.
-			build_tree(out, &proxy);
-			cur = proxy.child;
-			continue;
+		if (next == NULL) {
+			// the bytecode cache fills up over time, so its misses are never final
+			lookup_miss = errno == ENOENT && !pycache ? node_cache(cur, true) : SB_CACHE_NONE;
+			break;
 		}
 
-		// check for children with the given name, even if this is a real directory
-		// this allows for virtual nodes or other real nodes to shadow what the real fs has
-		for (struct sbfs_node *child = cur->child; child != NULL; child = child->next) {
-			if (!strcmp(name, child->name)) {
-				cur = child;
-				goto found;
-			}
+		cur = next;
+	}
+
+	free(ourpath);
+	return next == NULL ? NULL : cur;
+}
+
+/* Asks our parent about name in the proxy node cur. The answer is cached for the current child,
+ * including the name not existing. */
+static struct sbfs_node *lookup_proxy(struct sbfs_node *cur, const char *name, const char *path)
+{
+	struct sbfs_node *node;
+	json_object *out = NULL;
+	json_object *cur_name = json_object_new_string(cur->name);
+	json_object *cur_realpath = cur->realpath ? json_object_new_string(cur->realpath) : NULL;
+	json_object *json_name = json_object_new_string(name);
+	json_object *json_path = json_object_new_string(path);
+	int ret;
+
+	ret = trampoline(&out, NS_SB, "getnode", 4, cur_name, cur_realpath, json_name, json_path);
+	if (ret != 0) {
+		json_object_put(out);
+		if (errno == ENOENT) {
+			dcache_insert(cur, name, NULL);
 		}
 
-		// no children; check for a real file or directory with our name
-		if (cur->realpath != NULL && (cur->flags & SBFS_RECURSE)) {
-			// Before we get around to actually checking the filesystem, first check our blacklist/whitelist
-			// for our name. If we aren't allowed to read it, don't bother seeing if it exists.
-			if (cur->filter != NULL) {
-				int i;
-
-				for (i = 0; cur->filter[i] != NULL; ++i) {
-					// our filter may have nested subdirectories, ensure we only match the topmost one
-					char *filter = strdup(cur->filter[i]);
-					char *slash = strchr(filter, '/');
-					if (slash != NULL)
-						*slash = '\0';
-
-					if (!fnmatch(filter, name, FNM_PERIOD | FNM_EXTMATCH)) {
-						if (cur->flags & SBFS_BLACKLIST) {
-							errno = ENOENT;
-							cur = NULL;
-							free(filter);
-							goto cleanup;
-						} else {
-							// matched whitelist entry
-							free(filter);
-							break;
-						}
-					}
-
-					free(filter);
-				}
+		return NULL;
+	}
 
-				if ((cur->flags & SBFS_BLACKLIST) == 0 && cur->filter[i] == NULL) {
-					// no entries matched and we are using a whitelist
-					errno = ENOENT;
-					cur = NULL;
-					goto cleanup;
-				}
+	node = (struct sbfs_node *)calloc(1, sizeof(struct sbfs_node));
+	node->parent = cur;
+	// our parent answers for the child we are serving, other children may get a different answer
+	node->owner = current_child;
+	build_tree(out, node, false);
+	json_object_put(out);
 
-				// getting here means we either matched a whitelist entry or did not match a blacklist entry
-				// either way execution should proceed
-			}
+	dcache_insert(cur, name, node);
+	return node;
+}
 
-			DIR *dir = opendir(cur->realpath);
-			if (dir == NULL) {
-				cur = NULL;
-				goto cleanup;
-			}
+/* Looks for name in the real directory behind cur, applying cur's filters.
+ * Whatever is found (or not found) is cached. */
+static struct sbfs_node *lookup_real(struct sbfs_node *cur, const char *name)
+{
+	struct sbfs_node *node;
+	int ret;
 
-			struct sbfs_node *newcur = NULL;
-			for (struct dirent *dent = readdir(dir); dent != NULL; dent = readdir(dir)) {
-				if (strcoll(dent->d_name, name))
-					continue;
+	// Before we get around to actually checking the filesystem, first check our blacklist/whitelist
+	// for our name. If we aren't allowed to read it, don't bother seeing if it exists.
+	uint64_t live;
+	if (!filter_allows(cur, name, &live)) {
+		goto notfound;
+	}
 
-				size_t buflen = strlen(cur->realpath) + strlen(name) + 2;
-				char *buf = (char *)malloc(buflen);
-				strcpy(buf, cur->realpath);
-				strcat(buf, "/");
-				strcat(buf, name);
-
-				free(proxy.name);
-				free(proxy.realpath);
-				free(proxy.filter);
-				proxy.name = strdup(name);
-				proxy.realpath = buf;
-				proxy.flags = cur->flags & ~SBFS_DIRECTORY;
-				proxy.filter = NULL;
-
-				struct stat statres;
-				ret = lstat(proxy.realpath, &statres);
-				if (ret < 0) {
-					debug_error("Cannot stat %s: %s", proxy.realpath, strerror(errno));
-					cur = NULL;
-					goto cleanup;
-				}
+	// look the name up directly relative to the directory rather than scanning it
+	size_t buflen = strlen(cur->realpath) + strlen(name) + 2;
+	char *buf = (char *)malloc(buflen);
+	strcpy(buf, cur->realpath);
+	strcat(buf, "/");
+	strcat(buf, name);
+
+	int dirfd = dcache_dirfd(cur);
+	const char *relpath = name;
+	if (dirfd < 0) {
+		dirfd = AT_FDCWD;
+		relpath = buf;
+	}
 
-				if (S_ISLNK(statres.st_mode)) {
-					if (!(cur->flags & SBFS_FOLLOW)) {
-						newcur = NULL;
-						break;
-					}
-
-					ret = stat(proxy.realpath, &statres);
-					if (ret < 0) {
-						debug_error("Cannot stat %s: %s", proxy.realpath, strerror(errno));
-						cur = NULL;
-						goto cleanup;
-					}
-				}
+	struct stat statres;
+	ret = fstatat(dirfd, relpath, &statres, AT_SYMLINK_NOFOLLOW);
+	if (ret < 0) {
+		int err = errno;
+		free(buf);
+		if (err == ENOENT || err == ENOTDIR) {
+			goto notfound;
+		}
 
-				if (S_ISDIR(statres.st_mode)) {
-					proxy.flags |= SBFS_DIRECTORY;
-				}
+		debug_error("Cannot stat %s/%s: %s", cur->realpath, name, strerror(err));
+		errno = err;
+		return NULL;
+	}
 
-				// copy over matching filters, advanced by one directory
-				if (cur->filter != NULL) {
-					int fbuflen, i = 0;
-					char **fbuf;
-					for (fbuflen = 0; cur->filter[fbuflen] != NULL; ++fbuflen)
-						/* nothing */;
-
-					fbuf = (char **)malloc(fbuflen * sizeof(char *));
-					for (int j = 0; j < fbuflen; ++j) {
-						char *filter = strdup(cur->filter[j]);
-						char *slash = strchr(filter, '/');
-						if (slash != NULL)
-							*slash = '\0';
-
-						if (!fnmatch(filter, name, FNM_PERIOD | FNM_EXTMATCH)) {
-							slash = strchr(cur->filter[j], '/');
-							if (slash != NULL) {
-								fbuf[i] = slash + 1;
-								++i;
-							}
-						}
-
-						free(filter);
-					}
-
-					fbuf[i] = NULL;
-					proxy.filter = fbuf;
-				}
+	if (S_ISLNK(statres.st_mode)) {
+		if (!(cur->flags & SBFS_FOLLOW)) {
+			free(buf);
+			goto notfound;
+		}
 
-				newcur = &proxy;
-				break;
+		ret = fstatat(dirfd, relpath, &statres, 0);
+		if (ret < 0) {
+			int err = errno;
+			free(buf);
+			if (err == ENOENT) {
+				// dangling symlink
+				goto notfound;
 			}
 
-			cur = newcur;
-			closedir(dir);
+			debug_error("Cannot stat %s/%s: %s", cur->realpath, name, strerror(err));
+			errno = err;
+			return NULL;
 		}
+	}
 
-found:
-		/* nothing */;
+	node = (struct sbfs_node *)calloc(1, sizeof(struct sbfs_node));
+	node->name = strdup(name);
+	node->realpath = buf;
+	node->parent = cur;
+	node->owner = cur->owner;
+	node->flags = cur->flags & ~(SBFS_DIRECTORY | SBFS_UNCACHED);
+
+	if (S_ISDIR(statres.st_mode)) {
+		node->flags |= SBFS_DIRECTORY;
 	}
 
-cleanup:
-	free(ourpath);
-	return cur;
+	// the filter is shared with us, advanced by one directory
+	node->filter = cur->filter;
+	node->filter_depth = cur->filter_depth + 1;
+	node->filter_live = live;
+
+	dcache_insert(cur, name, node);
+	return node;
+
+notfound:
+	dcache_insert(cur, name, NULL);
+	errno = ENOENT;
+	return NULL;
+}
+
+/* How long the child may keep what we told it about node (SB_CACHE_*), or if missing is set,
+ * about a name not existing under node. */
+static int node_cache(const struct sbfs_node *node, bool missing)
+{
+	// the bytecode cache fills up over time; writable real nodes can be changed by anyone on the host
+	if ((node->flags & SBFS_PYCACHE) || ((node->flags & SBFS_WRITABLE) && node->realpath != NULL)) {
+		return SB_CACHE_NONE;
+	}
+
+	// our parent answers for these, and only changes them when it is called (see fs_changed)
+	if ((node->flags & (SBFS_PROXY | SBFS_WRITABLE)) || node->owner != NULL || (node->realpath == NULL && !missing)) {
+		return SB_CACHE_EPOCH;
+	}
+
+	// real read-only nodes, and the declared children of virtual directories
+	return SB_CACHE_IMMUTABLE;
+}
+
+// sets reply_cache for an answer about path, which resolved to node (NULL if it was not found)
+static void set_reply_cache(const char *path, const struct sbfs_node *node)
+{
+	if (path[0] != '/') {
+		// relative to a working directory that our parent can change at will
+		reply_cache = SB_CACHE_NONE;
+	} else if (node == NULL) {
+		reply_cache = lookup_miss;
+	} else {
+		reply_cache = node_cache(node, false);
+	}
+}
+
+/* Moves the cache epoch of the child being served on, which makes it drop whatever it kept
+ * about the nodes our parent answers for. We forget the names our parent said were missing. */
+static void fs_changed(void)
+{
+	current_child->epoch++;
+	dcache_forget_missing(current_child);
+}
+
+/* Builds the declared children in json (a getfs array) into a sorted array on parent,
+ * allowing them to be found with a binary search. If several children share a name,
+ * the last one wins. */
+static void build_children(json_object *json, struct sbfs_node *parent)
+{
+	json_object *temp;
+	int len = json_object_array_length(json);
+	int n = 0;
+
+	if (len == 0) {
+		return;
+	}
+
+	struct child_ref *refs = (struct child_ref *)malloc(len * sizeof(struct child_ref));
+	for (int i = 0; i < len; ++i) {
+		refs[i].json = json_object_array_get_idx(json, i);
+		refs[i].name = json_object_object_get_ex(refs[i].json, "name", &temp) ? json_object_get_string(temp) : NULL;
+		refs[i].index = i;
+		if (refs[i].name == NULL) {
+			refs[i].name = "";
+		}
+	}
+
+	qsort(refs, len, sizeof(struct child_ref), compare_child_ref);
+
+	parent->children = (struct sbfs_node *)arena_alloc(len * sizeof(struct sbfs_node));
+	for (int i = 0; i < len; ++i) {
+		if (i > 0 && !strcmp(refs[i].name, refs[i - 1].name)) {
+			continue;
+		}
+
+		parent->children[n].parent = parent;
+		build_tree(refs[i].json, &parent->children[n], true);
+		++n;
+	}
+
+	parent->nchildren = n;
+	free(refs);
 }
 
-static void build_tree(json_object *json, struct sbfs_node *parent)
+/* Fills in node from json. Declared nodes (from getfs) are built in the arena along with
+ * their children; otherwise (getnode) strings are malloc()d and children are ignored. */
+static void build_tree(json_object *json, struct sbfs_node *node, bool declared)
 {
 	/* getfs data format: all fields optional except name; if unspecified a default
 	 * of either null, false, or an empty array will be assumed. node is a single element
@@ -468,27 +955,25 @@ static void build_tree(json_object *json, struct sbfs_node *parent)
 	 *     useful for virtual directories whose contents are not known during init
 	 *   "writable": bool if writing is allowed to this node or real files/subdirs;
 	 *     for real files/subdirs writing must also be allowed by filesystem permissions
+	 *   "passthrough": bool if real files under this node that are opened read-only
+	 *     should be handed to the child as real fds instead of serving each read here
 	 * },
 	 * ...
 	 * ]
 	 */
 	
 	json_object *temp;
-	struct sbfs_node *node = (struct sbfs_node *)malloc(sizeof(struct sbfs_node));
 	int len = 0;
 
-	// set up links; we prepend this node in front of previous first child so that insertion
-	// is O(1) rather than O(N). This does mean nodes are enumerated in reverse order, however
-	// that should not matter for any practical purpose.
-	node->parent = parent;
-	node->next = parent->child;
-	parent->child = node;
+	const char *name = json_object_object_get_ex(json, "name", &temp) ? json_object_get_string(temp) : NULL;
+	if (name == NULL) {
+		name = "";
+	}
 
-	json_object_object_get_ex(json, "name", &temp);
-	node->name = (char *)json_object_get_string(temp);
+	node->name = declared ? arena_intern(name) : strdup(name);
 
 	if (json_object_object_get_ex(json, "realpath", &temp) && json_object_is_type(temp, json_type_string)) {
-		node->realpath = (char *)json_object_get_string(temp);
+		node->realpath = declared ? arena_intern(json_object_get_string(temp)) : strdup(json_object_get_string(temp));
 		struct stat statres;
 		int ret = stat(node->realpath, &statres);
 		if (ret == -1) {
@@ -523,29 +1008,55 @@ static void build_tree(json_object *json, struct sbfs_node *parent)
 		node->flags |= SBFS_WRITABLE;
 	}
 
+	if (json_object_object_get_ex(json, "passthrough", &temp) && json_object_get_boolean(temp)) {
+		node->flags |= SBFS_PASSTHROUGH;
+	}
+
 	if (json_object_object_get_ex(json, "filter", &temp)) {
 		len = json_object_array_length(temp);
 		if (len > 0) {
-			node->filter = (char **)malloc(len * sizeof(char *));
+			const char **patterns = (const char **)malloc(len * sizeof(char *));
 			for (int i = 0; i < len; ++i) {
 				json_object *filter = json_object_array_get_idx(temp, i);
-				node->filter[i] = (char *)json_object_get_string(filter);
+				patterns[i] = json_object_get_string(filter);
 			}
+
+			node->filter = filter_compile(patterns, len);
+			free(patterns);
+			node->filter_live = len >= SBFS_MAX_FILTERS ? UINT64_MAX : ((uint64_t)1 << len) - 1;
 		}
 	}
 
-	if ((node->flags & SBFS_DIRECTORY) && json_object_object_get_ex(json, "children", &temp)) {
-		len = json_object_array_length(temp);
-		for (int i = 0; i < len; ++i) {
-			json_object *child = json_object_array_get_idx(temp, i);
-			build_tree(child, node);
-		}
+	if (declared && (node->flags & SBFS_DIRECTORY) && json_object_object_get_ex(json, "children", &temp)) {
+		build_children(temp, node);
 	}
 }
 
+static int compare_child_ref(const void *a, const void *b)
+{
+	const struct child_ref *left = (const struct child_ref *)a;
+	const struct child_ref *right = (const struct child_ref *)b;
+	int ret = strcmp(left->name, right->name);
+
+	// equal names are sorted last declared first
+	return ret != 0 ? ret : right->index - left->index;
+}
+
+static int compare_node_name(const void *key, const void *node)
+{
+	return strcmp((const char *)key, ((const struct sbfs_node *)node)->name);
+}
+
 int open_node(const char *pathname, int flags, int mode)
 {
-	struct sbfs_node *node = get_node(pathname);
+	struct sbfs_fd *fds = current_child->fds;
+	struct sbfs_node *node;
+
+	if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC))) {
+		fs_changed();
+	}
+
+	node = get_node(pathname);
 	if (node == NULL) {
 		// does not exist
 		if (flags & O_CREAT) {
@@ -557,22 +1068,22 @@ int open_node(const char *pathname, int flags, int mode)
 		return -1;
 	}
 
-	if ((node->flags & SBFS_DIRECTORY) && (mode & (O_WRONLY | O_RDWR))) {
+	if ((node->flags & SBFS_DIRECTORY) && (flags & (O_WRONLY | O_RDWR))) {
 		errno = EISDIR;
 		return -1;
 	}
 
-	if (mode & (O_CREAT | O_EXCL)) {
+	if ((flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
 		errno = EEXIST;
 		return -1;
 	}
 
-	if (!(node->flags & SBFS_WRITABLE) && (mode & (O_WRONLY | O_RDWR))) {
+	if (!(node->flags & SBFS_WRITABLE) && (flags & (O_WRONLY | O_RDWR))) {
 		errno = EROFS;
 		return -1;
 	}
 
-	if ((node->flags & SBFS_DIRECTORY) && !(mode & O_DIRECTORY)) {
+	if (!(node->flags & SBFS_DIRECTORY) && (flags & O_DIRECTORY)) {
 		errno = ENOTDIR;
 		return -1;
 	}
@@ -583,30 +1094,50 @@ int open_node(const char *pathname, int flags, int mode)
 		if (realfd == -1) {
 			return -1;
 		}
-	} else {
+
+		// regular files opened read-only can be read by the child directly, in which case
+		// the fd is handed over with our response and we don't track it ourselves.
+		// the child replaces our return value with the fd it ends up installing it at.
+		if ((node->flags & SBFS_PASSTHROUGH) && !(node->flags & SBFS_WRITABLE)
+			&& (flags & O_ACCMODE) == O_RDONLY && !(flags & O_PATH))
+		{
+			struct stat statres;
+			if (fstat(realfd, &statres) == 0 && S_ISREG(statres.st_mode)) {
+				// prefer handing over the shared cached copy, if there is one
+				int cachefd = cache_open(realfd, node->realpath);
+				if (cachefd >= 0) {
+					close(realfd);
+					realfd = cachefd;
+				}
+
+				grant_fd = realfd;
+				return 0;
+			}
+		}
+	} else if (!(node->flags & SBFS_PYCACHE)) {
 		// trampoline open request to parent to get a virtual (negative) fd
 		// note that the parent returns a postive fd and we make it negative
 		// e.g. if it reports fd 3 then we negate and subtract one for -4
 		// when we pass the fd back to parent we add one and negate to get 3 back
-		// TODO: this
-	}
+		int ret = trampoline(NULL, NS_SYS, "open", 3, json_object_new_string(pathname),
+			json_object_new_int(flags), json_object_new_int(mode));
+		if (ret < 0) {
+			return -1;
+		}
+
+		realfd = -ret - 1;
+	}
 
+	// 0-2 are stdio, 3 is RPCSOCK and 4 is SB_TRANSIT_FD
 	int i;
-	for (i = 4; i < MAX_FDS; ++i) {
+	for (i = 5; i < MAX_FDS; ++i) {
 		if (fds[i].realfd == 0) {
-			struct sbfs_node *newnode = calloc(1, sizeof(struct sbfs_node));
-			newnode->name = strdup(node->name);
-			newnode->flags = node->flags;
-			if (node->realpath != NULL) {
-				newnode->realpath= strdup(node->realpath);
-			}
-
-			if (realfd < 0 && (flags & O_CLOEXEC)) {
-				newnodw->flags |= SBFS_CLOEXEC;
-			}
-
+			// the node is shared with the tree rather than copied, our reference keeps
+			// the dentry cache from freeing it while the fd is open
+			node_get(node);
 			fds[i].realfd = realfd;
-			fds[i].node = newnode;
+			fds[i].flags = (realfd < 0 && (flags & O_CLOEXEC)) ? SBFS_CLOEXEC : 0;
+			fds[i].node = node;
 			break;
 		}
 	}
@@ -618,3 +1149,730 @@ int open_node(const char *pathname, int flags, int mode)
 
 	return i;
 }
+
+int close_node(int fd)
+{
+	struct sbfs_fd *fds = current_child->fds;
+
+	if (fd < 0 || fd >= MAX_FDS || fds[fd].realfd == 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (fds[fd].node->flags & SBFS_NOCLOSE) {
+		return 0;
+	}
+
+	if (fds[fd].realfd > 0) {
+		close(fds[fd].realfd);
+	} else if (!(fds[fd].node->flags & SBFS_PYCACHE)) {
+		trampoline(NULL, NS_SYS, "close", 1, json_object_new_int(-fds[fd].realfd - 1));
+	}
+
+	if (fds[fd].dirlist != NULL) {
+		free_dirlist(fds[fd].dirlist);
+		fds[fd].dirlist = NULL;
+	}
+
+	node_put(fds[fd].node);
+	fds[fd].realfd = 0;
+	fds[fd].flags = 0;
+	fds[fd].node = NULL;
+
+	return 0;
+}
+
+/* Like read_node(), but at offset rather than the file position, which is left alone */
+int pread_node(int fd, void *buf, size_t count, off_t offset)
+{
+	struct sbfs_fd *fds = current_child->fds;
+	size_t len = count;
+	int ret;
+
+	if (fd < 0 || fd >= MAX_FDS || fds[fd].realfd == 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (fds[fd].realfd > 0) {
+		return pread(fds[fd].realfd, buf, count, offset);
+	}
+
+	// the child fills its read-ahead buffer with these, our parent lets them be that large
+	ret = trampoline_buf(buf, &len, NS_SYS, "pread", 4, json_object_new_int(-fds[fd].realfd - 1),
+		json_object_new_int64(count), json_object_new_int64(offset),
+		json_object_new_boolean(!!(fds[fd].flags & SBFS_READAHEAD)));
+	if (ret > 0 && (size_t)ret != len) {
+		debug_error("data length mismatch\n");
+		exit(EPROTO);
+	}
+
+	return ret;
+}
+
+/* Returns the size of the regular file just opened as fd with flags, which the child sizes its
+ * read-ahead buffer from, or -1 if it does not get one (not opened read-only, directories and
+ * devices). Virtual files count as well, their blocks are fetched from our parent with pread. */
+off_t node_readahead(int fd, int flags)
+{
+	struct sbfs_fd *fds = current_child->fds;
+	struct stat st;
+	int err = errno;
+
+	if ((flags & (O_ACCMODE | O_PATH)) != O_RDONLY || fstat_node(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		errno = err;
+		return -1;
+	}
+
+	if (fds[fd].realfd < 0) {
+		fds[fd].flags |= SBFS_READAHEAD;
+	}
+
+	return st.st_size;
+}
+
+/* Moves the file position of fd. Directories we list ourselves can only be rewound. */
+off_t lseek_node(int fd, off_t offset, int whence)
+{
+	struct sbfs_fd *fds = current_child->fds;
+	json_object *out = NULL;
+	off_t ret;
+
+	if (fd < 0 || fd >= MAX_FDS || fds[fd].realfd == 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (fds[fd].realfd > 0) {
+		if (fds[fd].dirlist != NULL) {
+			if (offset != 0 || whence != SEEK_SET) {
+				errno = EINVAL;
+				return -1;
+			}
+
+			// the next getdents() sees the directory as it is now
+			free_dirlist(fds[fd].dirlist);
+			fds[fd].dirlist = NULL;
+			return 0;
+		}
+
+		return lseek(fds[fd].realfd, offset, whence);
+	}
+
+	// virtual fd, our parent knows it as -realfd - 1 (see open_node)
+	ret = trampoline(&out, NS_SYS, "lseek", 3, json_object_new_int(-fds[fd].realfd - 1),
+		json_object_new_int64(offset), json_object_new_int(whence));
+	json_object_put(out);
+	return ret < 0 ? -1 : ret;
+}
+
+/* Reads up to count bytes from fd into buf, which is what we send on to the child.
+ * Data for virtual fds is decoded by trampoline_buf() straight into buf. */
+int read_node(int fd, void *buf, size_t count)
+{
+	struct sbfs_fd *fds = current_child->fds;
+	size_t len = count;
+	int ret;
+
+	if (fd < 0 || fd >= MAX_FDS || fds[fd].realfd == 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (fds[fd].realfd > 0) {
+		return read(fds[fd].realfd, buf, count);
+	}
+
+	// virtual fd, our parent knows it as -realfd - 1 (see open_node)
+	ret = trampoline_buf(buf, &len, NS_SYS, "read", 2,
+		json_object_new_int(-fds[fd].realfd - 1), json_object_new_int64(count));
+	if (ret > 0 && (size_t)ret != len) {
+		debug_error("data length mismatch\n");
+		exit(EPROTO);
+	}
+
+	return ret;
+}
+
+// real files not owned by root are presented as belonging to the sandbox
+static void mask_owner(struct stat *buf)
+{
+	if (buf->st_uid != 0) {
+		buf->st_uid = SB_UID;
+		buf->st_gid = SB_GID;
+	} else {
+		buf->st_gid = 0;
+	}
+}
+
+static int stat_path(const char *path, struct stat *buf, bool follow)
+{
+	struct sbfs_node *node = get_node(path);
+	json_object *out = NULL;
+	int ret;
+
+	set_reply_cache(path, node);
+	if (node == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (node->realpath != NULL) {
+		ret = follow ? stat(node->realpath, buf) : lstat(node->realpath, buf);
+		if (ret == 0) {
+			mask_owner(buf);
+		}
+
+		return ret;
+	}
+
+	ret = trampoline(&out, NS_SYS, follow ? "stat" : "lstat", 1, json_object_new_string(path));
+	if (ret == 0) {
+		parse_stat(out, buf);
+	}
+
+	json_object_put(out);
+	return ret;
+}
+
+int stat_node(const char *path, struct stat *buf)
+{
+	return stat_path(path, buf, true);
+}
+
+int lstat_node(const char *path, struct stat *buf)
+{
+	return stat_path(path, buf, false);
+}
+
+int access_node(const char *path, int mode)
+{
+	struct sbfs_node *node = get_node(path);
+
+	set_reply_cache(path, node);
+	if (node == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if ((mode & W_OK) && !(node->flags & SBFS_WRITABLE)) {
+		errno = EROFS;
+		return -1;
+	}
+
+	if (node->realpath != NULL) {
+		return access(node->realpath, mode);
+	}
+
+	return trampoline(NULL, NS_SYS, "access", 2, json_object_new_string(path), json_object_new_int(mode));
+}
+
+int fstat_node(int fd, struct stat *buf)
+{
+	struct sbfs_fd *fds = current_child->fds;
+	json_object *out = NULL;
+	int ret;
+
+	if (fd < 0 || fd >= MAX_FDS || fds[fd].realfd == 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (fds[fd].realfd > 0) {
+		ret = fstat(fds[fd].realfd, buf);
+		if (ret == 0) {
+			mask_owner(buf);
+		}
+
+		return ret;
+	}
+
+	// virtual fd, our parent knows it as -realfd - 1 (see open_node)
+	ret = trampoline(&out, NS_SYS, "fstat", 1, json_object_new_int(-fds[fd].realfd - 1));
+	if (ret == 0) {
+		parse_stat(out, buf);
+	}
+
+	json_object_put(out);
+	return ret;
+}
+
+/* Provides a real read-only fd the child can mmap in place of our fd. The fd is handed
+ * over as grant_fd. This is the shared cached copy if the cache is enabled, otherwise just
+ * the file reopened read-only. If the file at realpath is no longer the one we have open,
+ * a sealed copy in a memfd is made instead.
+ */
+int map_node(int fd)
+{
+	struct sbfs_fd *fds = current_child->fds;
+	struct stat statres, mapstat;
+	int mapfd = -1;
+
+	if (fd < 0 || fd >= MAX_FDS || fds[fd].realfd == 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (fds[fd].realfd < 0) {
+		// virtual files cannot be mapped
+		errno = ENODEV;
+		return -1;
+	}
+
+	if (fstat(fds[fd].realfd, &statres) != 0) {
+		return -1;
+	}
+
+	if (!S_ISREG(statres.st_mode)) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	mapfd = cache_open(fds[fd].realfd, fds[fd].node->realpath);
+	if (mapfd < 0 && fds[fd].node->realpath != NULL) {
+		mapfd = open(fds[fd].node->realpath, O_RDONLY | O_CLOEXEC);
+		if (mapfd >= 0 && (fstat(mapfd, &mapstat) != 0
+			|| mapstat.st_dev != statres.st_dev || mapstat.st_ino != statres.st_ino))
+		{
+			close(mapfd);
+			mapfd = -1;
+		}
+	}
+
+	if (mapfd < 0) {
+		mapfd = memfd_create("sbmap", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (mapfd < 0) {
+			return -1;
+		}
+
+		char buf[65536];
+		off_t off = 0;
+		ssize_t ret;
+		while ((ret = pread(fds[fd].realfd, buf, sizeof(buf), off)) > 0) {
+			if (write(mapfd, buf, ret) != ret) {
+				ret = -1;
+				break;
+			}
+
+			off += ret;
+		}
+
+		// the child only ever gets to map this privately, but seal it regardless
+		if (ret < 0 || fcntl(mapfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+			int err = errno;
+			close(mapfd);
+			errno = err;
+			return -1;
+		}
+	}
+
+	grant_fd = mapfd;
+	return 0;
+}
+
+/* Appends a linux_dirent (or linux_dirent64) record for name at off in buf, which holds count bytes.
+ * Returns the offset following the record, or 0 if the record does not fit. */
+static size_t put_dirent(char *buf, size_t off, size_t count, bool is64,
+	uint64_t ino, unsigned char type, const char *name, size_t namelen, uint64_t cookie)
+{
+	size_t reclen, fixed;
+
+	if (is64) {
+		fixed = offsetof(struct linux_dirent64, d_name);
+		reclen = DIRENT_ALIGN(fixed + namelen + 1);
+	} else {
+		fixed = offsetof(struct linux_dirent, d_name);
+		reclen = DIRENT_ALIGN(fixed + namelen + 2);
+	}
+
+	if (reclen > count - off) {
+		return 0;
+	}
+
+	// zero the name and padding first, which also NULL terminates the name
+	memset(buf + off + fixed, 0, reclen - fixed);
+	if (is64) {
+		struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+		d->d_ino = ino;
+		d->d_off = (int64_t)cookie;
+		d->d_reclen = (unsigned short)reclen;
+		d->d_type = type;
+		memcpy(d->d_name, name, namelen);
+	} else {
+		struct linux_dirent *d = (struct linux_dirent *)(buf + off);
+		d->d_ino = (unsigned long)ino;
+		d->d_off = (unsigned long)cookie;
+		d->d_reclen = (unsigned short)reclen;
+		memcpy(d->d_name, name, namelen);
+		// d_type is the last byte of the record
+		buf[off + reclen - 1] = (char)type;
+	}
+
+	return off + reclen;
+}
+
+static void dirlist_add(struct sbfs_dirlist *dirlist, uint64_t ino, unsigned char type, const char *name)
+{
+	if (dirlist->count == dirlist->cap) {
+		dirlist->cap = dirlist->cap ? dirlist->cap * 2 : 64;
+		dirlist->entries = (struct sbfs_dirent *)realloc(dirlist->entries, dirlist->cap * sizeof(struct sbfs_dirent));
+		if (dirlist->entries == NULL) {
+			fatal("Out of memory");
+		}
+	}
+
+	dirlist->entries[dirlist->count].ino = ino;
+	dirlist->entries[dirlist->count].type = type;
+	dirlist->entries[dirlist->count].name = strdup(name);
+	++dirlist->count;
+}
+
+static void free_dirlist(struct sbfs_dirlist *dirlist)
+{
+	for (size_t i = 0; i < dirlist->count; ++i) {
+		free(dirlist->entries[i].name);
+	}
+
+	free(dirlist->entries);
+	free(dirlist);
+}
+
+/* Lists the real directory open as realfd, showing what lookups under node would find:
+ * declared children shadow real entries, and real entries are subject to node's filters.
+ * The whole directory is read in one pass, using the types the kernel reports. */
+static struct sbfs_dirlist *read_dirlist(struct sbfs_node *node, int realfd)
+{
+	struct sbfs_dirlist *dirlist = (struct sbfs_dirlist *)calloc(1, sizeof(struct sbfs_dirlist));
+	char dbuf[16384];
+	struct stat statres;
+	long nread;
+
+	for (unsigned int i = 0; i < node->nchildren; ++i) {
+		struct sbfs_node *child = &node->children[i];
+		unsigned char type = (child->flags & SBFS_DIRECTORY) ? DT_DIR : DT_REG;
+		// virtual nodes have no inode, their address will do as it is at least unique
+		uint64_t ino = (uint64_t)(uintptr_t)child;
+
+		if (child->realpath != NULL && stat(child->realpath, &statres) == 0) {
+			ino = statres.st_ino;
+		}
+
+		dirlist_add(dirlist, ino, type, child->name);
+	}
+
+	if (lseek(realfd, 0, SEEK_SET) < 0) {
+		goto fail;
+	}
+
+	while ((nread = syscall(SYS_getdents64, realfd, dbuf, sizeof(dbuf))) > 0) {
+		for (long off = 0; off < nread; off += ((struct linux_dirent64 *)(dbuf + off))->d_reclen) {
+			struct linux_dirent64 *d = (struct linux_dirent64 *)(dbuf + off);
+			unsigned char type = d->d_type;
+
+			if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) {
+				dirlist_add(dirlist, d->d_ino, type, d->d_name);
+				continue;
+			}
+
+			// same rules as resolve_path and lookup_real
+			if (!(node->flags & SBFS_RECURSE) || !filter_allows(node, d->d_name, NULL)) {
+				continue;
+			}
+
+			if (node->nchildren > 0 && bsearch(d->d_name, node->children, node->nchildren,
+				sizeof(struct sbfs_node), compare_node_name) != NULL)
+			{
+				continue;
+			}
+
+			if (type == DT_LNK && !(node->flags & SBFS_FOLLOW)) {
+				continue;
+			}
+
+			// same as lookup_real: symlinks are listed as what they point to, if we follow them at all
+			if (type == DT_UNKNOWN) {
+				if (fstatat(realfd, d->d_name, &statres, AT_SYMLINK_NOFOLLOW) != 0) {
+					// gone since we read the name
+					continue;
+				}
+
+				type = IFTODT(statres.st_mode);
+				if (type == DT_LNK && !(node->flags & SBFS_FOLLOW)) {
+					continue;
+				}
+			}
+
+			if (type == DT_LNK) {
+				if (fstatat(realfd, d->d_name, &statres, 0) != 0) {
+					// dangling symlink
+					continue;
+				}
+
+				type = IFTODT(statres.st_mode);
+			}
+
+			dirlist_add(dirlist, d->d_ino, type, d->d_name);
+		}
+	}
+
+	if (nread < 0) {
+		goto fail;
+	}
+
+	return dirlist;
+
+fail:
+	free_dirlist(dirlist);
+	return NULL;
+}
+
+/* Serves getdents() for a virtual directory; our parent keeps track of the position and
+ * sends the entries packed into a string (inode as int64, type as a byte, name length as
+ * uint16 and then the name for each), which we turn into records here. */
+static int getdents_virtual(int fd, char *buf, size_t count, bool is64)
+{
+	struct sbfs_fd *fds = current_child->fds;
+	json_object *out = NULL;
+	size_t misc = is64 ? offsetof(struct linux_dirent64, d_name) + 1 : offsetof(struct linux_dirent, d_name) + 2;
+	size_t off = 0, pos = 0, len;
+	const unsigned char *data;
+	int ret;
+
+	ret = trampoline(&out, NS_SYS, "getdents", 3, json_object_new_int(-fds[fd].realfd - 1),
+		json_object_new_int64(count), json_object_new_int64(misc));
+	if (ret <= 0) {
+		json_object_put(out);
+		return ret;
+	}
+
+	if (!json_object_is_type(out, json_type_string)) {
+		debug_error("getdents data is not a string\n");
+		exit(EPROTO);
+	}
+
+	data = (const unsigned char *)json_object_get_string(out);
+	len = json_object_get_string_len(out);
+
+	while (pos < len) {
+		uint64_t ino = 0;
+		size_t namelen;
+
+		if (len - pos < 11) {
+			debug_error("Truncated getdents entry\n");
+			exit(EPROTO);
+		}
+
+		for (int i = 7; i >= 0; --i) {
+			ino = (ino << 8) | data[pos + i];
+		}
+
+		namelen = data[pos + 9] | (data[pos + 10] << 8);
+		if (len - pos - 11 < namelen) {
+			debug_error("Truncated getdents entry\n");
+			exit(EPROTO);
+		}
+
+		off = put_dirent(buf, off, count, is64, ino, data[pos + 8], (const char *)data + pos + 11, namelen, off);
+		if (off == 0) {
+			// this indicates a bug in the parent process, it
+			// should not return more data than fits in our buffer
+			debug_error("getdents() buffer overflow\n");
+			exit(EPROTO);
+		}
+
+		pos += 11 + namelen;
+	}
+
+	json_object_put(out);
+	return (int)off;
+}
+
+/* Fills buf with up to count bytes of linux_dirent (or linux_dirent64 if is64) records for
+ * the directory open as fd, continuing from where the previous call stopped. Returns the
+ * number of bytes used, 0 at the end of the directory or -1 on error. */
+int getdents_node(int fd, char *buf, size_t count, bool is64)
+{
+	struct sbfs_fd *fds = current_child->fds;
+	struct sbfs_dirlist *dirlist;
+	size_t off = 0;
+
+	if (fd < 0 || fd >= MAX_FDS || fds[fd].realfd == 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (!(fds[fd].node->flags & SBFS_DIRECTORY)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	if (fds[fd].realfd < 0) {
+		return getdents_virtual(fd, buf, count, is64);
+	}
+
+	if (fds[fd].dirlist == NULL) {
+		fds[fd].dirlist = read_dirlist(fds[fd].node, fds[fd].realfd);
+		if (fds[fd].dirlist == NULL) {
+			return -1;
+		}
+	}
+
+	dirlist = fds[fd].dirlist;
+	while (dirlist->pos < dirlist->count) {
+		struct sbfs_dirent *d = &dirlist->entries[dirlist->pos];
+		size_t next = put_dirent(buf, off, count, is64, d->ino, d->type, d->name, strlen(d->name), dirlist->pos + 1);
+		if (next == 0) {
+			break;
+		}
+
+		off = next;
+		++dirlist->pos;
+	}
+
+	if (off == 0 && dirlist->pos < dirlist->count) {
+		// not even one entry fits
+		errno = EINVAL;
+		return -1;
+	}
+
+	return (int)off;
+}
+
+/* Answers sb.manifest, which the child's import machinery (lib/sandbox/finder.py) uses instead of
+ * probing each sys.path entry with stat/open for every import. dirs is an array of absolute paths;
+ * the result maps each of them to an object of {name: 1 for directories, 0 for anything else},
+ * or to null if we cannot vouch for its contents (proxied or writable nodes, or not a directory),
+ * in which case the child goes back to asking the filesystem. */
+static json_object *build_manifest(json_object *dirs)
+{
+	json_object *manifest = json_object_new_object();
+	size_t total = 2;
+	int len = json_object_is_type(dirs, json_type_array) ? json_object_array_length(dirs) : 0;
+
+	for (int i = 0; i < len; ++i) {
+		const char *path = json_object_get_string(json_object_array_get_idx(dirs, i));
+		json_object *listing = NULL;
+
+		if (path == NULL || path[0] != '/') {
+			continue;
+		}
+
+		listing = list_dir(path);
+
+		// the reply must fit into a single datagram, leave out listings that don't fit
+		size_t needed = strlen(path) + 8;
+		if (listing != NULL) {
+			needed += strlen(json_object_to_json_string_ext(listing, JSON_C_TO_STRING_PLAIN));
+		}
+
+		if (listing != NULL && total + needed >= MANIFEST_MAX) {
+			json_object_put(listing);
+			listing = NULL;
+			needed = strlen(path) + 8;
+		}
+
+		total += needed;
+		json_object_object_add(manifest, path, listing);
+	}
+
+	return manifest;
+}
+
+/* Lists the directory at path as seen by the child, see build_manifest */
+static json_object *list_dir(const char *path)
+{
+	struct sbfs_node *node = get_node(path);
+	json_object *listing;
+
+	if (node == NULL || !(node->flags & SBFS_DIRECTORY) || (node->flags & (SBFS_PROXY | SBFS_WRITABLE))) {
+		return NULL;
+	}
+
+	listing = json_object_new_object();
+
+	// declared children shadow whatever the real directory has
+	for (unsigned int i = 0; i < node->nchildren; ++i) {
+		json_object_object_add(listing, node->children[i].name,
+			json_object_new_int((node->children[i].flags & SBFS_DIRECTORY) ? 1 : 0));
+	}
+
+	if (node->realpath == NULL || !(node->flags & SBFS_RECURSE)) {
+		return listing;
+	}
+
+	DIR *dir = opendir(node->realpath);
+	if (dir == NULL) {
+		debug_error("Cannot list %s: %s\n", node->realpath, strerror(errno));
+		json_object_put(listing);
+		return NULL;
+	}
+
+	int fd = dirfd(dir);
+	struct dirent *dent;
+	struct stat statres;
+
+	while ((dent = readdir(dir)) != NULL) {
+		bool isdir = dent->d_type == DT_DIR;
+
+		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, "..")) {
+			continue;
+		}
+
+		// same rules as lookup_real
+		if (json_object_object_get_ex(listing, dent->d_name, NULL) || !filter_allows(node, dent->d_name, NULL)) {
+			continue;
+		}
+
+		if (dent->d_type == DT_LNK && !(node->flags & SBFS_FOLLOW)) {
+			continue;
+		}
+
+		if (dent->d_type == DT_LNK || dent->d_type == DT_UNKNOWN) {
+			if (fstatat(fd, dent->d_name, &statres, (node->flags & SBFS_FOLLOW) ? 0 : AT_SYMLINK_NOFOLLOW) != 0
+				|| S_ISLNK(statres.st_mode))
+			{
+				continue;
+			}
+
+			isdir = S_ISDIR(statres.st_mode);
+		}
+
+		json_object_object_add(listing, dent->d_name, json_object_new_int(isdir ? 1 : 0));
+	}
+
+	closedir(dir);
+	return listing;
+}
+
+/* Sends the overall parent sb.stats for the current child: {"child": child_stats (what the child
+ * recorded about its syscalls, left out if NULL), "supervisor": ours}, see stats_json.
+ * child_stats is consumed. */
+static void report_stats(json_object *child_stats)
+{
+	json_object *stats = json_object_new_object();
+
+	if (child_stats != NULL) {
+		json_object_object_add(stats, "child", child_stats);
+	}
+
+	stats_print("supervisor");
+	json_object_object_add(stats, "supervisor", stats_json());
+	notify(NS_SB, "stats", 1, stats);
+	current_child->reported = true;
+}
+
+static void begin_job(void)
+{
+	for (int i = 0; i < MAX_FDS; ++i) {
+		current_child->job_fds[i] = current_child->fds[i].realfd != 0;
+	}
+}
+
+static void end_job(void)
+{
+	for (int i = 0; i < MAX_FDS; ++i) {
+		if (!current_child->job_fds[i] && current_child->fds[i].realfd != 0) {
+			close_node(i);
+		}
+	}
+}
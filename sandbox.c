@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
@@ -15,40 +16,41 @@
 
 bool is_child;
 
+static struct sb_child children[SB_MAX_CHILDREN];
+
 void sigchld_handler(int sig)
 {
-	int status;
-
 	if (is_child) {
 		// ensure we don't leave around zombies, but otherwise do nothing
 		while (waitpid(-1, NULL, WNOHANG) > 0);
 		return;
 	}
 
-	while (waitpid(-1, &status, WNOHANG) > 0) {
-		if (WIFEXITED(status)) {
-			exit(WEXITSTATUS(status));
-		}
-
-		if (WIFSIGNALED(status)) {
-			exit(-(WTERMSIG(status)));
-		}
-
-		// if we get here then the child wasn't actually terminated,
-		// so continue execution. This is in a loop just in case the child
-		// manages to set is_child back to false, so that it cannot leave
-		// zombie processes lying around; in normal execution there is only
-		// one child here to worry about.
-	}
+	// the parent reaps its children in run_parent(), which only lets this signal through
+	// while waiting for requests; all we need to do is interrupt that wait
 }
 
 int main(int argc, char *argv[])
 {
-	int ret, sv[2];
+	int ret, opt, sv[2];
+	unsigned int count = 1;
 	uid_t ruid, euid, suid;
 	gid_t rgid, egid, sgid;
 	pid_t pid;
 
+	/* -n N serves N sandboxed children from a single parent process instead of just one,
+	 * anything after the options is ignored */
+	while ((opt = getopt(argc, argv, "+n:")) != -1) {
+		if (opt == 'n') {
+			count = (unsigned int)strtoul(optarg, NULL, 10);
+		}
+
+		if (opt != 'n' || count < 1 || count > SB_MAX_CHILDREN) {
+			fprintf(stderr, "Usage: %s [-n children (1-%d)] ...\n", argv[0], SB_MAX_CHILDREN);
+			return 1;
+		}
+	}
+
 	/* verify that fds 3 and 4 have been opened for us */
 	ret = fcntl(PIPEIN, F_GETFD);
 	if (ret < 0) {
@@ -94,16 +96,6 @@ int main(int argc, char *argv[])
 		return -errno;
 	}
 
-	/* create a new socketpair for communicating between our parent/child process (comms
-	 * to the process that created us still happens on fds 3 and 4, which our child does not
-	 * inherit).
-	 */
-	ret = socketpair(AF_UNIX, SOCK_DGRAM, 0, sv);
-	if (ret < 0) {
-		fprintf(stderr, "%s: Error with socketpair: %s.\n", argv[0], strerror(errno));
-		return -errno;
-	}
-
 	/* register our SIGCHLD handler pre-fork just in case the child exits before the handler
 	 * can get set up in the parent. The child really has no use for the handler.
 	 */
@@ -117,14 +109,35 @@ int main(int argc, char *argv[])
 		return -errno;
 	}
 
-	/* split into a parent and child with fork(); the parent is responsible for handling
-	 * most of the virtualization (only talking with the parent's parent when needed) and
-	 * the child is what is running the actual sandbox.
-	 */
-	pid = fork();
-	if (pid < 0) {
-		fprintf(stderr, "%s: Error with fork: %s.\n", argv[0], strerror(errno));
-		return -errno;
+	for (unsigned int i = 0; i < count; ++i) {
+		/* create a new socketpair for communicating between our parent/child process (comms
+		 * to the process that created us still happens on fds 3 and 4, which our child does not
+		 * inherit).
+		 */
+		ret = socketpair(AF_UNIX, SOCK_DGRAM, 0, sv);
+		if (ret < 0) {
+			fprintf(stderr, "%s: Error with socketpair: %s.\n", argv[0], strerror(errno));
+			return -errno;
+		}
+
+		/* split into a parent and child with fork(); the parent is responsible for handling
+		 * most of the virtualization (only talking with the parent's parent when needed) and
+		 * the child is what is running the actual sandbox.
+		 */
+		pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "%s: Error with fork: %s.\n", argv[0], strerror(errno));
+			return -errno;
+		}
+
+		if (pid == 0) {
+			break;
+		}
+
+		close(sv[1]);
+		children[i].pid = pid;
+		children[i].socket = sv[0];
+		children[i].index = i;
 	}
 
 	if (pid == 0) {
@@ -135,6 +148,11 @@ int main(int argc, char *argv[])
 			return -errno;
 		}
 
+		/* nor does it get to talk to the children started before it */
+		for (unsigned int i = 0; i < count && children[i].pid != 0; ++i) {
+			close(children[i].socket);
+		}
+
 		ret = close(PIPEIN);
 		if (ret < 0) {
 			fprintf(stderr, "%s: Error closing pipe: %s.\n", argv[0], strerror(errno));
@@ -171,9 +189,8 @@ int main(int argc, char *argv[])
 		ret = run_child();
 	} else {
 		/* parent */
-		close(sv[1]);
 		is_child = false;
-		ret = run_parent(pid, sv[0]);
+		ret = run_parent(children, count);
 	}
 
 	return ret;
@@ -0,0 +1,135 @@
+// arena allocator for data which lives as long as the parent does (the declared filesystem tree)
+// allocations are carved out of large chunks and never freed individually, and strings are
+// interned so that names repeated across the tree (lib, __init__.py, ...) are only stored once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sbcontext.h"
+
+#define ARENA_CHUNK 65536 /* size of a regular chunk, larger allocations get a chunk of their own */
+#define ARENA_ALIGN 16 /* must be a power of 2 */
+
+struct chunk {
+	struct chunk *next;
+	size_t used;
+	size_t size;
+	// data follows, aligned to ARENA_ALIGN
+};
+
+#define CHUNK_HEADER ((sizeof(struct chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static struct chunk *chunks = NULL;
+
+// open addressing hash table of interned strings
+static char **strings = NULL;
+static size_t nstrings = 0;
+static size_t stringcap = 0; // always 0 or a power of 2
+
+static void *arena_take(size_t size, size_t align)
+{
+	struct chunk *chunk = chunks;
+	size_t offset = 0;
+
+	if (chunk != NULL) {
+		offset = (chunk->used + align - 1) & ~(align - 1);
+	}
+
+	if (chunk == NULL || offset > chunk->size || chunk->size - offset < size) {
+		size_t chunksize = size > ARENA_CHUNK - CHUNK_HEADER ? size : ARENA_CHUNK - CHUNK_HEADER;
+
+		chunk = (struct chunk *)malloc(CHUNK_HEADER + chunksize);
+		if (chunk == NULL) {
+			fatal("Out of memory");
+		}
+
+		chunk->used = 0;
+		chunk->size = chunksize;
+		offset = 0;
+
+		if (chunks != NULL && size > ARENA_CHUNK - CHUNK_HEADER) {
+			// dedicated chunk, keep allocating from the current one afterwards
+			chunk->next = chunks->next;
+			chunks->next = chunk;
+		} else {
+			chunk->next = chunks;
+			chunks = chunk;
+		}
+	}
+
+	chunk->used = offset + size;
+	return (char *)chunk + CHUNK_HEADER + offset;
+}
+
+/* Returns size bytes of zeroed memory that stays valid for the rest of the process */
+void *arena_alloc(size_t size)
+{
+	return memset(arena_take(size, ARENA_ALIGN), 0, size);
+}
+
+static size_t intern_hash(const char *s)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (; *s != '\0'; ++s) {
+		hash ^= (unsigned char)*s;
+		hash *= 1099511628211ULL;
+	}
+
+	return (size_t)hash;
+}
+
+static void intern_grow(void)
+{
+	size_t oldcap = stringcap;
+	char **old = strings;
+
+	stringcap = stringcap ? stringcap * 2 : 1024;
+	strings = (char **)calloc(stringcap, sizeof(char *));
+	if (strings == NULL) {
+		fatal("Out of memory");
+	}
+
+	for (size_t i = 0; i < oldcap; ++i) {
+		if (old[i] == NULL)
+			continue;
+
+		size_t slot = intern_hash(old[i]) & (stringcap - 1);
+		while (strings[slot] != NULL) {
+			slot = (slot + 1) & (stringcap - 1);
+		}
+
+		strings[slot] = old[i];
+	}
+
+	free(old);
+}
+
+/* Returns a copy of s in the arena, which is shared with every other call for an equal string.
+ * The result must not be modified or free()d. */
+char *arena_intern(const char *s)
+{
+	size_t slot;
+
+	// keep the load factor under 3/4
+	if ((nstrings + 1) * 4 > stringcap * 3) {
+		intern_grow();
+	}
+
+	for (slot = intern_hash(s) & (stringcap - 1); strings[slot] != NULL; slot = (slot + 1) & (stringcap - 1)) {
+		if (!strcmp(strings[slot], s)) {
+			return strings[slot];
+		}
+	}
+
+	size_t len = strlen(s) + 1;
+	strings[slot] = (char *)memcpy(arena_take(len, 1), s, len);
+	++nstrings;
+	return strings[slot];
+}
@@ -0,0 +1,271 @@
+// base64 decoding for data our parent sends us (file contents, mostly)
+// the bulk of the input is decoded 16 or 32 characters at a time with SSSE3 or AVX2, picked at
+// runtime depending on what the cpu supports, or 4 characters at a time without either.
+// whatever those cannot handle (padding, whitespace, invalid input and the last few characters)
+// goes through the table-driven decoder, which decides whether the input as a whole is valid.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SB_BASE64_SIMD
+#endif
+
+#include "sbcontext.h"
+
+// base64 decode routine from wikibooks
+// code was released into the public domain there
+
+#define WHITESPACE 64
+#define EQUALS     65
+#define INVALID    66
+
+static const unsigned char d[] = {
+    66,66,66,66,66,66,66,66,66,66,64,66,66,66,66,66,66,66,66,66,66,66,66,66,66,
+    66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,62,66,66,66,63,52,53,
+    54,55,56,57,58,59,60,61,66,66,66,65,66,66,66, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+    10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,66,66,66,66,66,66,26,27,28,
+    29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47,48,49,50,51,66,66,
+    66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,
+    66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,
+    66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,
+    66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,
+    66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,
+    66,66,66,66,66,66
+};
+
+static int decode_tail(const char *in, size_t inLen, unsigned char *out, size_t *outLen)
+{
+    const char *end = in + inLen;
+    char iter = 0;
+    size_t buf = 0, len = 0;
+
+    while (in < end) {
+        unsigned char c = d[(unsigned char)*in++];
+
+        switch (c) {
+        case WHITESPACE: continue;   /* skip whitespace */
+        case INVALID:    return 1;   /* invalid input, return error */
+        case EQUALS:                 /* pad character, end of data */
+            in = end;
+            continue;
+        default:
+            buf = buf << 6 | c;
+            iter++; // increment the number of iteration
+            /* If the buffer is full, split it into bytes */
+            if (iter == 4) {
+                if ((len += 3) > *outLen) return 1; /* buffer overflow */
+                *(out++) = (buf >> 16) & 255;
+                *(out++) = (buf >> 8) & 255;
+                *(out++) = buf & 255;
+                buf = 0; iter = 0;
+
+            }
+        }
+    }
+
+    if (iter == 3) {
+        if ((len += 2) > *outLen) return 1; /* buffer overflow */
+        *(out++) = (buf >> 10) & 255;
+        *(out++) = (buf >> 2) & 255;
+    }
+    else if (iter == 2) {
+        if (++len > *outLen) return 1; /* buffer overflow */
+        *(out++) = (buf >> 4) & 255;
+    }
+
+    *outLen = len; /* modify to reflect the actual output size */
+    return 0;
+}
+
+/* Block decoders: decode whole blocks from the start of in into out (which has room for outcap
+ * bytes) for as long as they only contain base64 characters. They return the number of bytes
+ * written and set *consumed to the number of characters decoded, which is a multiple of 4.
+ */
+typedef size_t (*decode_fn)(const char *in, size_t inlen, unsigned char *out, size_t outcap, size_t *consumed);
+
+// 4 characters at a time, with one check for all of them
+static size_t decode_scalar(const char *in, size_t inlen, unsigned char *out, size_t outcap, size_t *consumed)
+{
+	const unsigned char *s = (const unsigned char *)in;
+	size_t done = 0, written = 0;
+	uint32_t a, b, c, e;
+
+	while (inlen - done >= 4 && outcap - written >= 3) {
+		a = d[s[done]];
+		b = d[s[done + 1]];
+		c = d[s[done + 2]];
+		e = d[s[done + 3]];
+		if ((a | b | c | e) > 63) {
+			break;
+		}
+
+		a = a << 18 | b << 12 | c << 6 | e;
+		out[written] = a >> 16;
+		out[written + 1] = a >> 8;
+		out[written + 2] = a;
+		done += 4;
+		written += 3;
+	}
+
+	*consumed = done;
+	return written;
+}
+
+#ifdef SB_BASE64_SIMD
+/* The vector decoders follow Wojciech Muła's approach (as used by aklomp/base64): characters are
+ * classified by their nibbles with two table lookups, which also rejects everything that is not
+ * in the alphabet, then shifted onto their 6-bit values with a third and packed with multiplies.
+ * Each block is stored as a full vector, so they stop while there is room for one more.
+ */
+
+__attribute__((target("ssse3")))
+static size_t decode_ssse3(const char *in, size_t inlen, unsigned char *out, size_t outcap, size_t *consumed)
+{
+	const __m128i lut_lo = _mm_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i pack = _mm_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m128i mask_2f = _mm_set1_epi8(0x2f);
+	size_t done = 0, written = 0;
+	__m128i str, hi_nibbles, lo_nibbles, hi, lo, roll;
+
+	while (inlen - done >= 16 && outcap - written >= 16) {
+		str = _mm_loadu_si128((const __m128i *)(in + done));
+		hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+		lo_nibbles = _mm_and_si128(str, mask_2f);
+		hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+		if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0) {
+			break;
+		}
+
+		// '/' shares its high nibble with '+' but needs a different offset
+		roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(str, mask_2f), hi_nibbles));
+		str = _mm_add_epi8(str, roll);
+
+		// 4 x 6 bits -> 24 bits in each 32-bit lane, then drop the empty byte of each
+		str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+		str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+		str = _mm_shuffle_epi8(str, pack);
+		_mm_storeu_si128((__m128i *)(out + written), str);
+
+		done += 16;
+		written += 12;
+	}
+
+	*consumed = done;
+	return written;
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(const char *in, size_t inlen, unsigned char *out, size_t outcap, size_t *consumed)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i pack = _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+	size_t done = 0, written = 0;
+	__m256i str, hi_nibbles, lo_nibbles, hi, lo, roll;
+
+	while (inlen - done >= 32 && outcap - written >= 32) {
+		str = _mm256_loadu_si256((const __m256i *)(in + done));
+		hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+		lo_nibbles = _mm256_and_si256(str, mask_2f);
+		hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm256_testz_si256(lo, hi)) {
+			break;
+		}
+
+		roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(str, mask_2f), hi_nibbles));
+		str = _mm256_add_epi8(str, roll);
+
+		str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+		str = _mm256_shuffle_epi8(str, pack);
+		// 12 bytes in each half, move them next to each other
+		str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+		_mm256_storeu_si256((__m256i *)(out + written), str);
+
+		done += 32;
+		written += 24;
+	}
+
+	*consumed = done;
+	return written;
+}
+#endif
+
+static decode_fn decode_block = NULL;
+
+static void pick_decoder(void)
+{
+	decode_block = decode_scalar;
+
+#ifdef SB_BASE64_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		decode_block = decode_avx2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		decode_block = decode_ssse3;
+	}
+#endif
+}
+
+/* Decodes inLen characters of base64 from in into out, which has room for *outLen bytes.
+ * Whitespace is skipped and decoding stops at the first '='. On success, *outLen is set to
+ * the number of bytes decoded and 0 is returned; 1 is returned if the input is invalid or
+ * does not fit. out may be written to even then.
+ */
+int base64decode(const char *in, size_t inLen, unsigned char *out, size_t *outLen)
+{
+	size_t done, written, len;
+
+	if (decode_block == NULL) {
+		pick_decoder();
+	}
+
+	written = decode_block(in, inLen, out, *outLen, &done);
+
+	// the vector decoders leave a few blocks near the end of out, where they cannot store whole vectors
+	written += decode_scalar(in + done, inLen - done, out + written, *outLen - written, &len);
+	done += len;
+
+	// the block decoders only stop at a block boundary, so this picks up right where they left off
+	len = *outLen - written;
+	if (decode_tail(in + done, inLen - done, out + written, &len)) {
+		return 1;
+	}
+
+	*outLen = written + len;
+	return 0;
+}
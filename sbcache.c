@@ -0,0 +1,128 @@
+// host-wide cache of read-only file contents, shared by every sandbox on the host
+// when a cache directory is configured (getlimits "cachedir", ideally on tmpfs), real files
+// handed to the child as fds are first copied into it and the child is given the copy instead.
+// entries are keyed by realpath, inode and mtime, so the second sandbox to use a file finds it
+// already resident and maps the same pages instead of making a copy of its own.
+// the directory can be emptied at any time, fds to removed entries remain valid.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sbcontext.h"
+
+#define CACHE_MAX_FILE 67108864 /* files larger than this (64 MiB) are never cached */
+
+static int cachedirfd = -1;
+
+/* Enables the cache, using dir to store entries. If dir cannot be used,
+ * the cache remains disabled (which only costs us performance). */
+void cache_init(const char *dir)
+{
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		debug_error("Unable to create cache directory %s: %s\n", dir, strerror(errno));
+		return;
+	}
+
+	cachedirfd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (cachedirfd < 0) {
+		debug_error("Unable to open cache directory %s: %s\n", dir, strerror(errno));
+	}
+}
+
+static uint64_t cache_hash(uint64_t hash, const void *data, size_t len)
+{
+	// FNV-1a
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= ((const unsigned char *)data)[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/* Copies realfd into a new entry called name, returning a read-only fd to it or -1 */
+static int cache_fill(int realfd, const char *name, off_t size)
+{
+	char tmpname[64], buf[65536];
+	off_t off = 0;
+	ssize_t ret = 0;
+	int fd;
+
+	// several sandboxes may fill the same entry at once, each writes its own copy
+	// and the last rename wins (they all have the same contents anyway)
+	snprintf(tmpname, sizeof(tmpname), ".%s.%d", name, (int)getpid());
+	fd = openat(cachedirfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0444);
+	if (fd < 0) {
+		return -1;
+	}
+
+	while (off < size && (ret = pread(realfd, buf, sizeof(buf), off)) > 0) {
+		if (write(fd, buf, ret) != ret) {
+			ret = -1;
+			break;
+		}
+
+		off += ret;
+	}
+
+	close(fd);
+
+	if (ret < 0 || off != size || renameat(cachedirfd, tmpname, cachedirfd, name) != 0) {
+		unlinkat(cachedirfd, tmpname, 0);
+		return -1;
+	}
+
+	return openat(cachedirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+/* Returns a read-only fd to a cached copy of the regular file realfd (opened from realpath),
+ * filling the cache if needed, or -1 if the cache is disabled or cannot be used for this file.
+ * In that case the caller should go on to use realfd itself.
+ */
+int cache_open(int realfd, const char *realpath)
+{
+	struct stat statres, cachestat;
+	uint64_t hash = 14695981039346656037ULL;
+	char name[17];
+	int fd;
+
+	if (cachedirfd < 0 || realpath == NULL) {
+		return -1;
+	}
+
+	if (fstat(realfd, &statres) != 0 || !S_ISREG(statres.st_mode) || statres.st_size > CACHE_MAX_FILE) {
+		return -1;
+	}
+
+	hash = cache_hash(hash, realpath, strlen(realpath));
+	hash = cache_hash(hash, &statres.st_dev, sizeof(statres.st_dev));
+	hash = cache_hash(hash, &statres.st_ino, sizeof(statres.st_ino));
+	hash = cache_hash(hash, &statres.st_size, sizeof(statres.st_size));
+	hash = cache_hash(hash, &statres.st_mtim, sizeof(statres.st_mtim));
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+
+	fd = openat(cachedirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		fd = cache_fill(realfd, name, statres.st_size);
+		if (fd < 0) {
+			return -1;
+		}
+	}
+
+	// cheap sanity check against truncated or foreign entries
+	if (fstat(fd, &cachestat) != 0 || !S_ISREG(cachestat.st_mode) || cachestat.st_size != statres.st_size) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
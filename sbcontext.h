@@ -36,19 +36,57 @@
 /* sandboxed child talks to its parent on this fd; it's a socket unlike the above */
 #define RPCSOCK 3
 
+/* Real fds granted to the child by its parent (see SBFS_PASSTHROUGH) are passed over RPCSOCK
+ * with SCM_RIGHTS. The kernel installs them at the lowest free fd, which is always SB_TRANSIT_FD
+ * as fds 0-3 are kept open, and the child immediately moves them into the grant range
+ * [SB_GRANT_FD_MIN, SB_GRANT_FD_MIN + SB_GRANT_FDS). seccomp allows reading from descriptors in
+ * that range directly. SB_GRANT_FDS must be a power of 2 and SB_GRANT_FD_MIN a multiple of it.
+ */
+#define SB_TRANSIT_FD 4
+#define SB_GRANT_FD_MIN 512
+#define SB_GRANT_FDS 512
+
+/* when the parent configures a stdlib archive (getlimits "archive"), it appears under this name
+ * in the root directory and the child adds it to PYTHONPATH before initializing python */
+#define SB_ARCHIVE_NAME "sandbox-stdlib.zip"
+
+/* largest buffer getdents() fills in one go, the records must fit into a single response */
+#define SB_GETDENTS_MAX 32768
+
+/* largest read() we pass on in one go, for the same reason; shorter reads are fine for callers.
+ * This is also the most the child reads ahead for a file (see readahead_max). */
+#define SB_READ_MAX 131072
+
+/* Responses to syscalls (see serve_request) carry the child's cache epoch and how long the child
+ * may keep the answer, one of the following. Entries kept for the epoch are dropped as soon as
+ * a response arrives with a different one; the supervisor moves it on whenever the nodes that the
+ * overall parent answers for (proxy and virtual nodes) could have changed, see fs_changed.
+ */
+#define SB_CACHE_NONE      0 /* not to be kept */
+#define SB_CACHE_EPOCH     1 /* valid until the epoch changes */
+#define SB_CACHE_IMMUTABLE 2 /* valid for good */
+
 /* default resource usage limits by sandbox, 200 MiB of memory and 5 seconds of cpu time
  * these can be modified (increased or decreased) by configuration passed to parent
  */
 #define DEF_MEMORY 209715200
 #define DEF_CPU 5
 
+/* the user and group the sandbox believes it is running as, real files not owned by root
+ * are presented as being owned by these. Must match libsbpreload.c and Constants.php */
+#define SB_UID 1000
+#define SB_GID 1000
+
+struct sb_child;
+
 int run_child();
-int run_parent(pid_t child_pid, int child_socket);
+int run_parent(struct sb_child *children, unsigned int count);
 intptr_t dispatch(intptr_t (*func)(va_list), ...);
 void fatal(const char *msg) __attribute__ ((noreturn));
 void _debug_backtrace();
 
 extern _Bool is_child;
+extern unsigned int readahead_max; // child: largest block read ahead for a file, 0 to disable
 
 #define SBFS_FOLLOW    0x0001 /* filter: follow symlinks */
 #define SBFS_RECURSE   0x0002 /* filter: allow recursion into real subdirectories */
@@ -58,55 +96,240 @@ extern _Bool is_child;
 #define SBFS_DIRECTORY 0x0400 /* marks this node as a directory; if unset indicates node is a file */
 #define SBFS_CLOEXEC   0x0800 /* close-on-exec flag for virtual nodes */
 #define SBFS_NOCLOSE   0x1000 /* node cannot be closed (used for virtual stdin/stdout/stderr) */
+#define SBFS_PASSTHROUGH 0x2000 /* read-only real files are handed to the child as real fds */
+#define SBFS_UNCACHED  0x4000 /* node is not in the dentry cache, so nothing under it can be */
+#define SBFS_ORPHAN    0x8000 /* node was dropped by the dentry cache while fds still refer to it */
+#define SBFS_PYCACHE   0x10000 /* virtual __pycache__ directory served from the bytecode cache */
+#define SBFS_READAHEAD 0x20000 /* virtual fd the child reads ahead, see node_readahead */
 
 #define MAX_FDS 64
 
+/* number of filter patterns on a single node tracked in filter_live, any further ones are slower
+ * to match (see sbfilter.c) */
+#define SBFS_MAX_FILTERS 64
+
 // FNM_EXTMATCH is a GNU extension to fnmatch(), don't use if it doesn't exist
 #ifndef FNM_EXTMATCH
 #define FNM_EXTMATCH 0
 #endif
 
+/* Nodes declared by getfs live in the arena (sbarena.c) and are never freed. Nodes found
+ * during lookup are malloc()d and owned by the dentry cache, or by the open fds referring
+ * to them once the cache lets go of them (see node_get/node_put).
+ */
 struct sbfs_node {
 	char *name;
 	char *realpath; // usually NULL if virtual node (might not be if it is also a proxy node)
 	struct sbfs_node *parent; // parent node (root's parent is root, not NULL)
-	struct sbfs_node *child; // first child or NULL
-	struct sbfs_node *next; // next sibling or NULL
-	char **filter; // filters that apply to real children or NULL if no filters
+	struct sbfs_node *children; // array of nchildren declared children sorted by name, or NULL
+	struct sbfs_filter *filter; // filters that apply to real children or NULL if no filters (see sbfilter.c)
+	unsigned int nchildren;
 	unsigned int flags; // bitfield of SBFS_* constants
+	unsigned int filter_depth; // which component of the filter patterns applies to our children, 0 if we own filter
+	unsigned int dcache_refs; // number of cached nodes that have this node as their parent
+	unsigned int refs; // number of open fds referring to this node
+	int dirfd; // O_PATH fd of realpath used to look up real children, or 0 if not opened (see dcache_dirfd)
+	const struct sb_child *owner; // child whose parent told us about this node (see lookup_proxy), NULL if shared
+	uint64_t filter_live; // bitmask of filter patterns that still apply to our children
 };
 
 struct sbfs_fd {
 	int realfd; // the real fd for this, -1 if virtual or 0 for invalid fd
-	struct sbfs_node *node; // name and realpath are deep copied, those and node itself must be free()d.
+	unsigned int flags; // SBFS_CLOEXEC, SBFS_READAHEAD or 0
+	struct sbfs_node *node; // shared with the tree, we hold a reference to it (see node_get)
+	struct sbfs_dirlist *dirlist; // listing of a real directory being read with getdents, or NULL
+};
+
+/* most children a single supervisor can be asked to run (sandbox -n N) */
+#define SB_MAX_CHILDREN 32
+
+/* A sandboxed child and everything our parent process keeps for it. One supervisor can serve
+ * several children (see run_parent); they share the node tree and the dentry cache, except for
+ * whatever was looked up in proxy nodes, which only the child that asked gets to see.
+ */
+struct sb_child {
+	pid_t pid;
+	int socket; // our end of the socketpair, the child has the other end as RPCSOCK
+	unsigned int index; // identifies the child to the overall parent (see sb.select)
+	_Bool exited;
+	_Bool dropped; // we stopped serving it and are waiting for it to exit
+	struct sbfs_fd fds[MAX_FDS];
+	_Bool job_fds[MAX_FDS]; // fds that were open when the current job started (zygote mode)
+	unsigned int epoch; // sent with every response, see SB_CACHE_EPOCH
+	_Bool reported; // sent its call statistics at least once (see sb.stats)
 };
 
 extern struct sbfs_node root;
-extern struct sbfs_node proxy;
-extern struct sbfs_fd fds[MAX_FDS];
+extern struct sb_child *current_child; // child whose request is being handled
+extern unsigned int nchildren; // number of children the supervisor was started with
+extern int grant_fd; // real fd to pass to the child along with the current response, or -1
+extern int reply_cache; // how long the child may keep the current response (SB_CACHE_*)
 
 int open_node(const char *pathname, int flags, int mode);
 int read_node(int fd, void *buf, size_t count);
+int pread_node(int fd, void *buf, size_t count, off_t offset);
 int write_node(int fd, const void *buf, size_t count);
 int stat_node(const char *path, struct stat *buf);
 int fstat_node(int fd, struct stat *buf);
 int lstat_node(const char *path, struct stat *buf);
+int access_node(const char *path, int mode);
 int close_node(int fd);
+off_t lseek_node(int fd, off_t offset, int whence);
+off_t node_readahead(int fd, int flags);
+int map_node(int fd);
+int getdents_node(int fd, char *buf, size_t count, _Bool is64);
 
-/* External API (Parent <-> Overall parent) */
 struct json_object;
 
+/* Shared content cache (sbcache.c) */
+void cache_init(const char *dir);
+int cache_open(int realfd, const char *realpath);
+
+/* Shared bytecode cache (sbpycache.c) */
+void pycache_init(const char *dir);
+_Bool pycache_handles(const struct sbfs_node *cur, const char *name);
+struct sbfs_node *pycache_lookup(struct sbfs_node *cur, const char *name);
+
+/* Child-side stat cache (sbscache.c) */
+void scache_flush(void);
+void scache_epoch(unsigned int current);
+_Bool scache_stat(const char *path, _Bool follow, struct stat *buf, int *err);
+_Bool scache_access(const char *path, int mode, int *err);
+_Bool scache_missing(const char *path);
+void scache_add_stat(const char *path, _Bool follow, int err, const struct stat *buf, int cache);
+void scache_add_access(const char *path, int mode, int err, int cache);
+
+/* Call statistics (sbstats.c) */
+struct sb_hist;
+extern uint64_t stats_bytes; // child: bytes received from our parent for the syscall being handled
+uint64_t stats_now(void);
+void stats_record(struct sb_hist *hist, uint64_t start, uint64_t bytes);
+struct sb_hist *stats_syscall(int nr);
+struct sb_hist *stats_method(int ns, const char *fname);
+void stats_reset(void);
+struct json_object *stats_json(void);
+void stats_print(const char *who);
+
+/* Arena (sbarena.c) */
+void *arena_alloc(size_t size);
+char *arena_intern(const char *s);
+
+/* Compiled filters (sbfilter.c) */
+struct sbfs_filter *filter_compile(const char **patterns, unsigned int count);
+void filter_free(struct sbfs_filter *filter);
+_Bool filter_allows(const struct sbfs_node *node, const char *name, uint64_t *live);
+
+/* Dentry cache (sbdcache.c) */
+void dcache_begin(void);
+_Bool dcache_lookup(struct sbfs_node *parent, const char *name, struct sbfs_node **node);
+void dcache_insert(struct sbfs_node *parent, const char *name, struct sbfs_node *node);
+void free_node(struct sbfs_node *node);
+void node_get(struct sbfs_node *node);
+void node_put(struct sbfs_node *node);
+int dcache_dirfd(struct sbfs_node *node);
+void dcache_forget(const struct sb_child *child);
+void dcache_forget_missing(const struct sb_child *child);
+
+/* External API (Parent <-> Overall parent) */
+
 /* The varargs in trampoline should all be json_object *'s.
  * If an error occurs, trampoline will set errno and return -1.
  * If out is not NULL, the response json_object * will be set there,
  * it is the caller's responsibility to free it with json_object_put().
+ * Any number of calls can be outstanding at once (see trampoline_async), the overall parent
+ * may answer them in any order and responses are matched to calls by id.
  * NOTE: these functions only work on the parent process, calling from child will
  * result in sandbox termination.
  */
+typedef void (*sb_callback)(void *ctx, int code, int err, struct json_object *data);
+
 int trampoline(struct json_object **out, int ns, const char *fname, int numargs, ...);
+int trampoline_buf(void *buf, size_t *len, int ns, const char *fname, int numargs, ...);
+void trampoline_async(int ns, const char *fname, struct json_object *args, sb_callback done, void *ctx);
+void trampoline_cancel(void *ctx);
+void trampoline_receive(void);
+_Bool trampoline_buffered(void);
+void notify(int ns, const char *fname, int numargs, ...);
 int writejson(const char *json);
 int readjson(struct json_object **out);
+_Bool readjson_buffered(void);
+int parse_stat(struct json_object *data, struct stat *buf);
 int base64decode(const char *in, size_t inLen, unsigned char *out, size_t *outLen);
+void negotiate_protocol(void);
+
+/* Child -> parent API. Works like trampoline() (args being a json array, and consumed),
+ * but goes through our parent, which forwards anything it does not handle itself upstream.
+ * Only usable in the child.
+ */
+int sbcall(struct json_object **out, int ns, const char *fname, struct json_object *args);
+
+/* Wire protocols spoken with the overall parent. JSON (newline-delimited JSON-RPC 2.0)
+ * is always used until negotiate_protocol() has run, and remains the fallback if the
+ * overall parent does not understand sb.negotiate or does not opt into anything else.
+ * Negotiation is a regular JSON-RPC call: sb.negotiate(["binary", "json"]), whose
+ * result data is the name of the protocol to use from the next message onwards.
+ * Either way, calls we don't need an answer for are sent as notifications (JSON-RPC requests
+ * without an id, or SBF_NOTIFY frames) and the overall parent must not respond to those.
+ */
+#define SB_PROTO_JSON   0
+#define SB_PROTO_BINARY 1
+
+/* Binary framing: every message is a struct sb_frame followed by len bytes of payload.
+ * Integers are in host byte order (little-endian on every arch we support).
+ * SBF_CALL payload: the method name without its namespace prefix (namelen bytes,
+ *   not NULL terminated), followed by each argument as a tagged value.
+ * SBF_NOTIFY payload: same as SBF_CALL, but the call is not answered (id is 0).
+ * SBF_RESULT payload: int32 code, int32 errno, then the data as a single tagged value.
+ * SBF_ERROR payload: int32 code (an errno, or a JSON-RPC error code in -32768..-32000),
+ *   then the message as a tagged value.
+ * Tagged values are a one byte SBV_* tag, followed by:
+ *   SBV_NULL - nothing
+ *   SBV_INT  - int64
+ *   SBV_STR  - uint32 length and that many bytes (binary safe, no encoding)
+ *   SBV_JSON - uint32 length and that many bytes of JSON text (arrays, objects, ...)
+ *   SBV_STAT - struct sb_stat
+ * trampoline() hands SBV_STAT values to its caller as a string holding the raw struct sb_stat,
+ * use parse_stat() to turn either form of stat result into a struct stat.
+ */
+struct sb_frame {
+	uint32_t len;
+	uint32_t id;
+	uint8_t type;
+	uint8_t ns;
+	uint16_t namelen;
+};
+
+#define SBF_CALL   1
+#define SBF_RESULT 2
+#define SBF_ERROR  3
+#define SBF_NOTIFY 4
+
+#define SBV_NULL 'n'
+#define SBV_INT  'i'
+#define SBV_STR  's'
+#define SBV_JSON 'j'
+#define SBV_STAT 't'
+
+/* fixed-layout stat record, fields are in the same order as PHP's stat()
+ * with the nanosecond parts of the timestamps following */
+struct sb_stat {
+	int64_t dev;
+	int64_t ino;
+	int64_t mode;
+	int64_t nlink;
+	int64_t uid;
+	int64_t gid;
+	int64_t rdev;
+	int64_t size;
+	int64_t atime;
+	int64_t mtime;
+	int64_t ctime;
+	int64_t blksize;
+	int64_t blocks;
+	int64_t atime_nsec;
+	int64_t mtime_nsec;
+	int64_t ctime_nsec;
+};
 
 /* architecture-dependent macros to manipulate registers given a ucontext_t
  * register mapping lifted from man syscall(2) and browsing ucontext.h source
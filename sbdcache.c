@@ -0,0 +1,292 @@
+// dentry cache for the parent's virtual filesystem
+// maps (parent node, name) to the node found there, or to nothing at all (negative entries)
+// so that repeated lookups don't need to hit the real filesystem or our own parent again
+// the cache is shared by every child we serve, except that what our parent says about proxy
+// nodes only applies to the child it said it for (see dentry_owner)
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sbcontext.h"
+
+#define DCACHE_SIZE 4096 /* max number of entries */
+#define DCACHE_BUCKETS 4096 /* must be a power of 2 */
+#define DCACHE_DIRFDS 256 /* max number of directory fds kept open, see dcache_dirfd() */
+
+struct dentry {
+	struct sbfs_node *parent;
+	char *name;
+	struct sbfs_node *node; // NULL for a negative entry
+	const struct sb_child *owner; // child this entry is visible to, NULL for every child
+	struct dentry *next; // next entry in the same bucket
+	unsigned int epoch; // last resolution this entry was used in
+	bool referenced; // clock bit, cleared as the hand passes over the entry
+	bool used;
+};
+
+static struct dentry entries[DCACHE_SIZE];
+static struct dentry *buckets[DCACHE_BUCKETS];
+static unsigned int hand = 0;
+static unsigned int epoch = 0;
+static unsigned int ndirfds = 0;
+
+// nodes which could not be cached, these live until the next resolution starts
+static struct sbfs_node **transient = NULL;
+static size_t ntransient = 0;
+static size_t transientcap = 0;
+
+static unsigned int dcache_hash(const struct sbfs_node *parent, const char *name)
+{
+	// FNV-1a over the name, seeded with the parent pointer
+	uint64_t hash = 14695981039346656037ULL ^ (uint64_t)(uintptr_t)parent;
+
+	for (; *name != '\0'; ++name) {
+		hash ^= (unsigned char)*name;
+		hash *= 1099511628211ULL;
+	}
+
+	return (unsigned int)(hash ^ (hash >> 32)) & (DCACHE_BUCKETS - 1);
+}
+
+/* Which child a lookup under parent is for. Proxy nodes are answered by our parent on behalf of
+ * the child asking, everything below a node inherits the owner of that node. */
+static const struct sb_child *dentry_owner(const struct sbfs_node *parent)
+{
+	return (parent->flags & SBFS_PROXY) ? current_child : parent->owner;
+}
+
+/* Frees a node created during lookup. The node owns its name and realpath, and its filter
+ * if it was compiled for this node (real children share the filter of the node above them). */
+void free_node(struct sbfs_node *node)
+{
+	if (node->dirfd > 0) {
+		close(node->dirfd);
+		--ndirfds;
+	}
+
+	free(node->name);
+	free(node->realpath);
+	if (node->filter_depth == 0) {
+		filter_free(node->filter);
+	}
+
+	free(node);
+}
+
+static void dcache_evict(struct dentry *entry)
+{
+	unsigned int bucket = dcache_hash(entry->parent, entry->name);
+	struct dentry **link = &buckets[bucket];
+
+	while (*link != entry) {
+		link = &(*link)->next;
+	}
+
+	*link = entry->next;
+
+	if (entry->node != NULL) {
+		entry->parent->dcache_refs--;
+		free_node(entry->node);
+	}
+
+	free(entry->name);
+	memset(entry, 0, sizeof(struct dentry));
+}
+
+/* Finds a free slot, evicting something if needed. Entries used by the current resolution,
+ * entries whose node is the parent of other cached nodes and entries whose node is held open
+ * are never evicted; returns NULL if that leaves nothing to evict.
+ */
+static struct dentry *dcache_alloc(void)
+{
+	struct dentry *entry;
+
+	for (unsigned int i = 0; i < 2 * DCACHE_SIZE; ++i) {
+		entry = &entries[hand];
+		hand = (hand + 1) % DCACHE_SIZE;
+
+		if (!entry->used) {
+			return entry;
+		}
+
+		if (entry->epoch == epoch || (entry->node != NULL && (entry->node->dcache_refs > 0 || entry->node->refs > 0))) {
+			continue;
+		}
+
+		if (entry->referenced) {
+			entry->referenced = false;
+			continue;
+		}
+
+		dcache_evict(entry);
+		return entry;
+	}
+
+	return NULL;
+}
+
+static void transient_add(struct sbfs_node *node)
+{
+	if (ntransient == transientcap) {
+		transientcap = transientcap ? transientcap * 2 : 16;
+		transient = (struct sbfs_node **)realloc(transient, transientcap * sizeof(struct sbfs_node *));
+		if (transient == NULL) {
+			fatal("Out of memory");
+		}
+	}
+
+	node->flags |= SBFS_UNCACHED;
+	transient[ntransient] = node;
+	++ntransient;
+}
+
+/* Starts a new path resolution. Nodes returned by the previous resolution that were
+ * not cached are released here (or once the last fd referring to them is closed), and
+ * cached entries touched from now on are pinned until the next call.
+ */
+void dcache_begin(void)
+{
+	while (ntransient > 0) {
+		--ntransient;
+		if (transient[ntransient]->refs > 0) {
+			transient[ntransient]->flags |= SBFS_ORPHAN;
+		} else {
+			free_node(transient[ntransient]);
+		}
+	}
+
+	++epoch;
+}
+
+/* Returns true if (parent, name) is cached, in which case *node is set to the cached
+ * node or to NULL if the name is known not to exist. */
+bool dcache_lookup(struct sbfs_node *parent, const char *name, struct sbfs_node **node)
+{
+	const struct sb_child *owner = dentry_owner(parent);
+
+	for (struct dentry *entry = buckets[dcache_hash(parent, name)]; entry != NULL; entry = entry->next) {
+		if (entry->parent == parent && entry->owner == owner && !strcmp(entry->name, name)) {
+			entry->epoch = epoch;
+			entry->referenced = true;
+			*node = entry->node;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Records the result of looking up name under parent; node is NULL for a negative entry.
+ * node is owned by the cache from here on and remains valid at least until the next
+ * dcache_begin(), or for as long as an fd refers to it.
+ * Lookups under writable nodes are not cached since what they resolve to may change,
+ * and neither are lookups under nodes that could not be cached themselves.
+ */
+void dcache_insert(struct sbfs_node *parent, const char *name, struct sbfs_node *node)
+{
+	struct dentry *entry = NULL;
+	unsigned int bucket;
+
+	if (!(parent->flags & (SBFS_WRITABLE | SBFS_UNCACHED))) {
+		entry = dcache_alloc();
+	}
+
+	if (entry == NULL) {
+		if (node != NULL) {
+			transient_add(node);
+		}
+
+		return;
+	}
+
+	bucket = dcache_hash(parent, name);
+	entry->parent = parent;
+	entry->name = strdup(name);
+	entry->node = node;
+	entry->owner = dentry_owner(parent);
+	entry->epoch = epoch;
+	entry->referenced = true;
+	entry->used = true;
+	entry->next = buckets[bucket];
+	buckets[bucket] = entry;
+
+	if (node != NULL) {
+		parent->dcache_refs++;
+	}
+}
+
+/* Drops every entry only visible to child, which must not have any fds open anymore.
+ * Entries are dropped leaves first, as the parent of a cached node cannot go before it does. */
+void dcache_forget(const struct sb_child *child)
+{
+	bool dropped = true;
+
+	while (dropped) {
+		dropped = false;
+		for (unsigned int i = 0; i < DCACHE_SIZE; ++i) {
+			struct dentry *entry = &entries[i];
+			if (entry->used && entry->owner == child && (entry->node == NULL || entry->node->dcache_refs == 0)) {
+				dcache_evict(entry);
+				dropped = true;
+			}
+		}
+	}
+}
+
+/* Drops the names our parent told child do not exist, it may have created them since */
+void dcache_forget_missing(const struct sb_child *child)
+{
+	for (unsigned int i = 0; i < DCACHE_SIZE; ++i) {
+		if (entries[i].used && entries[i].owner == child && entries[i].node == NULL) {
+			dcache_evict(&entries[i]);
+		}
+	}
+}
+
+/* Takes a reference to node on behalf of an open fd, keeping the cache from freeing it */
+void node_get(struct sbfs_node *node)
+{
+	node->refs++;
+}
+
+/* Drops a reference taken with node_get(); frees the node if the cache no longer wants it */
+void node_put(struct sbfs_node *node)
+{
+	if (--node->refs == 0 && (node->flags & SBFS_ORPHAN)) {
+		free_node(node);
+	}
+}
+
+/* Returns an O_PATH fd for the real directory behind node, opening it the first time round,
+ * or -1 if it cannot be opened. The fd lives as long as the node does, but only up to
+ * DCACHE_DIRFDS of them are kept around so that we don't run out of fds for open_node;
+ * past that -1 is returned and callers should fall back to using the full path.
+ */
+int dcache_dirfd(struct sbfs_node *node)
+{
+	int fd;
+
+	if (node->dirfd > 0) {
+		return node->dirfd;
+	}
+
+	if (node->realpath == NULL || ndirfds >= DCACHE_DIRFDS) {
+		return -1;
+	}
+
+	fd = open(node->realpath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	node->dirfd = fd;
+	++ndirfds;
+	return fd;
+}
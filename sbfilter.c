@@ -0,0 +1,224 @@
+// compiled whitelist/blacklist filters for sbfs nodes
+// each filter pattern is split into its path components once, when the node is built, and
+// each component is classified so that the common cases (foo, *, *.py, lib*) don't need fnmatch().
+// the compiled filter is shared by every real node below the node it was declared on; each of those
+// only records how deep it is and which patterns are still live at that depth. patterns past the
+// first SBFS_MAX_FILTERS have no room in that record, those are matched against the whole path instead.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sbcontext.h"
+
+#define PATTERN_ANY     0 /* "*" */
+#define PATTERN_LITERAL 1 /* no wildcards at all */
+#define PATTERN_SUFFIX  2 /* "*" followed by a literal, e.g. "*.py" */
+#define PATTERN_PREFIX  3 /* a literal followed by "*", e.g. "lib*" */
+#define PATTERN_FNMATCH 4 /* anything else */
+
+struct sbfs_pattern {
+	char *text; // the component, or for SUFFIX/PREFIX only its literal part
+	size_t len; // strlen(text)
+	int kind; // PATTERN_* constant
+};
+
+struct sbfs_filter {
+	unsigned int count; // number of patterns, those past SBFS_MAX_FILTERS are not tracked in filter_live
+	unsigned int *depth; // depth[i] is the number of components in pattern i
+	struct sbfs_pattern **components; // components[i][d] is component d of pattern i
+};
+
+static bool is_literal(const char *s, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		switch (s[i]) {
+		case '*':
+		case '?':
+		case '[':
+		case '\\':
+			return false;
+		case '+':
+		case '@':
+		case '!':
+			// extglob, e.g. @(foo|bar)
+			if (i + 1 < len && s[i + 1] == '(')
+				return false;
+			break;
+		}
+	}
+
+	return true;
+}
+
+static void compile_component(struct sbfs_pattern *pattern, const char *s, size_t len)
+{
+	if (len == 1 && s[0] == '*') {
+		pattern->kind = PATTERN_ANY;
+		pattern->text = strndup(s, len);
+	} else if (is_literal(s, len)) {
+		pattern->kind = PATTERN_LITERAL;
+		pattern->text = strndup(s, len);
+	} else if (s[0] == '*' && is_literal(s + 1, len - 1) && !(len > 1 && s[1] == '(')) {
+		pattern->kind = PATTERN_SUFFIX;
+		pattern->text = strndup(s + 1, len - 1);
+	} else if (s[len - 1] == '*' && is_literal(s, len - 1)) {
+		pattern->kind = PATTERN_PREFIX;
+		pattern->text = strndup(s, len - 1);
+	} else {
+		pattern->kind = PATTERN_FNMATCH;
+		pattern->text = strndup(s, len);
+	}
+
+	pattern->len = strlen(pattern->text);
+}
+
+/* Compiles count filter patterns (as given in getfs) into a filter */
+struct sbfs_filter *filter_compile(const char **patterns, unsigned int count)
+{
+	struct sbfs_filter *filter;
+
+	filter = (struct sbfs_filter *)malloc(sizeof(struct sbfs_filter));
+	filter->count = count;
+	filter->depth = (unsigned int *)calloc(count, sizeof(unsigned int));
+	filter->components = (struct sbfs_pattern **)calloc(count, sizeof(struct sbfs_pattern *));
+
+	for (unsigned int i = 0; i < count; ++i) {
+		const char *s = patterns[i];
+		const char *slash;
+		unsigned int depth = 1;
+
+		for (slash = strchr(s, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+			++depth;
+		}
+
+		filter->depth[i] = depth;
+		filter->components[i] = (struct sbfs_pattern *)calloc(depth, sizeof(struct sbfs_pattern));
+
+		for (unsigned int d = 0; d < depth; ++d) {
+			slash = strchr(s, '/');
+			size_t len = slash != NULL ? (size_t)(slash - s) : strlen(s);
+			compile_component(&filter->components[i][d], s, len);
+			s += len + 1;
+		}
+	}
+
+	return filter;
+}
+
+void filter_free(struct sbfs_filter *filter)
+{
+	if (filter == NULL) {
+		return;
+	}
+
+	for (unsigned int i = 0; i < filter->count; ++i) {
+		for (unsigned int d = 0; d < filter->depth[i]; ++d) {
+			free(filter->components[i][d].text);
+		}
+
+		free(filter->components[i]);
+	}
+
+	free(filter->components);
+	free(filter->depth);
+	free(filter);
+}
+
+/* Matches name the way fnmatch(pattern, name, FNM_PERIOD | FNM_EXTMATCH) would */
+static bool pattern_match(const struct sbfs_pattern *pattern, const char *name)
+{
+	size_t len;
+
+	switch (pattern->kind) {
+	case PATTERN_ANY:
+		return name[0] != '.';
+	case PATTERN_LITERAL:
+		return !strcmp(pattern->text, name);
+	case PATTERN_SUFFIX:
+		// FNM_PERIOD: a leading * never matches a leading period
+		len = strlen(name);
+		return name[0] != '.' && len >= pattern->len && !memcmp(name + len - pattern->len, pattern->text, pattern->len);
+	case PATTERN_PREFIX:
+		return !strncmp(name, pattern->text, pattern->len);
+	default:
+		return !fnmatch(pattern->text, name, FNM_PERIOD | FNM_EXTMATCH);
+	}
+}
+
+/* Whether pattern i of node's filter is live for node's children, for the patterns past
+ * SBFS_MAX_FILTERS: it has to reach that deep, and its components above must match the names of
+ * node and its parents up to the node the filter belongs to. */
+static bool overflow_live(const struct sbfs_node *node, unsigned int i)
+{
+	const struct sbfs_filter *filter = node->filter;
+	const struct sbfs_node *cur = node;
+
+	if (filter->depth[i] <= node->filter_depth) {
+		return false;
+	}
+
+	for (unsigned int d = node->filter_depth; d > 0; --d) {
+		if (!pattern_match(&filter->components[i][d - 1], cur->name)) {
+			return false;
+		}
+
+		cur = cur->parent;
+	}
+
+	return true;
+}
+
+/* Checks whether name may be looked up under node according to node's filters.
+ * If so and live is not NULL, it is set to the patterns that still apply one level
+ * further down (that is, patterns which matched name and have more components left).
+ */
+bool filter_allows(const struct sbfs_node *node, const char *name, uint64_t *live)
+{
+	const struct sbfs_filter *filter = node->filter;
+	uint64_t next = 0;
+	bool matched = false;
+
+	if (filter == NULL) {
+		if (live != NULL) {
+			*live = 0;
+		}
+
+		return true;
+	}
+
+	for (unsigned int i = 0; i < filter->count; ++i) {
+		if (i < SBFS_MAX_FILTERS ? !(node->filter_live & ((uint64_t)1 << i)) : !overflow_live(node, i)) {
+			continue;
+		}
+
+		if (!pattern_match(&filter->components[i][node->filter_depth], name)) {
+			continue;
+		}
+
+		if (node->flags & SBFS_BLACKLIST) {
+			return false;
+		}
+
+		matched = true;
+		if (i < SBFS_MAX_FILTERS && filter->depth[i] > node->filter_depth + 1) {
+			next |= (uint64_t)1 << i;
+		}
+	}
+
+	if (!matched && !(node->flags & SBFS_BLACKLIST)) {
+		// no entries matched and we are using a whitelist
+		return false;
+	}
+
+	if (live != NULL) {
+		*live = next;
+	}
+
+	return true;
+}
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <limits.h>
 #include <dlfcn.h>
 #include <unistd.h>
 #include <asm/unistd.h>
@@ -13,8 +15,10 @@
 #include <errno.h>
 #include <sys/cdefs.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/vfs.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include <signal.h>
 #include <dirent.h>
 #include <poll.h>
@@ -36,17 +40,163 @@ static struct iovec request[9] = {
 	{ &arglen, 2 }
 };
 
+// most buffers a single readv() or preadv() is passed on with, see clamp_iov
+#define SB_IOV_MAX 64
+
+// every response starts with these (see serve_request), the data follows from response[RESPONSE_HDR]
+#define RESPONSE_HDR 4
+#define RESPONSE_HDR_LEN (sizeof(int) * 3 + sizeof(unsigned int))
+
 static int syscode;
 static int syserrno;
-static struct iovec response[8] = {
+static unsigned int sysepoch;
+static int syscache; // SB_CACHE_* constant
+static struct iovec response[RESPONSE_HDR + SB_IOV_MAX] = {
 	{ &syscode, sizeof(int) },
-	{ &syserrno, sizeof(int) }
+	{ &syserrno, sizeof(int) },
+	{ &sysepoch, sizeof(unsigned int) },
+	{ &syscache, sizeof(int) }
 };
 
+/* Read-ahead buffers for the fds our parent serves, so that reading a file sequentially takes
+ * one request per block rather than one per read(). Only regular files opened read-only get one,
+ * sized from the file size our parent sends along with the fd from open() up to readahead_max
+ * (which our parent gives us along with our limits); fds from anywhere else are not buffered. The buffer
+ * holds the file contents from off to off + len. Blocks are fetched with positional reads, so the
+ * file position of a buffered fd is ours alone (off + pos) and our parent's is never used; read()
+ * and lseek() never leave the process except to fetch the next block, and a seek outside the
+ * buffer drops the contents.
+ */
+struct readbuf {
+	char *data;
+	size_t size; // 0 if the fd is not buffered
+	size_t len;
+	size_t pos; // where the caller is, relative to off
+	off_t off;
+};
+
+unsigned int readahead_max = 0;
+static struct readbuf readbufs[MAX_FDS];
+
+/* Reads the parent's response into the first niov entries of response.
+ * If the parent granted us a real fd along with it, that is stored in grantfd
+ * (which is otherwise set to -1). Anything the stat cache kept for an earlier epoch goes.
+ */
+static int recv_response(int niov, int *grantfd)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = response;
+	msg.msg_iovlen = niov;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+	ret = recvmsg(RPCSOCK, &msg, 0);
+	if (ret < 0) {
+		debug_error("recvmsg failed: %s", strerror(errno));
+		exit(EIO);
+	}
+
+	if ((size_t)ret < RESPONSE_HDR_LEN) {
+		debug_error("Truncated response\n");
+		exit(EPROTO);
+	}
+
+	scache_epoch(sysepoch);
+	stats_bytes += ret;
+
+	*grantfd = -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		memcpy(grantfd, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	return ret;
+}
+
+// forgets whatever we knew about fd, which was closed or now refers to something else
+static void readbuf_drop(int fd)
+{
+	if (fd < 0 || fd >= MAX_FDS) {
+		return;
+	}
+
+	free(readbufs[fd].data);
+	memset(&readbufs[fd], 0, sizeof(struct readbuf));
+}
+
+// gives fd, just opened at offset 0 for a regular file of the given size, a read-ahead buffer
+static void readbuf_setup(int fd, off_t size)
+{
+	struct readbuf *rb;
+
+	if (readahead_max == 0 || fd < 0 || fd >= MAX_FDS || size <= 0) {
+		return;
+	}
+
+	rb = &readbufs[fd];
+	rb->size = (uint64_t)size < readahead_max ? (size_t)size : readahead_max;
+	rb->data = (char *)malloc(rb->size);
+	if (rb->data == NULL) {
+		rb->size = 0;
+	}
+}
+
+// returns the read-ahead buffer for fd, or NULL if fd has none
+static struct readbuf *readbuf_get(int fd)
+{
+	if (fd < 0 || fd >= MAX_FDS || readbufs[fd].data == NULL) {
+		return NULL;
+	}
+
+	return &readbufs[fd];
+}
+
+/* Moves a granted fd into the grant range, where seccomp lets us use it without trapping.
+ * Granted fds are closed directly by the kernel so we don't know which slots are free,
+ * probe for one instead (starting after the last slot we handed out).
+ */
+static int install_grant(int fd, int flags)
+{
+	static int hint = 0;
+	int i, slot;
+
+	if (fd != SB_TRANSIT_FD) {
+		// one of our low fds was closed out from under us, can't safely continue
+		debug_error("Granted fd arrived as %d instead of %d\n", fd, SB_TRANSIT_FD);
+		exit(EPROTO);
+	}
+
+	for (i = 0; i < SB_GRANT_FDS; ++i) {
+		slot = SB_GRANT_FD_MIN + (hint + i) % SB_GRANT_FDS;
+		if (fcntl(slot, F_GETFD) == -1 && errno == EBADF) {
+			slot = dup3(fd, slot, flags & O_CLOEXEC);
+			close(fd);
+			if (slot >= 0) {
+				hint = (slot - SB_GRANT_FD_MIN + 1) % SB_GRANT_FDS;
+			}
+
+			return slot;
+		}
+	}
+
+	close(fd);
+	errno = EMFILE;
+	return -1;
+}
+
 SYS(open)
 {
 	const char *pathname;
-	int flags, mode, ret;
+	int flags, mode, ret, grantfd;
+	off_t size;
 	int *len;
 
 	if (is_child) {
@@ -54,8 +204,13 @@ SYS(open)
 		flags = va_arg(args, int);
 		mode = va_arg(args, int);
 
+		if (!(flags & O_CREAT) && scache_missing(pathname)) {
+			errno = ENOENT;
+			return -1;
+		}
+
 		request[3].iov_base = (void *)pathname;
-		request[3].iov_len = strlen(pathname);
+		request[3].iov_len = strlen(pathname) + 1;
 		request[4].iov_base = &flags;
 		request[4].iov_len = sizeof(int);
 		request[5].iov_base = &mode;
@@ -69,13 +224,20 @@ SYS(open)
 			exit(EIO);
 		}
 
-		ret = readv(RPCSOCK, response, 2);
-		if (ret < 0) {
-			debug_error("read failed: %s", strerror(errno));
-			exit(EIO);
-		}
+		// the size of a regular file, if it is worth reading ahead (see readbuf_setup)
+		response[RESPONSE_HDR].iov_base = &size;
+		response[RESPONSE_HDR].iov_len = sizeof(off_t);
+		ret = recv_response(RESPONSE_HDR + 1, &grantfd);
 
 		errno = syserrno;
+		if (grantfd >= 0) {
+			syscode = install_grant(grantfd, flags);
+		} else if (syscode >= 0) {
+			readbuf_drop(syscode);
+			if ((flags & (O_ACCMODE | O_PATH)) == O_RDONLY && (size_t)ret == RESPONSE_HDR_LEN + sizeof(off_t)) {
+				readbuf_setup(syscode, size);
+			}
+		}
 	} else {
 		len = va_arg(args, int *);
 
@@ -83,8 +245,15 @@ SYS(open)
 		flags = *va_arg(args, int *);
 		mode = *va_arg(args, int *);
 
+		// pathname lives in the same buffer as the output, we are done with it by then
 		syscode = open_node(pathname, flags, mode);
-		*len = 0;
+		size = syscode > 0 && grant_fd < 0 ? node_readahead(syscode, flags) : -1;
+		if (size > 0) {
+			*len = sizeof(off_t);
+			memcpy(len + 1, &size, sizeof(off_t));
+		} else {
+			*len = 0;
+		}
 	}
 
 	return syscode;
@@ -178,300 +347,485 @@ SYS(fcntl)
 
 SYS(close)
 {
-	int fd = va_arg(args, int);
-	json_object *arg1 = json_object_new_int(fd);
+	int fd, ret, grantfd;
+	int *len;
+
+	if (is_child) {
+		fd = va_arg(args, int);
+		readbuf_drop(fd);
+
+		request[3].iov_base = &fd;
+		request[3].iov_len = sizeof(int);
+		callnum = __NR_close;
+		arglen = sizeof(int);
 
-	return trampoline(NULL, NS_SYS, "close", 1, arg1);
+		ret = writev(RPCSOCK, request, 4);
+		if (ret < 0) {
+			debug_error("writev failed: %s", strerror(errno));
+			exit(EIO);
+		}
+
+		recv_response(RESPONSE_HDR, &grantfd);
+		if (grantfd >= 0) {
+			debug_error("Unexpected fd in close response\n");
+			exit(EPROTO);
+		}
+
+		errno = syserrno;
+		return syscode;
+	}
+
+	len = va_arg(args, int *);
+	fd = *len;
+	*len = 0;
+	return close_node(fd);
 }
 
-SYS(read)
+/* read(), pread64(), readv(), preadv(), getdents() and getdents64() are answered by our parent
+ * with the data (finished linux_dirent(64) records for the latter two), received straight into
+ * the caller's buffers. The fd and total size are sent as ints, followed by the offset as an
+ * off_t for positional reads (offset is NULL otherwise). The data has to fit into a single
+ * response, so callers limit the total to what the parent fills in one go (see clamp_iov).
+ */
+static intptr_t fd_requestv(int nr, int fd, const struct iovec *iov, int iovcnt, const off_t *offset)
 {
-	int fd = va_arg(args, int);
-	void *buf = va_arg(args, void *);
-	size_t count = va_arg(args, size_t);
+	unsigned int count = 0;
+	int i, ret, grantfd, nreq = 5;
 
-	int code = 0;
-	int ret = 0;
+	for (i = 0; i < iovcnt; ++i) {
+		response[RESPONSE_HDR + i] = iov[i];
+		count += iov[i].iov_len;
+	}
 
-	json_object *arg1 = json_object_new_int(fd);
-	json_object *arg2 = json_object_new_int64(count);
-	json_object *out = NULL;
-	json_object *data = NULL;
+	request[3].iov_base = &fd;
+	request[3].iov_len = sizeof(int);
+	request[4].iov_base = &count;
+	request[4].iov_len = sizeof(unsigned int);
+	arglen = sizeof(int) + sizeof(unsigned int);
+	if (offset != NULL) {
+		request[5].iov_base = (void *)offset;
+		request[5].iov_len = sizeof(off_t);
+		arglen += sizeof(off_t);
+		nreq = 6;
+	}
 
-	code = trampoline(&out, NS_SYS, "read", 2, arg1, arg2);
-	if (code <= 0) {
-		json_object_put(out);
-		return code;
+	callnum = nr;
+	ret = writev(RPCSOCK, request, nreq);
+	if (ret < 0) {
+		debug_error("writev failed: %s", strerror(errno));
+		exit(EIO);
 	}
 
-	if (!json_object_object_get_ex(out, "data", &data)) {
-		debug_error("data expected\n");
+	ret = recv_response(RESPONSE_HDR + iovcnt, &grantfd);
+	if (grantfd >= 0) {
+		debug_error("Unexpected fd in %s response\n", syscalls[nr]);
 		exit(EPROTO);
 	}
 
-	if (!json_object_is_type(data, json_type_string)) {
-		debug_error("data is not a string\n");
+	if (syscode > 0 && (size_t)ret != RESPONSE_HDR_LEN + (size_t)syscode) {
+		debug_error("%s response length mismatch\n", syscalls[nr]);
 		exit(EPROTO);
 	}
 
-	const char *str = json_object_get_string(data);
-	ret = json_object_get_string_len(data);
-	if (ret > 0 && (size_t)ret > count) {
-		debug_error("data string larger than buffer\n");
-		exit(EPROTO);
+	errno = syserrno;
+	return syscode;
+}
+
+static intptr_t fd_request(int nr, int fd, void *buf, unsigned int count)
+{
+	struct iovec iov = { buf, count };
+
+	return fd_requestv(nr, fd, &iov, 1, NULL);
+}
+
+/* Copies the first iovcnt entries of iov into out, shortened to max bytes in total and to at
+ * most SB_IOV_MAX entries; short reads are something callers of readv() deal with anyway.
+ * Returns the number of entries used, or -1 if iovcnt is out of range.
+ */
+static int clamp_iov(const struct iovec *iov, int iovcnt, struct iovec *out, size_t max)
+{
+	int i;
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX) {
+		errno = EINVAL;
+		return -1;
 	}
-	if (ret != code) {
-		debug_error("data length mismatch\n");
-		exit(EPROTO);
+
+	for (i = 0; i < iovcnt && i < SB_IOV_MAX && max > 0; ++i) {
+		out[i] = iov[i];
+		if (out[i].iov_len > max) {
+			out[i].iov_len = max;
+		}
+
+		max -= out[i].iov_len;
 	}
 
-	memcpy(buf, str, ret);
-	json_object_put(out);
-	return code;
+	return i;
 }
 
-SYS(stat)
+// reads into buf through the read-ahead buffer of fd
+static intptr_t buffered_read(struct readbuf *rb, int fd, void *buf, size_t count)
 {
-#define ST_GET(type, field) if (!json_object_object_get_ex(data, #field, &fld)) {\
-								debug_error("data." #field " expected\n");\
-								exit(EPROTO);\
-							}\
-							if (!json_object_is_type(fld, json_type_int)) {\
-								debug_error("data." #field " is not an int\n");\
-								exit(EPROTO);\
-							}\
-							buf->field = (type)json_object_get_int64(fld)
-	const char *path = va_arg(args, const char *);
-	struct stat *buf = va_arg(args, struct stat *);
+	int ret;
 
-	int ret = 0;
+	if (rb->pos == rb->len) {
+		rb->off += rb->len;
+		rb->len = rb->pos = 0;
 
-	json_object *arg1 = json_object_new_string(path);
-	json_object *out = NULL;
-	json_object *data = NULL;
-	json_object *fld = NULL;
+		if (count >= rb->size) {
+			// the caller wants at least a block anyway, no point in copying it through the buffer
+			struct iovec iov = { buf, count < rb->size ? count : rb->size };
+			ret = fd_requestv(__NR_pread64, fd, &iov, 1, &rb->off);
+			if (ret > 0) {
+				rb->off += ret;
+			}
 
-	ret = trampoline(&out, NS_SYS, "stat", 1, arg1);
-	if (ret != 0) {
-		json_object_put(out);
-		return ret;
+			return ret;
+		}
+
+		struct iovec iov = { rb->data, rb->size };
+		ret = fd_requestv(__NR_pread64, fd, &iov, 1, &rb->off);
+		if (ret <= 0) {
+			return ret;
+		}
+
+		rb->len = ret;
 	}
 
-	if (!json_object_object_get_ex(out, "data", &data)) {
-		debug_error("data expected\n");
-		exit(EPROTO);
+	if (count > rb->len - rb->pos) {
+		count = rb->len - rb->pos;
 	}
 
-	if (!json_object_is_type(data, json_type_object)) {
-		debug_error("data is not an object\n");
-		exit(EPROTO);
+	memcpy(buf, rb->data + rb->pos, count);
+	rb->pos += count;
+	return count;
+}
+
+// child side of readv(), and of preadv2() without an offset
+static intptr_t readv_request(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct iovec vec[SB_IOV_MAX];
+	struct readbuf *rb;
+	intptr_t ret, total = 0;
+	int i, n;
+
+	n = clamp_iov(iov, iovcnt, vec, SB_READ_MAX);
+	if (n <= 0) {
+		return n;
 	}
 
-	ST_GET(dev_t, st_dev);
-	ST_GET(ino_t, st_ino);
-	ST_GET(mode_t, st_mode);
-	ST_GET(nlink_t, st_nlink);
-	ST_GET(uid_t, st_uid);
-	ST_GET(gid_t, st_gid);
-	ST_GET(dev_t, st_rdev);
-	ST_GET(off_t, st_size);
-	ST_GET(blksize_t, st_blksize);
-	ST_GET(blkcnt_t, st_blocks);
+	rb = readbuf_get(fd);
+	if (rb == NULL) {
+		return fd_requestv(__NR_readv, fd, vec, n, NULL);
+	}
 
-	if (!json_object_object_get_ex(data, "st_atime", &fld)) {
-		debug_error("data.st_atime expected\n");
-		exit(EPROTO);
+	// filled one after the other, which takes a request whenever the buffer runs out
+	for (i = 0; i < n; ++i) {
+		ret = buffered_read(rb, fd, vec[i].iov_base, vec[i].iov_len);
+		if (ret < 0) {
+			return total > 0 ? total : ret;
+		}
+
+		total += ret;
+		if ((size_t)ret < vec[i].iov_len) {
+			break;
+		}
 	}
 
-	if (!json_object_is_type(fld, json_type_int)) {
-		debug_error("data.st_atime is not an int\n");
-		exit(EPROTO);
+	return total;
+}
+
+// child side of pread64(), preadv() and preadv2() with an offset
+static intptr_t preadv_request(int nr, int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct iovec vec[SB_IOV_MAX];
+	struct readbuf *rb = NULL;
+	size_t total = 0, pos;
+	int i, n;
+
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	buf->st_atim.tv_sec = (time_t)json_object_get_int64(fld);
+	n = clamp_iov(iov, iovcnt, vec, SB_READ_MAX);
+	if (n <= 0) {
+		return n;
+	}
 
-	if (!json_object_object_get_ex(data, "st_mtime", &fld)) {
-		debug_error("data.st_mtime expected\n");
-		exit(EPROTO);
+	for (i = 0; i < n; ++i) {
+		total += vec[i].iov_len;
 	}
 
-	if (!json_object_is_type(fld, json_type_int)) {
-		debug_error("data.st_mtime is not an int\n");
-		exit(EPROTO);
+	// these don't move the file position, so there is no point in setting up a buffer for them,
+	// but if the read-ahead buffer has the data already there is no need to ask for it
+	if (fd >= 0 && fd < MAX_FDS && readbufs[fd].data != NULL) {
+		rb = &readbufs[fd];
 	}
 
-	buf->st_mtim.tv_sec = (time_t)json_object_get_int64(fld);
+	if (rb != NULL && offset >= rb->off && offset + (off_t)total <= rb->off + (off_t)rb->len) {
+		pos = offset - rb->off;
+		for (i = 0; i < n; ++i) {
+			memcpy(vec[i].iov_base, rb->data + pos, vec[i].iov_len);
+			pos += vec[i].iov_len;
+		}
 
-	if (!json_object_object_get_ex(data, "st_ctime", &fld)) {
-		debug_error("data.st_ctime expected\n");
-		exit(EPROTO);
+		return total;
 	}
 
-	if (!json_object_is_type(fld, json_type_int)) {
-		debug_error("data.st_ctime is not an int\n");
-		exit(EPROTO);
+	return fd_requestv(nr, fd, vec, n, &offset);
+}
+
+/* parent side of the reads: the fd and size (and the offset, if positional) are packed after
+ * each other in buf, the data is written after the length prefix in their place */
+static intptr_t read_reply(int *len, bool positional)
+{
+	int fd = len[0];
+	size_t count = *(unsigned int *)(len + 1);
+	off_t offset = 0;
+	int ret;
+
+	if (positional) {
+		memcpy(&offset, (char *)(len + 1) + sizeof(unsigned int), sizeof(off_t));
 	}
 
-	buf->st_ctim.tv_sec = (time_t)json_object_get_int64(fld);
+	if (count > SB_READ_MAX) {
+		count = SB_READ_MAX;
+	}
 
-	json_object_put(out);
+	ret = positional ? pread_node(fd, len + 1, count, offset) : read_node(fd, len + 1, count);
+	*len = ret > 0 ? ret : 0;
 	return ret;
 }
 
-SYS(lstat)
+SYS(read)
 {
-	const char *path = va_arg(args, const char *);
-	struct stat *buf = va_arg(args, struct stat *);
+	int fd;
+	void *buf;
+	size_t count;
+	struct readbuf *rb;
 
-	int ret = 0;
-	json_object *arg1 = json_object_new_string(path);
-	json_object *out = NULL;
-	json_object *data = NULL;
-	json_object *fld = NULL;
+	if (is_child) {
+		fd = va_arg(args, int);
+		buf = va_arg(args, void *);
+		count = va_arg(args, size_t);
 
-	ret = trampoline(&out, NS_SYS, "lstat", 1, arg1);
-	if (ret != 0) {
-		json_object_put(out);
-		return ret;
-	}
+		rb = readbuf_get(fd);
+		if (rb == NULL) {
+			return fd_request(__NR_read, fd, buf, count < SB_READ_MAX ? count : SB_READ_MAX);
+		}
 
-	if (!json_object_object_get_ex(out, "data", &data)) {
-		debug_error("data expected\n");
-		exit(EPROTO);
+		return buffered_read(rb, fd, buf, count);
 	}
 
-	if (!json_object_is_type(data, json_type_object)) {
-		debug_error("data is not an object\n");
-		exit(EPROTO);
-	}
+	return read_reply(va_arg(args, int *), false);
+}
 
-	ST_GET(dev_t, st_dev);
-	ST_GET(ino_t, st_ino);
-	ST_GET(mode_t, st_mode);
-	ST_GET(nlink_t, st_nlink);
-	ST_GET(uid_t, st_uid);
-	ST_GET(gid_t, st_gid);
-	ST_GET(dev_t, st_rdev);
-	ST_GET(off_t, st_size);
-	ST_GET(blksize_t, st_blksize);
-	ST_GET(blkcnt_t, st_blocks);
+SYS(pread64)
+{
+	int fd;
+	struct iovec iov;
+	off_t offset;
 
-	if (!json_object_object_get_ex(data, "st_atime", &fld)) {
-		debug_error("data.st_atime expected\n");
-		exit(EPROTO);
-	}
+	if (is_child) {
+		fd = va_arg(args, int);
+		iov.iov_base = va_arg(args, void *);
+		iov.iov_len = va_arg(args, size_t);
+		offset = (off_t)va_arg(args, intptr_t);
+#if defined(__i386__)
+		// 64-bit offsets are split over two registers
+		offset = (off_t)(uint32_t)offset | (off_t)va_arg(args, uint32_t) << 32;
+#endif
 
-	if (!json_object_is_type(fld, json_type_int)) {
-		debug_error("data.st_atime is not an int\n");
-		exit(EPROTO);
+		return preadv_request(__NR_pread64, fd, &iov, 1, offset);
 	}
 
-	buf->st_atim.tv_sec = (time_t)json_object_get_int64(fld);
+	return read_reply(va_arg(args, int *), true);
+}
 
-	if (!json_object_object_get_ex(data, "st_mtime", &fld)) {
-		debug_error("data.st_mtime expected\n");
-		exit(EPROTO);
-	}
+SYS(readv)
+{
+	int fd;
+	const struct iovec *iov;
 
-	if (!json_object_is_type(fld, json_type_int)) {
-		debug_error("data.st_mtime is not an int\n");
-		exit(EPROTO);
+	if (is_child) {
+		fd = va_arg(args, int);
+		iov = va_arg(args, const struct iovec *);
+		return readv_request(fd, iov, va_arg(args, int));
 	}
 
-	buf->st_mtim.tv_sec = (time_t)json_object_get_int64(fld);
+	return read_reply(va_arg(args, int *), false);
+}
 
-	if (!json_object_object_get_ex(data, "st_ctime", &fld)) {
-		debug_error("data.st_ctime expected\n");
-		exit(EPROTO);
-	}
+SYS(preadv)
+{
+	int fd, iovcnt;
+	const struct iovec *iov;
+	off_t offset;
 
-	if (!json_object_is_type(fld, json_type_int)) {
-		debug_error("data.st_ctime is not an int\n");
-		exit(EPROTO);
+	if (is_child) {
+		fd = va_arg(args, int);
+		iov = va_arg(args, const struct iovec *);
+		iovcnt = va_arg(args, int);
+		offset = (off_t)va_arg(args, intptr_t);
+#if defined(__i386__)
+		offset = (off_t)(uint32_t)offset | (off_t)va_arg(args, uint32_t) << 32;
+#endif
+
+		return preadv_request(__NR_preadv, fd, iov, iovcnt, offset);
 	}
 
-	buf->st_ctim.tv_sec = (time_t)json_object_get_int64(fld);
+	return read_reply(va_arg(args, int *), true);
+}
 
-	json_object_put(out);
-	return ret;
+/* The flags only ask for hints or non-blocking behavior, which make no difference to us.
+ * Granted fds are allowed readv() and preadv() directly, but not this one. */
+SYS(preadv2)
+{
+	int fd, iovcnt;
+	const struct iovec *iov;
+	off_t offset;
+
+	if (is_child) {
+		fd = va_arg(args, int);
+		iov = va_arg(args, const struct iovec *);
+		iovcnt = va_arg(args, int);
+		offset = (off_t)va_arg(args, intptr_t);
+#if defined(__i386__)
+		offset = (off_t)(uint32_t)offset | (off_t)va_arg(args, uint32_t) << 32;
+#endif
+
+		if (fd >= SB_GRANT_FD_MIN && fd < SB_GRANT_FD_MIN + SB_GRANT_FDS) {
+			return offset == -1 ? readv(fd, iov, iovcnt) : preadv(fd, iov, iovcnt, offset);
+		} else if (offset == -1) {
+			return readv_request(fd, iov, iovcnt);
+		}
+
+		return preadv_request(__NR_preadv, fd, iov, iovcnt, offset);
+	}
+
+	return read_reply(va_arg(args, int *), true);
 }
 
-SYS(fstat)
+/* stat(), lstat() and fstat() are answered by our parent with a struct stat (which it made for
+ * us, as it runs on the same machine), received straight into the caller's buffer.
+ * Paths are sent NULL terminated, fds as an int. Answers for paths go through the stat cache.
+ */
+static intptr_t stat_request(int nr, const void *arg, size_t arglength, struct stat *buf)
 {
-	int fd = va_arg(args, int);
-	struct stat *buf = va_arg(args, struct stat *);
+	int ret, grantfd;
 
-	int ret = 0;
-	json_object *arg1 = json_object_new_int(fd);
-	json_object *out = NULL;
-	json_object *data = NULL;
-	json_object *fld = NULL;
+	request[3].iov_base = (void *)arg;
+	request[3].iov_len = arglength;
+	callnum = nr;
+	arglen = arglength;
 
-	ret = trampoline(&out, NS_SYS, "fstat", 1, arg1);
-	if (ret != 0) {
-		json_object_put(out);
-		return ret;
+	ret = writev(RPCSOCK, request, 4);
+	if (ret < 0) {
+		debug_error("writev failed: %s", strerror(errno));
+		exit(EIO);
 	}
 
-	if (!json_object_object_get_ex(out, "data", &data)) {
-		debug_error("data expected\n");
+	response[RESPONSE_HDR].iov_base = buf;
+	response[RESPONSE_HDR].iov_len = sizeof(struct stat);
+	ret = recv_response(RESPONSE_HDR + 1, &grantfd);
+	if (grantfd >= 0) {
+		debug_error("Unexpected fd in stat response\n");
 		exit(EPROTO);
 	}
 
-	if (!json_object_is_type(data, json_type_object)) {
-		debug_error("data is not an object\n");
+	if (syscode == 0 && (size_t)ret != RESPONSE_HDR_LEN + sizeof(struct stat)) {
+		debug_error("Truncated stat response\n");
 		exit(EPROTO);
 	}
 
-	ST_GET(dev_t, st_dev);
-	ST_GET(ino_t, st_ino);
-	ST_GET(mode_t, st_mode);
-	ST_GET(nlink_t, st_nlink);
-	ST_GET(uid_t, st_uid);
-	ST_GET(gid_t, st_gid);
-	ST_GET(dev_t, st_rdev);
-	ST_GET(off_t, st_size);
-	ST_GET(blksize_t, st_blksize);
-	ST_GET(blkcnt_t, st_blocks);
+	errno = syserrno;
+	return syscode;
+}
 
-	if (!json_object_object_get_ex(data, "st_atime", &fld)) {
-		debug_error("data.st_atime expected\n");
-		exit(EPROTO);
-	}
+// child side of stat() and lstat()
+static intptr_t stat_path_request(int nr, const char *path, struct stat *buf)
+{
+	bool follow = nr == __NR_stat;
+	intptr_t ret;
+	int err;
 
-	if (!json_object_is_type(fld, json_type_int)) {
-		debug_error("data.st_atime is not an int\n");
-		exit(EPROTO);
+	if (scache_stat(path, follow, buf, &err)) {
+		errno = err;
+		return err == 0 ? 0 : -1;
 	}
 
-	buf->st_atim.tv_sec = (time_t)json_object_get_int64(fld);
+	ret = stat_request(nr, path, strlen(path) + 1, buf);
+	scache_add_stat(path, follow, ret == 0 ? 0 : syserrno, buf, syscache);
+	errno = syserrno;
+	return ret;
+}
 
-	if (!json_object_object_get_ex(data, "st_mtime", &fld)) {
-		debug_error("data.st_mtime expected\n");
-		exit(EPROTO);
+// parent side: writes st after the length prefix in buf (if the call succeeded)
+static intptr_t stat_reply(int *len, int ret, const struct stat *st)
+{
+	if (ret == 0) {
+		*len = sizeof(struct stat);
+		memcpy(len + 1, st, sizeof(struct stat));
+	} else {
+		*len = 0;
 	}
 
-	if (!json_object_is_type(fld, json_type_int)) {
-		debug_error("data.st_mtime is not an int\n");
-		exit(EPROTO);
-	}
+	return ret;
+}
 
-	buf->st_mtim.tv_sec = (time_t)json_object_get_int64(fld);
+SYS(stat)
+{
+	const char *path;
+	struct stat st;
+	int *len;
+	int ret;
 
-	if (!json_object_object_get_ex(data, "st_ctime", &fld)) {
-		debug_error("data.st_ctime expected\n");
-		exit(EPROTO);
+	if (is_child) {
+		path = va_arg(args, const char *);
+		return stat_path_request(__NR_stat, path, va_arg(args, struct stat *));
 	}
 
-	if (!json_object_is_type(fld, json_type_int)) {
-		debug_error("data.st_ctime is not an int\n");
-		exit(EPROTO);
+	len = va_arg(args, int *);
+	path = (const char *)len;
+	ret = stat_node(path, &st);
+	return stat_reply(len, ret, &st);
+}
+
+SYS(lstat)
+{
+	const char *path;
+	struct stat st;
+	int *len;
+	int ret;
+
+	if (is_child) {
+		path = va_arg(args, const char *);
+		return stat_path_request(__NR_lstat, path, va_arg(args, struct stat *));
 	}
 
-	buf->st_ctim.tv_sec = (time_t)json_object_get_int64(fld);
+	len = va_arg(args, int *);
+	path = (const char *)len;
+	ret = lstat_node(path, &st);
+	return stat_reply(len, ret, &st);
+}
 
-	json_object_put(out);
-	return ret;
+SYS(fstat)
+{
+	int fd;
+	struct stat st;
+	int *len;
+	int ret;
+
+	if (is_child) {
+		fd = va_arg(args, int);
+		return stat_request(__NR_fstat, &fd, sizeof(int), va_arg(args, struct stat *));
+	}
+
+	len = va_arg(args, int *);
+	fd = *len;
+	ret = fstat_node(fd, &st);
+	return stat_reply(len, ret, &st);
 }
 
 SYS(readlink)
@@ -481,12 +835,18 @@ SYS(readlink)
 	size_t bufsiz = va_arg(args, size_t);
 
 	int ret = 0, len = 0;
-	json_object *arg1 = json_object_new_string(path);
 	json_object *out = NULL;
 	json_object *data = NULL;
 	const char *str;
+	struct stat st;
 
-	ret = trampoline(&out, NS_SYS, "readlink", 1, arg1);
+	// nothing to ask if the stat cache knows the path does not exist or is not a symlink
+	if (is_child && scache_stat(path, false, &st, &ret) && (ret != 0 || !S_ISLNK(st.st_mode))) {
+		errno = ret != 0 ? ret : EINVAL;
+		return -1;
+	}
+
+	ret = trampoline(&out, NS_SYS, "readlink", 1, json_object_new_string(path));
 	if (ret <= 0) {
 		json_object_put(out);
 		return ret;
@@ -525,7 +885,12 @@ SYS(openat)
 	int flags = va_arg(args, int);
 	int mode = va_arg(args, int);
 
-	
+	// glibc implements open() with openat(AT_FDCWD, ...), so make sure those
+	// end up in the same place (and can be granted real fds) as plain open()
+	if (is_child && (dirfd == AT_FDCWD || pathname[0] == '/')) {
+		return dispatch(sb_open, pathname, flags, mode);
+	}
+
 	int numargs = 3;
 	json_object *arg1 = json_object_new_int(dirfd);
 	json_object *arg2 = json_object_new_string(pathname);
@@ -539,134 +904,152 @@ SYS(openat)
 	return trampoline(NULL, NS_SYS, "openat", numargs, arg1, arg2, arg3, arg4);
 }
 
-struct linux_dirent {
-	unsigned long d_ino;
-	unsigned long d_off;
-	unsigned short d_reclen;
-	char d_name[];
-	/* these fields are at the end of d_name
-	char pad;
-	char d_type;
-	*/
-};
+// parent side: the records are written after the length prefix in buf
+static intptr_t getdents_reply(int *len, bool is64)
+{
+	int fd = len[0];
+	unsigned int count = *(unsigned int *)(len + 1);
+	int ret;
+
+	if (count > SB_GETDENTS_MAX) {
+		count = SB_GETDENTS_MAX;
+	}
+
+	ret = getdents_node(fd, (char *)(len + 1), count, is64);
+	*len = ret > 0 ? ret : 0;
+	return ret;
+}
 
 SYS(getdents)
 {
-	unsigned int fd = va_arg(args, unsigned int);
-	char *dirp = va_arg(args, char *);
-	unsigned int count = va_arg(args, unsigned int);
+	int fd;
+	char *dirp;
+	unsigned int count;
 
-	// size of the struct not counting the name, we pass this along
-	// so the parent side can calculate how many strings it can pass
-	size_t misc = offsetof(struct linux_dirent, d_name) + 2;
-	int ret, i, off = 0;
-	const char *name;
-	struct linux_dirent *d = NULL;
+	if (is_child) {
+		fd = va_arg(args, int);
+		dirp = va_arg(args, char *);
+		count = va_arg(args, unsigned int);
+		return fd_request(__NR_getdents, fd, dirp, count < SB_GETDENTS_MAX ? count : SB_GETDENTS_MAX);
+	}
 
-	json_object *arg1 = json_object_new_int64(fd);
-	json_object *arg2 = json_object_new_int64(count);
-	json_object *arg3 = json_object_new_int64(misc);
-	json_object *out = NULL;
-	json_object *data = NULL;
-	json_object *obj = NULL;
-	json_object *fld = NULL;
+	return getdents_reply(va_arg(args, int *), false);
+}
 
-	ret = trampoline(&out, NS_SYS, "getdents", 3, arg1, arg2, arg3);
-	if (ret <= 0) {
-		json_object_put(out);
-		return ret;
+SYS(getdents64)
+{
+	int fd;
+	char *dirp;
+	unsigned int count;
+
+	if (is_child) {
+		fd = va_arg(args, int);
+		dirp = va_arg(args, char *);
+		count = va_arg(args, unsigned int);
+		return fd_request(__NR_getdents64, fd, dirp, count < SB_GETDENTS_MAX ? count : SB_GETDENTS_MAX);
 	}
 
-	if (!json_object_object_get_ex(out, "data", &data)) {
-		debug_error("data expected\n");
-		exit(EPROTO);
+	return getdents_reply(va_arg(args, int *), true);
+}
+
+/* lseek() is answered by our parent with the resulting offset as an off_t (the return code only
+ * says whether it worked, as it is an int). The fd, offset and whence are sent as is.
+ */
+static off_t lseek_request(int fd, off_t offset, int whence)
+{
+	off_t result = -1;
+	int ret, grantfd;
+
+	request[3].iov_base = &fd;
+	request[3].iov_len = sizeof(int);
+	request[4].iov_base = &offset;
+	request[4].iov_len = sizeof(off_t);
+	request[5].iov_base = &whence;
+	request[5].iov_len = sizeof(int);
+	callnum = __NR_lseek;
+	arglen = sizeof(int) + sizeof(off_t) + sizeof(int);
+
+	ret = writev(RPCSOCK, request, 6);
+	if (ret < 0) {
+		debug_error("writev failed: %s", strerror(errno));
+		exit(EIO);
 	}
 
-	if (!json_object_is_type(data, json_type_array)) {
-		debug_error("data is not an array\n");
+	response[RESPONSE_HDR].iov_base = &result;
+	response[RESPONSE_HDR].iov_len = sizeof(off_t);
+	ret = recv_response(RESPONSE_HDR + 1, &grantfd);
+	if (grantfd >= 0) {
+		debug_error("Unexpected fd in lseek response\n");
 		exit(EPROTO);
 	}
 
-	int len = json_object_array_length(data);
-	if (len == 0) {
-		debug_error("0 length array but nonzero return value\n");
+	if (syscode == 0 && (size_t)ret != RESPONSE_HDR_LEN + sizeof(off_t)) {
+		debug_error("lseek response length mismatch\n");
 		exit(EPROTO);
 	}
 
-	for (i = 0; i < len; ++i) {
-		d = (struct linux_dirent *)(dirp + off);
-		obj = json_object_array_get_idx(data, i);
-		if (!json_object_is_type(obj, json_type_object)) {
-			debug_error("array member not an object\n");
-			exit(EPROTO);
-		}
-
-		if (!json_object_object_get_ex(obj, "d_ino", &fld)) {
-			debug_error("missing field d_ino\n");
-			exit(EPROTO);
-		}
-
-		if (!json_object_is_type(fld, json_type_int)) {
-			debug_error("d_ino is not an int\n");
-			exit(EPROTO);
-		}
-
-		d->d_ino = (unsigned int)json_object_get_int(fld);
+	errno = syserrno;
+	return syscode == 0 ? result : -1;
+}
 
-		if (!json_object_object_get_ex(obj, "d_name", &fld)) {
-			debug_error("missing field d_name\n");
-			exit(EPROTO);
-		}
+SYS(lseek)
+{
+	int fd, whence;
+	off_t offset, target;
+	struct readbuf *rb = NULL;
+	int *len;
 
-		if (!json_object_is_type(fld, json_type_string)) {
-			debug_error("d_name is not a string\n");
-			exit(EPROTO);
-		}
+	if (is_child) {
+		fd = va_arg(args, int);
+		offset = va_arg(args, off_t);
+		whence = va_arg(args, int);
 
-		name = json_object_get_string(fld);
-		d->d_reclen = misc + json_object_get_string_len(fld);
-		d->d_off = off + d->d_reclen;
-		if (d->d_off > count) {
-			// this indicates a bug in the parent process, it
-			// should not return more data than fits in our buffer
-			debug_error("getdents() buffer overflow\n");
-			exit(EPROTO);
+		if (fd >= 0 && fd < MAX_FDS && readbufs[fd].data != NULL) {
+			rb = &readbufs[fd];
 		}
 
-		// strcpy fills in the "pad" byte as well
-		strcpy(d->d_name, name);
-
-		if (!json_object_object_get_ex(obj, "d_type", &fld)) {
-			debug_error("missing field d_type\n");
-			exit(EPROTO);
+		if (rb != NULL && (whence == SEEK_SET || whence == SEEK_CUR)) {
+			target = whence == SEEK_SET ? offset : rb->off + (off_t)rb->pos + offset;
+			if (target < 0) {
+				errno = EINVAL;
+				return -1;
+			}
+
+			if (target >= rb->off && target <= rb->off + (off_t)rb->len) {
+				rb->pos = target - rb->off;
+			} else {
+				// the next block is fetched from there
+				rb->off = target;
+				rb->len = rb->pos = 0;
+			}
+
+			return target;
 		}
 
-		if (!json_object_is_type(fld, json_type_int)) {
-			debug_error("d_type is not an int\n");
-			exit(EPROTO);
+		target = lseek_request(fd, offset, whence);
+		if (rb != NULL && target >= 0) {
+			rb->off = target;
+			rb->len = rb->pos = 0;
 		}
 
-		// fill in the d_type field
-		*(dirp + d->d_off - 1) = (char)json_object_get_int(fld);
-
-		off = d->d_off;
+		return target;
 	}
 
-	json_object_put(out);
-	return d->d_off;
-}
+	// parent side: the args are packed after each other in buf, the result goes after the length
+	len = va_arg(args, int *);
+	fd = len[0];
+	memcpy(&offset, len + 1, sizeof(off_t));
+	memcpy(&whence, (char *)(len + 1) + sizeof(off_t), sizeof(int));
 
-SYS(lseek)
-{
-	int fd = va_arg(args, int);
-	off_t offset = va_arg(args, off_t);
-	int whence = va_arg(args, int);
-
-	json_object *arg1 = json_object_new_int(fd);
-	json_object *arg2 = json_object_new_int64(offset);
-	json_object *arg3 = json_object_new_int(whence);
+	target = lseek_node(fd, offset, whence);
+	if (target < 0) {
+		*len = 0;
+		return -1;
+	}
 
-	return trampoline(NULL, NS_SYS, "lseek", 3, arg1, arg2, arg3);
+	*len = sizeof(off_t);
+	memcpy(len + 1, &target, sizeof(off_t));
+	return 0;
 }
 
 SYS(dup)
@@ -678,6 +1061,17 @@ SYS(dup)
 	return trampoline(NULL, NS_SYS, "dup", 1, arg1);
 }
 
+// reads a required integer field from data into buf
+#define ST_GET(type, field) if (!json_object_object_get_ex(data, #field, &fld)) {\
+								debug_error("data." #field " expected\n");\
+								exit(EPROTO);\
+							}\
+							if (!json_object_is_type(fld, json_type_int)) {\
+								debug_error("data." #field " is not an int\n");\
+								exit(EPROTO);\
+							}\
+							buf->field = (type)json_object_get_int64(fld)
+
 SYS(statfs)
 {
 	const char *path = va_arg(args, const char *);
@@ -733,15 +1127,59 @@ SYS(statfs)
 	return ret;
 }
 
+/* access() is answered by our parent from the path (sent NULL terminated) and mode (an int),
+ * and goes through the stat cache like stat() does. */
 SYS(access)
 {
-	const char *pathname = va_arg(args, const char *);
-	int mode = va_arg(args, int);
+	const char *pathname;
+	int mode, ret, grantfd, err;
+	int *len;
+
+	if (is_child) {
+		pathname = va_arg(args, const char *);
+		mode = va_arg(args, int);
+
+		if (mode & ~(R_OK | W_OK | X_OK)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (scache_access(pathname, mode, &err)) {
+			errno = err;
+			return err == 0 ? 0 : -1;
+		}
+
+		request[3].iov_base = (void *)pathname;
+		request[3].iov_len = strlen(pathname) + 1;
+		request[4].iov_base = &mode;
+		request[4].iov_len = sizeof(int);
+		callnum = __NR_access;
+		arglen = request[3].iov_len + request[4].iov_len;
+
+		ret = writev(RPCSOCK, request, 5);
+		if (ret < 0) {
+			debug_error("writev failed: %s", strerror(errno));
+			exit(EIO);
+		}
 
-	json_object *arg1 = json_object_new_string(pathname);
-	json_object *arg2 = json_object_new_int(mode);
+		recv_response(RESPONSE_HDR, &grantfd);
+		if (grantfd >= 0) {
+			debug_error("Unexpected fd in access response\n");
+			exit(EPROTO);
+		}
+
+		scache_add_access(pathname, mode, syscode == 0 ? 0 : syserrno, syscache);
+		errno = syserrno;
+		return syscode;
+	}
 
-	return trampoline(NULL, NS_SYS, "access", 2, arg1, arg2);
+	len = va_arg(args, int *);
+	pathname = (const char *)len;
+	mode = *va_arg(args, int *);
+
+	ret = access_node(pathname, mode);
+	*len = 0;
+	return ret;
 }
 
 SYS(poll)
@@ -806,59 +1244,78 @@ SYS(poll)
 }
 
 // we do not forward mmap calls as-is
-// anonymous mappings are directly allowed, so this is only called when
-// we are asked to mmap a file. As such, we perform an anonymous mmap,
-// read in the file to it, then fix the flags on it and return that address.
-// This is doable because when python asks us to mmap a file for a .so,
-// it opens the file first so the fd passed to us is also open in our parent.
-// Therefore, we lseek() it to the beginning, re-read() it, and return it.
+// anonymous mappings and private mappings of granted fds are directly allowed, so this is
+// only called when we are asked to mmap a file that our parent serves for us.
+// In that case we ask our parent for a real read-only fd of that file (which arrives the same
+// way as a granted fd from open), map that, and close it again. The kernel enforces the
+// requested protections and pages are demand-faulted and shared with the page cache.
 SYS(mmap)
 {
-	void *addr = va_arg(args, void *);
-	size_t length = va_arg(args, size_t);
-	int prot = va_arg(args, int);
-	int flags = va_arg(args, int);
-	int fd = va_arg(args, int);
-	off_t offset = va_arg(args, int);
+	void *addr;
+	size_t length;
+	int prot, flags, fd, ret, grantfd;
+	off_t offset;
+	int *len;
 
-	if (flags & (MAP_SHARED | MAP_GROWSDOWN | MAP_STACK)) {
-		errno = EPERM;
-		debug_error("mmap flags has disallowed values\n");
-		return (intptr_t)MAP_FAILED;
-	}
+	if (is_child) {
+		addr = va_arg(args, void *);
+		length = va_arg(args, size_t);
+		prot = va_arg(args, int);
+		flags = va_arg(args, int);
+		fd = va_arg(args, int);
+		offset = (off_t)va_arg(args, intptr_t);
 
-	void *mem = mmap(addr, length, PROT_READ | PROT_WRITE, flags | MAP_ANONYMOUS, -1, 0);
-	if (mem == MAP_FAILED) {
-		debug_error("mmap call failed with errno %d\n", errno);
-		return (intptr_t)MAP_FAILED;
-	}
+		if (flags & (MAP_SHARED | MAP_GROWSDOWN | MAP_STACK)) {
+			errno = EPERM;
+			debug_error("mmap flags has disallowed values\n");
+			return (intptr_t)MAP_FAILED;
+		}
 
-	if (lseek(fd, offset, SEEK_SET) == -1) {
-		debug_error("lseek call failed\n");
-		munmap(mem, length);
-		return (intptr_t)MAP_FAILED;
-	}
+		request[3].iov_base = &fd;
+		request[3].iov_len = sizeof(int);
+		callnum = __NR_mmap;
+		arglen = request[3].iov_len;
 
-	size_t num_read = 0;
-	int ret;
-	while (num_read < length) {
-		ret = read(fd, mem + num_read, length - num_read);
-		if (ret == 0) {
-			break;
-		} else if (ret < 0) {
-			debug_error("read call failed\n");
-			munmap(mem, length);
+		ret = writev(RPCSOCK, request, 4);
+		if (ret < 0) {
+			debug_error("writev failed: %s", strerror(errno));
+			exit(EIO);
+		}
+
+		recv_response(RESPONSE_HDR, &grantfd);
+
+		if (syscode < 0) {
+			if (grantfd >= 0) {
+				close(grantfd);
+			}
+
+			errno = syserrno;
 			return (intptr_t)MAP_FAILED;
 		}
 
-		num_read += ret;
-	}
+		if (grantfd < 0) {
+			debug_error("mmap response did not carry an fd\n");
+			exit(EPROTO);
+		}
 
-	if (mprotect(mem, length, prot) != 0) {
-		debug_error("mprotect call failed\n");
-		munmap(mem, length);
-		return (intptr_t)MAP_FAILED;
+		fd = install_grant(grantfd, O_CLOEXEC);
+		if (fd < 0) {
+			return (intptr_t)MAP_FAILED;
+		}
+
+		void *mem = mmap(addr, length, prot, flags, fd, offset);
+		int map_errno = errno;
+		close(fd);
+		errno = map_errno;
+		return (intptr_t)mem;
+	} else {
+		len = va_arg(args, int *);
+		// only the fd is sent over
+		fd = *len;
+
+		syscode = map_node(fd);
+		*len = 0;
 	}
 
-	return (intptr_t)mem;
+	return syscode;
 }
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <string.h>
 #include <json/json.h>
 #include <errno.h>
@@ -11,12 +12,35 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <execinfo.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <asm/unistd.h>
 
 #include "sbcontext.h"
 #include "sblibc.h"
 
-static FILE *pipeout = NULL;
-static FILE *pipein = NULL;
+/* Everything we read from the overall parent goes through inbuf, which is allocated once and
+ * reused for every message. Whatever is left in it after a message belongs to the next one.
+ * Messages are not limited by its size: JSON is fed to the tokener a chunk at a time, and
+ * large binary payloads are read straight into their destination.
+ */
+#define PIPEIN_BUFSIZE 65536
+
+static char *inbuf = NULL;
+static size_t inpos = 0; // start of what has not been consumed yet
+static size_t inlen = 0; // end of what has been read
+static json_tokener *tok = NULL;
+
+// sizes of the last message sent to and received from the overall parent, for the call statistics
+static size_t sent_len = 0;
+static size_t received_len = 0;
+
+// json_tokener_get_parse_end() only exists since json-c 0.15, before that the field was public
+#if defined(JSON_C_VERSION_NUM) && JSON_C_VERSION_NUM >= ((0 << 16) | (15 << 8))
+#define TOKENER_PARSE_END(tok) json_tokener_get_parse_end(tok)
+#else
+#define TOKENER_PARSE_END(tok) ((size_t)(tok)->char_offset)
+#endif
 
 intptr_t dispatch(intptr_t (*func)(va_list), ...)
 {
@@ -30,65 +54,186 @@ intptr_t dispatch(intptr_t (*func)(va_list), ...)
 	return ret;
 }
 
+// writes all of iov to fd, resuming after partial writes
+static int writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t ret;
+
+	while (iovcnt > 0) {
+		ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
 // helper function to write json string to pipeout, terminated with a newline
+// the string is written as is, without copying it into a buffer first
 int writejson(const char *json)
 {
-	int ret;
+	struct iovec iov[2] = {
+		{ (void *)json, strlen(json) },
+		{ "\n", 1 }
+	};
+
+	return writev_full(PIPEOUT, iov, 2);
+}
+
+// replaces the contents of inbuf with whatever can be read from pipein in one go
+static int pipein_fill(void)
+{
+	ssize_t ret;
 
-	if (pipeout == NULL) {
-		pipeout = fdopen(PIPEOUT, "w");
+	if (inbuf == NULL) {
+		inbuf = (char *)malloc(PIPEIN_BUFSIZE);
+		if (inbuf == NULL) {
+			fatal("Out of memory");
+		}
 	}
 
-	ret = fprintf(pipeout, "%s\n", json);
-	fflush(pipeout);
+	inpos = inlen = 0;
+	do {
+		ret = read(PIPEIN, inbuf, PIPEIN_BUFSIZE);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret <= 0) {
+		if (ret == 0) {
+			errno = EIO;
+		}
 
-	if (feof(pipeout)) {
-		ret = -1;
-		errno = EIO;
+		return -1;
 	}
 
-	return ret;
+	inlen = (size_t)ret;
+	return 0;
 }
 
-// helper function to read json string from pipein (until a newline is encountered)
+// reads exactly count bytes from pipein
+static int pipein_read(void *buf, size_t count)
+{
+	char *pos = (char *)buf;
+	size_t len;
+	ssize_t ret;
+
+	while (count > 0) {
+		if (inpos == inlen && count >= PIPEIN_BUFSIZE) {
+			// no point in copying this through inbuf
+			ret = read(PIPEIN, pos, count);
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			} else if (ret <= 0) {
+				if (ret == 0) {
+					errno = EIO;
+				}
+
+				return -1;
+			}
+
+			pos += ret;
+			count -= ret;
+			continue;
+		}
+
+		if (inpos == inlen && pipein_fill() < 0) {
+			return -1;
+		}
+
+		len = inlen - inpos < count ? inlen - inpos : count;
+		memcpy(pos, inbuf + inpos, len);
+		inpos += len;
+		pos += len;
+		count -= len;
+	}
+
+	return 0;
+}
+
+// helper function to read json string from pipein (messages are separated by newlines)
 // caller is responsible for freeing the generated json_object
 int readjson(struct json_object **out)
 {
-	// allocate a large enough buffer for our json data
-	// (if the json is longer than this, we'll terminate the program)
-	char *buf = (char *)malloc(65536);
-	char *ret = NULL;
-	int code = 0;
+	enum json_tokener_error err;
+	bool started = false;
 
 	if (out == NULL) {
 		errno = EINVAL;
-		code = -2;
-		goto cleanup;
+		return -2;
 	}
 
-	if (pipein == NULL) {
-		pipein = fdopen(PIPEIN, "r");
+	if (tok == NULL) {
+		tok = json_tokener_new();
 	}
 
-	ret = fgets(buf, 65536, pipein);
-	if (ret == NULL) {
-		*out = NULL;
-		code = -1;
-		goto cleanup;
-	}
+	*out = NULL;
+	received_len = 0;
+	for (;;) {
+		// skip the newline ending the previous message; within a message the tokener does that
+		while (!started && inpos < inlen && (inbuf[inpos] == '\n' || inbuf[inpos] == '\r'
+			|| inbuf[inpos] == ' ' || inbuf[inpos] == '\t'))
+		{
+			++inpos;
+		}
+
+		if (inpos == inlen) {
+			if (pipein_fill() < 0) {
+				json_tokener_reset(tok);
+				return -1;
+			}
+
+			continue;
+		}
+
+		started = true;
+		*out = json_tokener_parse_ex(tok, inbuf + inpos, (int)(inlen - inpos));
+		err = json_tokener_get_error(tok);
+		inpos += TOKENER_PARSE_END(tok);
+		received_len += TOKENER_PARSE_END(tok);
 
-	if (feof(pipein)) {
-		code = -1;
-		errno = EIO;
-		goto cleanup;
+		if (err == json_tokener_success) {
+			json_tokener_reset(tok);
+			return 0;
+		} else if (err != json_tokener_continue) {
+			json_tokener_reset(tok);
+			errno = EPROTO;
+			return -1;
+		}
 	}
+}
+
+// whether readjson() can return a message without reading from pipein
+bool readjson_buffered(void)
+{
+	return inpos < inlen && memchr(inbuf + inpos, '\n', inlen - inpos) != NULL;
+}
 
-	*out = json_tokener_parse(buf);
+// whether a complete binary frame has been read from pipein already
+static bool frame_buffered(void)
+{
+	struct sb_frame frame;
 
-cleanup:
-	free(buf);
+	if (inlen - inpos < sizeof(frame)) {
+		return false;
+	}
 
-	return code;
+	memcpy(&frame, inbuf + inpos, sizeof(frame));
+	return inlen - inpos - sizeof(frame) >= frame.len;
 }
 
 void _debug_backtrace() {
@@ -104,41 +249,336 @@ void fatal(const char *msg)
 }
 
 #ifdef JSON_C_TO_STRING_NOSLASHESCAPE
-#define SB_JSON_FLAGS (JSON_C_TO_STRING PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE)
+#define SB_JSON_FLAGS (JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE)
 #else
 #define SB_JSON_FLAGS JSON_C_TO_STRING_PLAIN
 #endif
 
-/* We use JSON-RPC 2.0 as the communication format.
+// protocol spoken with the overall parent, see negotiate_protocol()
+static int protocol = SB_PROTO_JSON;
+// id of the next request we send; responses must echo it back
+static uint32_t next_id = 0;
+// child the overall parent currently attributes our calls to, see select_child()
+static unsigned int selected_child = 0;
+
+/* Calls sent with trampoline_async() whose response has not arrived yet. Responses can
+ * come back in any order, they are matched to the call they answer by id. */
+struct pending_call {
+	uint32_t id;
+	sb_callback done; // NULL if the caller no longer cares, see trampoline_cancel()
+	void *ctx;
+	struct sb_hist *hist; // where the call is recorded once answered, see sbstats.c
+	uint64_t start;
+	size_t sent;
+};
+
+static struct pending_call *pending = NULL;
+static size_t npending = 0;
+static size_t pendingcap = 0;
+
+// where the data of the response to a trampoline_buf() call goes, see store_data()
+static struct {
+	bool active;
+	uint32_t id;
+	unsigned char *buf;
+	size_t cap;
+	size_t len;
+} dest;
+
+static void send_json(int ns, const char *fname, json_object *args, int64_t id);
+static uint32_t receive_json(int *code, int *err, json_object **data);
+static void send_binary(int ns, const char *fname, json_object *args, int64_t id);
+static uint32_t receive_binary(int *code, int *err, json_object **data);
+
+/* Sends a call to the overall parent; id is -1 for a notification, which is not answered */
+static void send_call(int ns, const char *fname, json_object *args, int64_t id)
+{
+	if (protocol == SB_PROTO_BINARY) {
+		send_binary(ns, fname, args, id);
+	} else {
+		send_json(ns, fname, args, id);
+	}
+}
+
+/* Reads the next response from the overall parent, whichever call it is for.
+ * code, err and data are set as trampoline() would return them; returns the id. */
+static uint32_t receive_response(int *code, int *err, json_object **data)
+{
+	if (protocol == SB_PROTO_BINARY) {
+		return receive_binary(code, err, data);
+	}
+
+	return receive_json(code, err, data);
+}
+
+/* If the response with the given id is for the trampoline_buf() call we are waiting on,
+ * stores its (string) data in that call's buffer, decoding it first if base64 is set.
+ * Returns false if the data is for someone else. */
+static bool store_data(uint32_t id, const char *str, size_t len, bool base64)
+{
+	if (!dest.active || id != dest.id) {
+		return false;
+	}
+
+	dest.len = dest.cap;
+	if (base64) {
+		if (base64decode(str, len, dest.buf, &dest.len)) {
+			debug_error("invalid base64-encoded data.\n");
+			exit(EPROTO);
+		}
+	} else if (len <= dest.cap) {
+		memcpy(dest.buf, str, len);
+		dest.len = len;
+	} else {
+		debug_error("data string larger than buffer\n");
+		exit(EPROTO);
+	}
+
+	return true;
+}
+
+/* Hands a response to the trampoline_async() call it belongs to */
+static void complete_pending(uint32_t id, int code, int err, json_object *data)
+{
+	struct pending_call call;
+	size_t i;
+
+	for (i = 0; i < npending; ++i) {
+		if (pending[i].id == id) {
+			break;
+		}
+	}
+
+	if (i == npending) {
+		debug_error("Response id %u does not match any request.\n", id);
+		exit(EPROTO);
+	}
+
+	// taken off the list first, the callback is free to make further calls
+	call = pending[i];
+	pending[i] = pending[--npending];
+	stats_record(call.hist, call.start, call.sent + received_len);
+
+	if (call.done != NULL) {
+		errno = err;
+		call.done(call.ctx, code, err, data);
+	} else {
+		json_object_put(data);
+	}
+}
+
+// with several children, tell the overall parent whenever we start making calls for a
+// different one than before; everything up to the next sb.select is about that child
+static void select_child(void)
+{
+	json_object *args;
+
+	if (nchildren <= 1 || current_child == NULL || current_child->index == selected_child) {
+		return;
+	}
+
+	selected_child = current_child->index;
+	args = json_object_new_array();
+	json_object_array_add(args, json_object_new_int(selected_child));
+	send_call(NS_SB, "select", args, -1);
+	json_object_put(args);
+}
+
+static json_object *build_args(int numargs, va_list vargs)
+{
+	json_object *args;
+
+	if (numargs == -1) {
+		return va_arg(vargs, json_object *);
+	}
+
+	args = json_object_new_array();
+	for (int i = 0; i < numargs; ++i) {
+		json_object_array_add(args, va_arg(vargs, json_object *));
+	}
+
+	return args;
+}
+
+/* We use JSON-RPC 2.0 as the communication format unless negotiate_protocol()
+ * switched us over to binary frames (see sbcontext.h for their layout).
  * On success, the response key should be an object with the following keys:
  * code - int; this will be the return value of trampoline().
  * data - any; required if out is not NULL, is not read if out is NULL.
  *   The value of data will be stored in out.
  * base64 - bool (optional); if true data must be a base64-encoded string,
  *   it will be decoded before writing it to out.
+ * The json_object args passed in are consumed by this call.
+ * Responses to calls made with trampoline_async() that arrive while we wait for ours
+ * are passed on to their callbacks.
  */
 int trampoline(struct json_object **out, int ns, const char *fname, int numargs, ...)
 {
-	static size_t id = 0;
+	va_list vargs;
+	json_object *args, *data;
+	uint32_t id, got;
+	uint64_t start;
+	size_t sent;
+	int code, err;
+
+	va_start(vargs, numargs);
+	args = build_args(numargs, vargs);
+	va_end(vargs);
+
+	select_child();
+	id = next_id++;
+	start = stats_now();
+	send_call(ns, fname, args, id);
+	sent = sent_len;
+	json_object_put(args);
+
+	while ((got = receive_response(&code, &err, &data)) != id) {
+		complete_pending(got, code, err, data);
+	}
+
+	stats_record(stats_method(ns, fname), start, sent + received_len);
+
+	if (out != NULL) {
+		*out = data;
+	} else {
+		json_object_put(data);
+	}
+
+	errno = err;
+	return code;
+}
+
+/* Like trampoline(), for calls which answer with a string (file contents, for instance).
+ * Instead of being returned as a json object, the data is stored in buf, which has room for
+ * *len bytes; base64-encoded data is decoded straight into it. *len is set to the length of
+ * the data, or 0 if there was none. Data which does not fit into buf is a protocol error.
+ */
+int trampoline_buf(void *buf, size_t *len, int ns, const char *fname, int numargs, ...)
+{
+	va_list vargs;
+	json_object *args, *data;
+	uint32_t id, got;
+	uint64_t start;
+	size_t sent;
+	int code, err;
+
+	va_start(vargs, numargs);
+	args = build_args(numargs, vargs);
+	va_end(vargs);
+
+	select_child();
+	id = next_id++;
+	start = stats_now();
+	send_call(ns, fname, args, id);
+	sent = sent_len;
+	json_object_put(args);
+
+	dest.active = true;
+	dest.id = id;
+	dest.buf = (unsigned char *)buf;
+	dest.cap = *len;
+	dest.len = 0;
+
+	while ((got = receive_response(&code, &err, &data)) != id) {
+		complete_pending(got, code, err, data);
+	}
+
+	dest.active = false;
+	*len = dest.len;
+	stats_record(stats_method(ns, fname), start, sent + received_len);
+
+	// anything but a string, error details for instance
+	json_object_put(data);
+
+	errno = err;
+	return code;
+}
+
+/* Like trampoline(), but returns as soon as the call is sent. done is called with ctx and
+ * the result (which it must release) once the response is read, either by trampoline_receive()
+ * or while a later trampoline() waits for its own. args is a json array, and is consumed.
+ */
+void trampoline_async(int ns, const char *fname, struct json_object *args, sb_callback done, void *ctx)
+{
+	select_child();
+
+	if (npending == pendingcap) {
+		pendingcap = pendingcap ? pendingcap * 2 : 16;
+		pending = (struct pending_call *)realloc(pending, pendingcap * sizeof(struct pending_call));
+		if (pending == NULL) {
+			fatal("Out of memory");
+		}
+	}
+
+	pending[npending].id = next_id;
+	pending[npending].done = done;
+	pending[npending].ctx = ctx;
+	pending[npending].hist = stats_method(ns, fname);
+	pending[npending].start = stats_now();
+
+	send_call(ns, fname, args, next_id++);
+	pending[npending].sent = sent_len;
+	++npending;
+	json_object_put(args);
+}
+
+/* Makes sure done is no longer called for ctx; the responses are read and dropped as usual */
+void trampoline_cancel(void *ctx)
+{
+	for (size_t i = 0; i < npending; ++i) {
+		if (pending[i].ctx == ctx) {
+			pending[i].done = NULL;
+		}
+	}
+}
+
+/* Reads one response for a trampoline_async() call, blocking until there is one */
+void trampoline_receive(void)
+{
+	json_object *data;
+	uint32_t id;
+	int code, err;
+
+	id = receive_response(&code, &err, &data);
+	complete_pending(id, code, err, data);
+}
+
+/* Returns true if a response was read from PIPEIN already but not handed out yet,
+ * in which case waiting for PIPEIN to become readable is not going to tell us about it */
+bool trampoline_buffered(void)
+{
+	return protocol == SB_PROTO_BINARY ? frame_buffered() : readjson_buffered();
+}
 
+/* Sends a call to the overall parent without waiting for, or getting, any response.
+ * Used for calls whose result we would ignore anyway. Arguments work like trampoline().
+ */
+void notify(int ns, const char *fname, int numargs, ...)
+{
 	va_list vargs;
-	int ret = 0, i;
-	char *decorated_fname = (char *)malloc(strlen(fname) + 5);
+	json_object *args;
+
+	va_start(vargs, numargs);
+	args = build_args(numargs, vargs);
+	va_end(vargs);
+
+	select_child();
+	send_call(ns, fname, args, -1);
+	json_object_put(args);
+}
+
+static void send_json(int ns, const char *fname, json_object *args, int64_t id)
+{
+	int ret = 0;
+	char *decorated_fname = (char *)malloc(strlen(fname) + 8);
 	if (decorated_fname == NULL) {
 		debug_error("Out of memory");
 		exit(errno);
 	}
 
 	json_object *callinfo = json_object_new_object();
-	json_object *response = NULL;
-	json_object *json_code = NULL;
-	json_object *json_errno = NULL;
-	json_object *json_temp = NULL;
-	json_object *json_data = NULL;
 	json_object *name = NULL;
-	json_object *args = json_object_new_array();
 	json_object *version = json_object_new_string("2.0");
-	json_object *json_id = json_object_new_int64(id);
 
 	switch (ns) {
 	case NS_SYS:
@@ -150,86 +590,107 @@ int trampoline(struct json_object **out, int ns, const char *fname, int numargs,
 	case NS_APP:
 		strcpy(decorated_fname, "app.");
 		break;
+	default:
+		// namespaces registered by the overall parent are addressed by number
+		sprintf(decorated_fname, "%d.", (int16_t)ns);
+		break;
 	}
 
 	// decorated_fname is guaranteed to be large enough to hold the prefix above
-	// (max 4 bytes), fname, and the trailing NULL byte because the size of it
-	// is fname + 5.
+	// (max 7 bytes), fname, and the trailing NULL byte because the size of it
+	// is fname + 8.
 	strcat(decorated_fname, fname);
 	name = json_object_new_string(decorated_fname);
 	free(decorated_fname);
 
-	va_start(vargs, numargs);
-	if (numargs == -1) {
-		json_object_put(args);
-		args = va_arg(vargs, json_object *);
-	} else {
-		for (i = 0; i < numargs; ++i) {
-			json_object_array_add(args, va_arg(vargs, json_object *));
-		}
-	}
-	va_end(vargs);
-
 	json_object_object_add(callinfo, "jsonrpc", version);
 	json_object_object_add(callinfo, "method", name);
-	json_object_object_add(callinfo, "params", args);
-	json_object_object_add(callinfo, "id", json_id);
+	// args is owned by our caller, callinfo takes its own reference
+	json_object_object_add(callinfo, "params", json_object_get(args));
+
+	// a request without an id is a notification
+	if (id >= 0) {
+		json_object_object_add(callinfo, "id", json_object_new_int64(id));
+	}
 
-	ret = writejson(json_object_to_json_string_ext(callinfo, SB_JSON_FLAGS));
+	const char *json = json_object_to_json_string_ext(callinfo, SB_JSON_FLAGS);
+	sent_len = strlen(json) + 1;
+	ret = writejson(json);
+	json_object_put(callinfo);
 	if (ret < 0) {
 		debug_error("writejson failed with errno %d\n", errno);
 		exit(-errno);
 	}
+}
 
-	ret = readjson(&response);
-	if (ret < 0) {
+static uint32_t receive_json(int *code, int *err, json_object **data)
+{
+	json_object *response = NULL;
+	json_object *json_code = NULL;
+	json_object *json_errno = NULL;
+	json_object *json_temp = NULL;
+	json_object *json_data = NULL;
+	uint32_t id;
+	bool base64;
+
+	if (readjson(&response) < 0) {
 		debug_error("readjson failed with errno %d\n", errno);
 		exit(-errno);
 	}
 
-	// we trust the parent implementation of json-rpc and do not validate that id is correct
-	// as we are not equipped to handle out-of-order responses anyway due to being singlethreaded.
-	// similarly, we do not validate that jsonrpc is set and equals 2.0 in the response.
+	// we do not validate that jsonrpc is set and equals 2.0 in the response, but we need
+	// the id to tell which call it answers
+	if (!json_object_object_get_ex(response, "id", &json_temp) || !json_object_is_type(json_temp, json_type_int)) {
+		debug_error("Response without a valid id.\n");
+		exit(EPROTO);
+	}
+
+	id = (uint32_t)json_object_get_int64(json_temp);
+	*data = NULL;
+
 	if (json_object_object_get_ex(response, "error", &json_data)) {
-		ret = -1;
+		*code = -1;
 		json_object_object_get_ex(json_data, "code", &json_errno);
 		json_object_object_get_ex(json_data, "message", &json_temp);
-		errno = json_object_get_int(json_errno);
+		*err = json_object_get_int(json_errno);
 
-		if (errno >= -32768 && errno <= -32000) {
-			debug_error("JSON-RPC error %d: %s\n", errno, json_object_get_string(json_temp));
+		if (*err >= -32768 && *err <= -32000) {
+			debug_error("JSON-RPC error %d: %s\n", *err, json_object_get_string(json_temp));
 			exit(EPROTO);
 		}
 
-		if (out != NULL) {
-			*out = json_object_get(json_data);
-		}
+		*data = json_object_get(json_data);
 	} else if (json_object_object_get_ex(response, "result", &json_data)) {
-		errno = 0;
+		*err = 0;
 		json_object_object_get_ex(json_data, "code", &json_code);
-		ret = json_object_get_int(json_code);
-
-		if (out != NULL) {
-			json_object_object_get_ex(json_data, "data", out);
-
-			if (json_object_object_get_ex(json_data, "base64", &json_temp) &&
-				json_object_get_boolean(json_temp))
-			{
-				const char *b64 = json_object_get_string(*out);
-				size_t b64_len = (size_t)json_object_get_string_len(*out) + 1;
-				char *b64_buf = (char *)malloc(b64_len);
-		
-				if (base64decode(b64, strlen(b64), (unsigned char *)b64_buf, &b64_len)) {
-					debug_error("invalid base64-encoded data.\n");
-					exit(EPROTO);
-				}
+		*code = json_object_get_int(json_code);
 
-				*out = json_object_new_string_len(b64_buf, b64_len);
-				free(b64_buf);
-			} else {
-				// need to increment refcount for this since we're freeing response below
-				*out = json_object_get(*out);
+		if (json_object_object_get_ex(json_data, "errno", &json_errno)) {
+			*err = json_object_get_int(json_errno);
+		}
+
+		json_object_object_get_ex(json_data, "data", data);
+		base64 = json_object_object_get_ex(json_data, "base64", &json_temp) && json_object_get_boolean(json_temp);
+
+		if (json_object_is_type(*data, json_type_string)
+			&& store_data(id, json_object_get_string(*data), (size_t)json_object_get_string_len(*data), base64))
+		{
+			*data = NULL;
+		} else if (base64) {
+			const char *b64 = json_object_get_string(*data);
+			size_t b64_len = (size_t)json_object_get_string_len(*data) + 1;
+			char *b64_buf = (char *)malloc(b64_len);
+
+			if (base64decode(b64, strlen(b64), (unsigned char *)b64_buf, &b64_len)) {
+				debug_error("invalid base64-encoded data.\n");
+				exit(EPROTO);
 			}
+
+			*data = json_object_new_string_len(b64_buf, b64_len);
+			free(b64_buf);
+		} else {
+			// need to increment refcount for this since we're freeing response below
+			*data = json_object_get(*data);
 		}
 	} else {
 		debug_error("Neither error nor result are set in response.\n");
@@ -237,99 +698,480 @@ int trampoline(struct json_object **out, int ns, const char *fname, int numargs,
 	}
 
 	json_object_put(response);
-	return ret;
+	return id;
 }
 
-// base64 decode routine from wikibooks
-// code was released into the public domain there
-
-#define WHITESPACE 64
-#define EQUALS     65
-#define INVALID    66
-
-static const unsigned char d[] = {
-    66,66,66,66,66,66,66,66,66,66,64,66,66,66,66,66,66,66,66,66,66,66,66,66,66,
-    66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,62,66,66,66,63,52,53,
-    54,55,56,57,58,59,60,61,66,66,66,65,66,66,66, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
-    10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,66,66,66,66,66,66,26,27,28,
-    29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47,48,49,50,51,66,66,
-    66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,
-    66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,
-    66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,
-    66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,
-    66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,66,
-    66,66,66,66,66,66
-};
 
-int base64decode(const char *in, size_t inLen, unsigned char *out, size_t *outLen)
-{ 
-    const char *end = in + inLen;
-    char iter = 0;
-    size_t buf = 0, len = 0;
-    
-    while (in < end) {
-        unsigned char c = d[(unsigned char)*in++];
-        
-        switch (c) {
-        case WHITESPACE: continue;   /* skip whitespace */
-        case INVALID:    return 1;   /* invalid input, return error */
-        case EQUALS:                 /* pad character, end of data */
-            in = end;
-            continue;
-        default:
-            buf = buf << 6 | c;
-            iter++; // increment the number of iteration
-            /* If the buffer is full, split it into bytes */
-            if (iter == 4) {
-                if ((len += 3) > *outLen) return 1; /* buffer overflow */
-                *(out++) = (buf >> 16) & 255;
-                *(out++) = (buf >> 8) & 255;
-                *(out++) = buf & 255;
-                buf = 0; iter = 0;
-
-            }   
-        }
-    }
-   
-    if (iter == 3) {
-        if ((len += 2) > *outLen) return 1; /* buffer overflow */
-        *(out++) = (buf >> 10) & 255;
-        *(out++) = (buf >> 2) & 255;
-    }
-    else if (iter == 2) {
-        if (++len > *outLen) return 1; /* buffer overflow */
-        *(out++) = (buf >> 4) & 255;
-    }
-
-    *outLen = len; /* modify to reflect the actual output size */
-    return 0;
-}
-
-const struct sys_arg_map arg_map[] = {
-	ASYS(open, 3, 0, sizeof(int), sizeof(mode_t)),
-	ASYS(fcntl, 3, sizeof(int), sizeof(int), -1),
-	ASYS(close, 1, sizeof(int)),
-	ASYS(read, 3),
-	ASYS(stat, 2),
-	ASYS(fstat, 2),
-	ASYS(lstat, 2),
-	ASYS(readlink, 3),
-	ASYS(openat, 4),
-	ASYS(getdents, 3),
-	ASYS(lseek, 3),
-	ASYS(dup, 1),
-	ASYS(mmap, 6),
-	ASYS(statfs, 2),
-	ASYS(access, 2),
-	ASYS(poll, 3),
-	{ NULL, 0, NULL }
+// outgoing frames are assembled here; the buffer is reused across calls and only ever grows
+static unsigned char *framebuf = NULL;
+static size_t framecap = 0;
+static size_t framelen = 0;
+
+static void frame_reserve(size_t count)
+{
+	size_t newcap = framecap ? framecap : 4096;
+
+	if (framelen + count <= framecap) {
+		return;
+	}
+
+	while (newcap < framelen + count) {
+		newcap *= 2;
+	}
+
+	framebuf = (unsigned char *)realloc(framebuf, newcap);
+	if (framebuf == NULL) {
+		fatal("Out of memory");
+	}
+
+	framecap = newcap;
+}
+
+static void frame_put(const void *data, size_t count)
+{
+	frame_reserve(count);
+	memcpy(framebuf + framelen, data, count);
+	framelen += count;
+}
+
+static void frame_put_value(json_object *val)
+{
+	uint8_t tag;
+	uint32_t len;
+	int64_t num;
+	const char *str;
+
+	switch (json_object_get_type(val)) {
+	case json_type_null:
+		tag = SBV_NULL;
+		frame_put(&tag, 1);
+		break;
+	case json_type_boolean:
+	case json_type_int:
+		tag = SBV_INT;
+		num = json_object_get_int64(val);
+		frame_put(&tag, 1);
+		frame_put(&num, sizeof(num));
+		break;
+	case json_type_string:
+		tag = SBV_STR;
+		str = json_object_get_string(val);
+		len = (uint32_t)json_object_get_string_len(val);
+		frame_put(&tag, 1);
+		frame_put(&len, sizeof(len));
+		frame_put(str, len);
+		break;
+	default:
+		// doubles, arrays and objects are rare enough that JSON text is fine for them
+		tag = SBV_JSON;
+		str = json_object_to_json_string_ext(val, SB_JSON_FLAGS);
+		len = (uint32_t)strlen(str);
+		frame_put(&tag, 1);
+		frame_put(&len, sizeof(len));
+		frame_put(str, len);
+		break;
+	}
+}
+
+// copies count bytes out of a received payload, terminating on truncated frames
+static void frame_get(const unsigned char **pos, const unsigned char *end, void *dst, size_t count)
+{
+	if ((size_t)(end - *pos) < count) {
+		debug_error("Truncated frame from parent.\n");
+		exit(EPROTO);
+	}
+
+	memcpy(dst, *pos, count);
+	*pos += count;
+}
+
+static json_object *frame_get_value(const unsigned char **pos, const unsigned char *end)
+{
+	uint8_t tag;
+	uint32_t len;
+	int64_t num;
+	struct sb_stat st;
+	json_object *val = NULL;
+	char *text = NULL;
+
+	frame_get(pos, end, &tag, 1);
+
+	switch (tag) {
+	case SBV_NULL:
+		return NULL;
+	case SBV_INT:
+		frame_get(pos, end, &num, sizeof(num));
+		return json_object_new_int64(num);
+	case SBV_STR:
+	case SBV_JSON:
+		frame_get(pos, end, &len, sizeof(len));
+		if ((size_t)(end - *pos) < len) {
+			debug_error("Truncated frame from parent.\n");
+			exit(EPROTO);
+		}
+
+		if (tag == SBV_STR) {
+			val = json_object_new_string_len((const char *)*pos, len);
+		} else {
+			// needs to be NULL terminated, otherwise json-c can't tell that a number has ended
+			text = strndup((const char *)*pos, len);
+			val = json_tokener_parse(text);
+			free(text);
+		}
+
+		*pos += len;
+		return val;
+	case SBV_STAT:
+		// kept as the raw record, parse_stat() copies it out from there
+		frame_get(pos, end, &st, sizeof(st));
+		return json_object_new_string_len((const char *)&st, sizeof(st));
+	}
+
+	debug_error("Unknown value tag %d in frame from parent.\n", tag);
+	exit(EPROTO);
+}
+
+static int write_full(int fd, const void *buf, size_t count)
+{
+	const char *pos = (const char *)buf;
+	ssize_t ret;
+
+	while (count > 0) {
+		ret = write(fd, pos, count);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		pos += ret;
+		count -= ret;
+	}
+
+	return 0;
+}
+
+static void send_binary(int ns, const char *fname, json_object *args, int64_t id)
+{
+	struct sb_frame frame;
+	int i;
+
+	framelen = 0;
+	frame_reserve(sizeof(frame));
+	framelen = sizeof(frame);
+
+	frame.namelen = (uint16_t)strlen(fname);
+	frame_put(fname, frame.namelen);
+
+	if (json_object_is_type(args, json_type_array)) {
+		for (i = 0; i < json_object_array_length(args); ++i) {
+			frame_put_value(json_object_array_get_idx(args, i));
+		}
+	} else {
+		frame_put_value(args);
+	}
+
+	frame.len = (uint32_t)(framelen - sizeof(frame));
+	frame.id = id >= 0 ? (uint32_t)id : 0;
+	frame.type = id >= 0 ? SBF_CALL : SBF_NOTIFY;
+	frame.ns = (uint8_t)ns;
+	memcpy(framebuf, &frame, sizeof(frame));
+
+	sent_len = framelen;
+	if (write_full(PIPEOUT, framebuf, framelen) < 0) {
+		debug_error("write to parent failed with errno %d\n", errno);
+		exit(-errno);
+	}
+}
+
+static uint32_t receive_binary(int *code, int *err, json_object **data)
+{
+	static unsigned char *payload = NULL;
+	static size_t paycap = 0;
+
+	struct sb_frame frame;
+	const unsigned char *pos, *end;
+	int32_t val;
+	uint32_t len;
+
+	if (pipein_read(&frame, sizeof(frame)) < 0) {
+		debug_error("read from parent failed with errno %d\n", errno);
+		exit(-errno);
+	}
+
+	if (frame.len > paycap) {
+		payload = (unsigned char *)realloc(payload, frame.len);
+		if (payload == NULL) {
+			fatal("Out of memory");
+		}
+
+		paycap = frame.len;
+	}
+
+	if (pipein_read(payload, frame.len) < 0) {
+		debug_error("read from parent failed with errno %d\n", errno);
+		exit(-errno);
+	}
+
+	received_len = sizeof(frame) + frame.len;
+
+	pos = payload;
+	end = payload + frame.len;
+
+	if (frame.type == SBF_ERROR) {
+		frame_get(&pos, end, &val, sizeof(val));
+		*data = frame_get_value(&pos, end);
+
+		if (val >= -32768 && val <= -32000) {
+			debug_error("JSON-RPC error %d: %s\n", val, json_object_get_string(*data));
+			exit(EPROTO);
+		}
+
+		*code = -1;
+		*err = val;
+		return frame.id;
+	} else if (frame.type != SBF_RESULT) {
+		debug_error("Unexpected frame type %d from parent.\n", frame.type);
+		exit(EPROTO);
+	}
+
+	frame_get(&pos, end, &val, sizeof(val));
+	*code = val;
+	frame_get(&pos, end, &val, sizeof(val));
+	*err = val;
+
+	if (pos < end && *pos == SBV_STR && dest.active && frame.id == dest.id) {
+		// copied out of the frame as is, without making a json string of it first
+		++pos;
+		frame_get(&pos, end, &len, sizeof(len));
+		if ((size_t)(end - pos) < len) {
+			debug_error("Truncated frame from parent.\n");
+			exit(EPROTO);
+		}
+
+		store_data(frame.id, (const char *)pos, len, false);
+		*data = NULL;
+		return frame.id;
+	}
+
+	*data = frame_get_value(&pos, end);
+	return frame.id;
+}
+
+/* Asks the overall parent which wire protocol it would like to speak. This must be
+ * the very first message sent, as a parent which does not know about negotiation
+ * will simply answer it with an error and we stay on JSON.
+ */
+void negotiate_protocol(void)
+{
+	json_object *callinfo = json_object_new_object();
+	json_object *params = json_object_new_array();
+	json_object *protocols = json_object_new_array();
+	json_object *response = NULL;
+	json_object *result = NULL;
+	json_object *data = NULL;
+
+	json_object_array_add(protocols, json_object_new_string("binary"));
+	json_object_array_add(protocols, json_object_new_string("json"));
+
+	json_object_object_add(callinfo, "jsonrpc", json_object_new_string("2.0"));
+	json_object_object_add(callinfo, "method", json_object_new_string("sb.negotiate"));
+	json_object_array_add(params, protocols);
+	json_object_object_add(callinfo, "params", params);
+	json_object_object_add(callinfo, "id", json_object_new_int64(next_id++));
+
+	if (writejson(json_object_to_json_string_ext(callinfo, SB_JSON_FLAGS)) < 0) {
+		debug_error("writejson failed with errno %d\n", errno);
+		exit(-errno);
+	}
+
+	json_object_put(callinfo);
+
+	if (readjson(&response) < 0) {
+		debug_error("readjson failed with errno %d\n", errno);
+		exit(-errno);
+	}
+
+	// an error response (e.g. method not found) means the parent only speaks JSON.
+	// Binary frames are read from the same buffer as JSON, so nothing is lost if the
+	// parent were to send more right after this response.
+	if (json_object_object_get_ex(response, "result", &result)
+		&& json_object_object_get_ex(result, "data", &data)
+		&& json_object_is_type(data, json_type_string)
+		&& !strcmp(json_object_get_string(data), "binary"))
+	{
+		protocol = SB_PROTO_BINARY;
+	}
+
+	debug_print("Using %s protocol with parent.\n", protocol == SB_PROTO_BINARY ? "binary" : "json");
+	json_object_put(response);
+}
+
+/* Child side counterpart of trampoline(): sends a request for something other than a
+ * syscall to our parent over RPCSOCK (which usually forwards it upstream) and waits for
+ * the response. Return value, errno and out behave as they do for trampoline(), and
+ * args (a json array) is consumed.
+ * The response is an int code, an int errno, our cache epoch, and then the data as JSON text.
+ */
+int sbcall(struct json_object **out, int ns, const char *fname, struct json_object *args)
+{
+	static char buf[65536];
+	const char *json = json_object_to_json_string_ext(args, SB_JSON_FLAGS);
+	int16_t req_ns = (int16_t)ns;
+	uint16_t fnamelen = (uint16_t)(strlen(fname) + 1);
+	uint16_t arglen = (uint16_t)strlen(json);
+	uint64_t start;
+	size_t sent;
+	int code, err, ret;
+	unsigned int epoch;
+	json_tokener *tok;
+	json_object *data;
+
+	struct iovec request[5] = {
+		{ &req_ns, 2 },
+		{ &fnamelen, 2 },
+		{ &arglen, 2 },
+		{ (void *)fname, fnamelen },
+		{ (void *)json, arglen }
+	};
+
+	struct iovec response[4] = {
+		{ &code, sizeof(int) },
+		{ &err, sizeof(int) },
+		{ &epoch, sizeof(unsigned int) },
+		{ buf, sizeof(buf) - 1 }
+	};
+
+	if (fnamelen + strlen(json) > 65536) {
+		json_object_put(args);
+		errno = E2BIG;
+		return -1;
+	}
+
+	start = stats_now();
+	ret = writev(RPCSOCK, request, 5);
+	json_object_put(args);
+	if (ret < 0) {
+		debug_error("writev failed: %s", strerror(errno));
+		exit(EIO);
+	}
+
+	sent = (size_t)ret;
+	ret = readv(RPCSOCK, response, 4);
+	if (ret < (int)(2 * sizeof(int) + sizeof(unsigned int))) {
+		debug_error("readv failed: %s", strerror(errno));
+		exit(EIO);
+	}
+
+	stats_record(stats_method(ns, fname), start, sent + ret);
+
+	// our parent moves the epoch on when it forwards a call (the overall parent may change its nodes
+	// while handling it)
+	scache_epoch(epoch);
+
+	// include the terminating NULL byte, otherwise json-c can't tell that a number has ended
+	ret -= 2 * sizeof(int) + sizeof(unsigned int);
+	buf[ret] = '\0';
+	tok = json_tokener_new();
+	data = json_tokener_parse_ex(tok, buf, ret + 1);
+	if (json_tokener_get_error(tok) != json_tokener_success) {
+		debug_error("Invalid JSON in response from parent.\n");
+		exit(EPROTO);
+	}
+
+	json_tokener_free(tok);
+
+	if (out != NULL) {
+		*out = data;
+	} else {
+		json_object_put(data);
+	}
+
+	errno = err;
+	return code;
+}
+
+/* Fills buf from a stat result received from our parent. This is either the raw struct sb_stat
+ * of a SBV_STAT value (binary protocol) or an object with st_* keys (JSON protocol), in which
+ * case the nanosecond parts of the timestamps are optional. Malformed results are fatal.
+ */
+int parse_stat(struct json_object *data, struct stat *buf)
+{
+	static const char *keys[] = {
+		"st_dev", "st_ino", "st_mode", "st_nlink", "st_uid", "st_gid", "st_rdev", "st_size",
+		"st_atime", "st_mtime", "st_ctime", "st_blksize", "st_blocks",
+		"st_atime_nsec", "st_mtime_nsec", "st_ctime_nsec"
+	};
+
+	struct sb_stat st;
+	int64_t *fields = (int64_t *)&st;
+	json_object *fld = NULL;
+
+	if (json_object_is_type(data, json_type_string) && json_object_get_string_len(data) == sizeof(st)) {
+		memcpy(&st, json_object_get_string(data), sizeof(st));
+	} else if (json_object_is_type(data, json_type_object)) {
+		for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+			if (!json_object_object_get_ex(data, keys[i], &fld)) {
+				if (i >= 13) {
+					fields[i] = 0;
+					continue;
+				}
+
+				debug_error("data.%s expected\n", keys[i]);
+				exit(EPROTO);
+			}
+
+			if (!json_object_is_type(fld, json_type_int)) {
+				debug_error("data.%s is not an int\n", keys[i]);
+				exit(EPROTO);
+			}
+
+			fields[i] = json_object_get_int64(fld);
+		}
+	} else {
+		debug_error("data is not a stat result\n");
+		exit(EPROTO);
+	}
+
+	memset(buf, 0, sizeof(struct stat));
+	buf->st_dev = (dev_t)st.dev;
+	buf->st_ino = (ino_t)st.ino;
+	buf->st_mode = (mode_t)st.mode;
+	buf->st_nlink = (nlink_t)st.nlink;
+	buf->st_uid = (uid_t)st.uid;
+	buf->st_gid = (gid_t)st.gid;
+	buf->st_rdev = (dev_t)st.rdev;
+	buf->st_size = (off_t)st.size;
+	buf->st_blksize = (blksize_t)st.blksize;
+	buf->st_blocks = (blkcnt_t)st.blocks;
+	buf->st_atim.tv_sec = (time_t)st.atime;
+	buf->st_atim.tv_nsec = (long)st.atime_nsec;
+	buf->st_mtim.tv_sec = (time_t)st.mtime;
+	buf->st_mtim.tv_nsec = (long)st.mtime_nsec;
+	buf->st_ctim.tv_sec = (time_t)st.ctime;
+	buf->st_ctim.tv_nsec = (long)st.ctime_nsec;
+
+	return 0;
+}
+
+// dispatch table, indexed by syscall number so that the trap path and the parent's
+// request loop can find a handler without scanning. Built from SB_SYSCALLS, with
+// __NR_* taken from the kernel headers of whatever arch we are compiled for.
+const struct sys_arg_map arg_map[SB_NSYSCALLS] = {
+#define SB_SYSCALL(name, nargs, ...) [__NR_##name] = ASYS(name, nargs, __VA_ARGS__),
+	SB_SYSCALLS
+#undef SB_SYSCALL
 };
 
+const int nsyscalls = SB_NSYSCALLS;
+
 // map syscall ints to strings (table generated via ausyscall --dump)
+// this is only used for diagnostics; numbers which are not assigned are NULL
 
 #if defined(__x86_64__)
 
-const int nsyscalls = 322;
 const char *syscalls[] = {
 /* 0 */ "read",
 /* 1 */ "write",
@@ -653,12 +1495,17 @@ const char *syscalls[] = {
 /* 319 */ "memfd_create",
 /* 320 */ "kexec_file_load",
 /* 321 */ "bpf",
+/* 322 */ "execveat",
+/* 323 */ "userfaultfd",
+/* 324 */ "membarrier",
+/* 325 */ "mlock2",
+/* 326 */ "copy_file_range",
+/* 327 */ "preadv2",
 NULL
 };
 
 #elif defined(__i386__) /* arch */
 
-const int nsyscalls = 358;
 const char *syscalls[] = {
 /* 0 */ "restart_syscall",
 /* 1 */ "exit",
@@ -882,6 +1729,8 @@ const char *syscalls[] = {
 /* 219 */ "madvise",
 /* 220 */ "getdents64",
 /* 221 */ "fcntl64",
+/* 222 */ NULL,
+/* 223 */ NULL,
 /* 224 */ "gettid",
 /* 225 */ "readahead",
 /* 226 */ "setxattr",
@@ -909,6 +1758,7 @@ const char *syscalls[] = {
 /* 248 */ "io_submit",
 /* 249 */ "io_cancel",
 /* 250 */ "fadvise64",
+/* 251 */ NULL,
 /* 252 */ "exit_group",
 /* 253 */ "lookup_dcookie",
 /* 254 */ "epoll_create",
@@ -942,6 +1792,7 @@ const char *syscalls[] = {
 /* 282 */ "mq_getsetattr",
 /* 283 */ "sys_kexec_load",
 /* 284 */ "waitid",
+/* 285 */ NULL,
 /* 286 */ "add_key",
 /* 287 */ "request_key",
 /* 288 */ "keyctl",
@@ -1014,6 +1865,27 @@ const char *syscalls[] = {
 /* 355 */ "getrandom",
 /* 356 */ "memfd_create",
 /* 357 */ "bpf",
+/* 358 */ "execveat",
+/* 359 */ "socket",
+/* 360 */ "socketpair",
+/* 361 */ "bind",
+/* 362 */ "connect",
+/* 363 */ "listen",
+/* 364 */ "accept4",
+/* 365 */ "getsockopt",
+/* 366 */ "setsockopt",
+/* 367 */ "getsockname",
+/* 368 */ "getpeername",
+/* 369 */ "sendto",
+/* 370 */ "sendmsg",
+/* 371 */ "recvfrom",
+/* 372 */ "recvmsg",
+/* 373 */ "shutdown",
+/* 374 */ "userfaultfd",
+/* 375 */ "membarrier",
+/* 376 */ "mlock2",
+/* 377 */ "copy_file_range",
+/* 378 */ "preadv2",
 NULL
 };
 
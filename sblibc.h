@@ -6,22 +6,39 @@
 #define ESYS(name) extern SYS(name)
 #define ASYS(name, nargs, ...) { #name, nargs, sb_##name, { __VA_ARGS__ } }
 
-ESYS(open);
-ESYS(fcntl);
-ESYS(close);
-ESYS(read);
-ESYS(stat);
-ESYS(fstat);
-ESYS(lstat);
-ESYS(readlink);
-ESYS(openat);
-ESYS(getdents);
-ESYS(lseek);
-ESYS(dup);
-ESYS(mmap);
-ESYS(statfs);
-ESYS(access);
-ESYS(poll);
+/* The single list of syscalls we emulate; everything else about them (handler
+ * declarations and the dispatch table) is generated from this.
+ * SB_SYSCALL(name, nargs, arglen...) -- name must match the kernel's __NR_name,
+ * and arglen gives how the child packs each argument when forwarding it to the
+ * parent (0 = NULL terminated string, > 0 = fixed size in bytes).
+ * Reads into iovecs send the total size of the buffers in place of the count.
+ */
+#define SB_SYSCALLS \
+	SB_SYSCALL(open, 3, 0, sizeof(int), sizeof(mode_t)) \
+	SB_SYSCALL(fcntl, 3, sizeof(int), sizeof(int), -1) \
+	SB_SYSCALL(close, 1, sizeof(int)) \
+	SB_SYSCALL(read, 3, sizeof(int), -1, sizeof(unsigned int)) \
+	SB_SYSCALL(pread64, 4, sizeof(int), -1, sizeof(unsigned int), sizeof(off_t)) \
+	SB_SYSCALL(readv, 3, sizeof(int), -1, sizeof(unsigned int)) \
+	SB_SYSCALL(preadv, 5, sizeof(int), -1, sizeof(unsigned int), sizeof(off_t), -1) \
+	SB_SYSCALL(preadv2, 6, sizeof(int), -1, sizeof(unsigned int), sizeof(off_t), -1, -1) \
+	SB_SYSCALL(stat, 2, 0, -1) \
+	SB_SYSCALL(fstat, 2, sizeof(int), -1) \
+	SB_SYSCALL(lstat, 2, 0, -1) \
+	SB_SYSCALL(readlink, 3) \
+	SB_SYSCALL(openat, 4) \
+	SB_SYSCALL(getdents, 3, sizeof(int), -1, sizeof(unsigned int)) \
+	SB_SYSCALL(getdents64, 3, sizeof(int), -1, sizeof(unsigned int)) \
+	SB_SYSCALL(lseek, 3, sizeof(int), sizeof(off_t), sizeof(int)) \
+	SB_SYSCALL(dup, 1) \
+	SB_SYSCALL(mmap, 6, sizeof(int), -1, -1, -1, -1, -1) \
+	SB_SYSCALL(statfs, 2) \
+	SB_SYSCALL(access, 2, 0, sizeof(int)) \
+	SB_SYSCALL(poll, 3)
+
+#define SB_SYSCALL(name, nargs, ...) ESYS(name);
+SB_SYSCALLS
+#undef SB_SYSCALL
 
 struct sys_arg_map {
 	const char *sys;
@@ -30,6 +47,23 @@ struct sys_arg_map {
 	int16_t arglen[6];
 };
 
-extern const struct sys_arg_map arg_map[];
+/* number of syscalls on this architecture (one past the highest syscall number) */
+#if defined(__x86_64__)
+#define SB_NSYSCALLS 328
+#elif defined(__i386__) /* arch */
+#define SB_NSYSCALLS 379
+#endif /* arch */
+
+/* preadv2 is newer than the kernel headers of some systems we are built on */
+#ifndef __NR_preadv2
+#if defined(__x86_64__)
+#define __NR_preadv2 327
+#elif defined(__i386__) /* arch */
+#define __NR_preadv2 378
+#endif /* arch */
+#endif
+
+/* arg_map is indexed directly by syscall number; func is NULL for syscalls we do not emulate */
+extern const struct sys_arg_map arg_map[SB_NSYSCALLS];
 extern const int nsyscalls;
 extern const char *syscalls[];
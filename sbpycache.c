@@ -0,0 +1,236 @@
+// host-wide cache of compiled bytecode, shared by every sandbox on the host
+// the sandbox cannot write bytecode itself, so without this every run compiles every module it imports.
+// when a cache directory is configured (getlimits "pycachedir"), each real directory gets a virtual
+// __pycache__ whose entries are served out of the cache directory. entries are keyed by the source
+// contents, the source mtime and size (both of which end up in the .pyc header) and the name python
+// asked for (which carries the interpreter's cache tag, e.g. cpython-35.pyc or cpython-35.opt-1.pyc).
+// we never compile anything ourselves: misses are queued in the queue/ subdirectory for a trusted
+// compiler (mkpycache.py) to pick up, and the import falls back to compiling from source until then.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sbcontext.h"
+
+#define PYCACHE_MAX_SOURCE 16777216 /* sources larger than this (16 MiB) are not looked up */
+
+static char *pycachedir = NULL;
+static int pycachedirfd = -1;
+static int queuedirfd = -1;
+
+/* Enables the bytecode cache, using dir to store entries. If dir cannot be used,
+ * the cache remains disabled and sources are compiled in the sandbox as usual.
+ * Sandboxed code runs whatever the entries hold, so they have to come from the compiler alone:
+ * dir must belong to another user (whoever runs mkpycache.py) and we must not be able to write
+ * to it. Misses are only queued if its queue/ lets us in (e.g. mode 1733); otherwise the
+ * cache just serves what has been compiled already. Neither is created here. */
+void pycache_init(const char *dir)
+{
+	struct stat st;
+
+	pycachedirfd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (pycachedirfd < 0) {
+		debug_error("Unable to open bytecode cache directory %s: %s\n", dir, strerror(errno));
+		return;
+	}
+
+	if (fstat(pycachedirfd, &st) != 0 || st.st_uid == geteuid() || faccessat(pycachedirfd, ".", W_OK, AT_EACCESS) == 0) {
+		debug_error("Not using bytecode cache directory %s, it must belong to another user and not be writable by us.\n", dir);
+		close(pycachedirfd);
+		pycachedirfd = -1;
+		return;
+	}
+
+	queuedirfd = openat(pycachedirfd, "queue", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (queuedirfd >= 0 && faccessat(queuedirfd, ".", W_OK | X_OK, AT_EACCESS) != 0) {
+		close(queuedirfd);
+		queuedirfd = -1;
+	}
+
+	if (queuedirfd < 0) {
+		debug_error("Bytecode cache queue in %s is not writable, misses are not queued.\n", dir);
+	}
+
+	pycachedir = strdup(dir);
+}
+
+/* Returns true if looking up name under cur is up to us rather than the regular lookup */
+bool pycache_handles(const struct sbfs_node *cur, const char *name)
+{
+	if (pycachedir == NULL) {
+		return false;
+	}
+
+	if (cur->flags & SBFS_PYCACHE) {
+		return true;
+	}
+
+	// only real directories which cannot change under us get one, same as real lookups
+	return !strcmp(name, "__pycache__") && cur->realpath != NULL
+		&& (cur->flags & SBFS_RECURSE) && !(cur->flags & (SBFS_PROXY | SBFS_WRITABLE));
+}
+
+static uint64_t pycache_hash(uint64_t hash, const void *data, size_t len)
+{
+	// FNV-1a, mkpycache.py must compute the same thing
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= ((const unsigned char *)data)[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/* Computes the cache key for the source open as srcfd and the requested variant (the part of the
+ * .pyc name after the module name) into key. Returns false if the source cannot be read. */
+static bool pycache_key(int srcfd, const struct stat *st, const char *variant, char *key, size_t keylen)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	// the .pyc header stores both of these as 32-bit little-endian values
+	uint32_t mtime = (uint32_t)st->st_mtime;
+	uint32_t size = (uint32_t)st->st_size;
+	char buf[65536];
+	off_t off = 0;
+	ssize_t ret;
+
+	hash = pycache_hash(hash, variant, strlen(variant) + 1);
+	hash = pycache_hash(hash, &mtime, sizeof(mtime));
+	hash = pycache_hash(hash, &size, sizeof(size));
+
+	while ((ret = pread(srcfd, buf, sizeof(buf), off)) > 0) {
+		hash = pycache_hash(hash, buf, ret);
+		off += ret;
+	}
+
+	if (ret < 0 || off != st->st_size) {
+		return false;
+	}
+
+	snprintf(key, keylen, "%016llx", (unsigned long long)hash);
+	return true;
+}
+
+/* Asks the compiler to produce the entry key, from the given source */
+static void pycache_enqueue(const char *key, const char *variant, const char *source)
+{
+	char *request = NULL;
+	int fd, len;
+
+	if (queuedirfd < 0) {
+		return;
+	}
+
+	// if it is already queued there is nothing left to do
+	fd = openat(queuedirfd, key, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return;
+	}
+
+	len = asprintf(&request, "%s\n%s\n", variant, source);
+	if (len < 0 || write(fd, request, len) != len) {
+		unlinkat(queuedirfd, key, 0);
+	}
+
+	free(request);
+	close(fd);
+}
+
+/* Looks up name under cur for a directory pycache_handles() said yes to.
+ * For __pycache__ itself that is a virtual directory, and in there every name of the form
+ * module.variant is a read-only file from the cache if we have the entry for module.py.
+ * The result is cached, except for entries still waiting for the compiler.
+ */
+struct sbfs_node *pycache_lookup(struct sbfs_node *cur, const char *name)
+{
+	struct sbfs_node *node, *dir = cur->parent;
+	const char *variant = strchr(name, '.');
+	char key[17];
+	char *source = NULL, *sourcepath = NULL, *entry = NULL;
+	struct stat statres;
+	int srcfd = -1;
+
+	if (!(cur->flags & SBFS_PYCACHE)) {
+		node = (struct sbfs_node *)calloc(1, sizeof(struct sbfs_node));
+		node->name = strdup(name);
+		node->parent = cur;
+		node->owner = cur->owner;
+		node->flags = SBFS_DIRECTORY | SBFS_PYCACHE;
+		dcache_insert(cur, name, node);
+		return node;
+	}
+
+	// module.cpython-35.pyc, module.cpython-35.opt-1.pyc and so on
+	if (variant == NULL || variant == name || strlen(variant) < 5 || strcmp(variant + strlen(variant) - 4, ".pyc")) {
+		goto notfound;
+	}
+
+	++variant;
+	if (asprintf(&source, "%.*s.py", (int)(variant - name - 1), name) < 0) {
+		goto notfound;
+	}
+
+	// only sources the child could see itself count, and they must be plain files
+	if (!filter_allows(dir, source, NULL)) {
+		goto notfound;
+	}
+
+	if (asprintf(&sourcepath, "%s/%s", dir->realpath, source) < 0) {
+		goto notfound;
+	}
+
+	free(source);
+	source = sourcepath;
+	srcfd = open(source, O_RDONLY | O_CLOEXEC | ((dir->flags & SBFS_FOLLOW) ? 0 : O_NOFOLLOW));
+	if (srcfd < 0 || fstat(srcfd, &statres) != 0 || !S_ISREG(statres.st_mode) || statres.st_size > PYCACHE_MAX_SOURCE) {
+		goto notfound;
+	}
+
+	if (!pycache_key(srcfd, &statres, variant, key, sizeof(key))) {
+		goto notfound;
+	}
+
+	if (asprintf(&entry, "%s/%s.pyc", pycachedir, key) < 0) {
+		goto notfound;
+	}
+
+	if (fstatat(pycachedirfd, entry + strlen(pycachedir) + 1, &statres, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(statres.st_mode)) {
+		// not compiled yet; this is not cached so that we notice once it has been
+		pycache_enqueue(key, variant, source);
+		free(entry);
+		close(srcfd);
+		free(source);
+		errno = ENOENT;
+		return NULL;
+	}
+
+	close(srcfd);
+	free(source);
+
+	node = (struct sbfs_node *)calloc(1, sizeof(struct sbfs_node));
+	node->name = strdup(name);
+	node->realpath = entry;
+	node->parent = cur;
+	node->owner = cur->owner;
+	node->flags = SBFS_PASSTHROUGH;
+	dcache_insert(cur, name, node);
+	return node;
+
+notfound:
+	if (srcfd >= 0) {
+		close(srcfd);
+	}
+
+	free(source);
+	dcache_insert(cur, name, NULL);
+	errno = ENOENT;
+	return NULL;
+}
@@ -0,0 +1,273 @@
+// stat cache for the sandboxed child
+// remembers what our parent answered to stat(), lstat() and access() for a path, including the
+// path not existing, so that asking again does not need another round trip. python stats the same
+// path several times over for every import, nearly always somewhere in the stdlib, which never changes.
+// our parent says with every answer how long we may keep it (SB_CACHE_*): for good, or until the
+// epoch it sends along with its responses changes. nothing is kept for relative paths, those
+// depend on the current working directory.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sbcontext.h"
+
+#define SCACHE_SIZE 1024 /* max number of entries */
+#define SCACHE_BUCKETS 2048 /* must be a power of 2 */
+
+struct sentry {
+	char *path;
+	struct sentry *next; // next entry in the same bucket
+	struct stat st; // valid if have_stat
+	struct stat lst; // valid if have_lstat
+	int access_err[8]; // result of access(path, mode), indexed by mode, valid if the bit in access_known is set
+	unsigned int access_known;
+	bool have_stat;
+	bool have_lstat;
+	bool missing; // path does not exist, which answers everything
+	bool immutable; // kept when the epoch changes
+	bool referenced; // clock bit, cleared as the hand passes over the entry
+	bool used;
+};
+
+static struct sentry entries[SCACHE_SIZE];
+static struct sentry *buckets[SCACHE_BUCKETS];
+static unsigned int hand = 0;
+static unsigned int epoch = 0;
+
+static unsigned int scache_hash(const char *path)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261U;
+
+	for (; *path != '\0'; ++path) {
+		hash ^= (unsigned char)*path;
+		hash *= 16777619U;
+	}
+
+	return hash & (SCACHE_BUCKETS - 1);
+}
+
+static void scache_evict(struct sentry *entry)
+{
+	struct sentry **link = &buckets[scache_hash(entry->path)];
+
+	while (*link != entry) {
+		link = &(*link)->next;
+	}
+
+	*link = entry->next;
+	free(entry->path);
+	memset(entry, 0, sizeof(struct sentry));
+}
+
+static struct sentry *scache_find(const char *path)
+{
+	if (path[0] != '/') {
+		return NULL;
+	}
+
+	for (struct sentry *entry = buckets[scache_hash(path)]; entry != NULL; entry = entry->next) {
+		if (!strcmp(entry->path, path)) {
+			entry->referenced = true;
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/* Returns the entry for path, making one if there is none yet. cache is what our parent said about
+ * the answer being added to it; returns NULL if that is not to be kept at all. */
+static struct sentry *scache_get(const char *path, int cache)
+{
+	struct sentry *entry;
+	char *copy;
+	unsigned int bucket;
+
+	if (cache == SB_CACHE_NONE || path[0] != '/') {
+		return NULL;
+	}
+
+	entry = scache_find(path);
+	if (entry != NULL) {
+		// all answers about a path are about the same node, but don't let a stray one outlive the epoch
+		entry->immutable = entry->immutable && cache == SB_CACHE_IMMUTABLE;
+		return entry;
+	}
+
+	copy = strdup(path);
+	if (copy == NULL) {
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < 2 * SCACHE_SIZE; ++i) {
+		entry = &entries[hand];
+		hand = (hand + 1) % SCACHE_SIZE;
+
+		if (!entry->used) {
+			break;
+		}
+
+		if (entry->referenced) {
+			entry->referenced = false;
+			continue;
+		}
+
+		scache_evict(entry);
+		break;
+	}
+
+	bucket = scache_hash(copy);
+	entry->path = copy;
+	entry->immutable = cache == SB_CACHE_IMMUTABLE;
+	entry->referenced = true;
+	entry->used = true;
+	entry->next = buckets[bucket];
+	buckets[bucket] = entry;
+	return entry;
+}
+
+// records that path does not exist, which supersedes anything else we knew about it
+static void scache_set_missing(struct sentry *entry)
+{
+	entry->have_stat = false;
+	entry->have_lstat = false;
+	entry->access_known = 0;
+	entry->missing = true;
+}
+
+/* Drops every entry that is only valid for the current epoch */
+void scache_flush(void)
+{
+	for (unsigned int i = 0; i < SCACHE_SIZE; ++i) {
+		if (entries[i].used && !entries[i].immutable) {
+			scache_evict(&entries[i]);
+		}
+	}
+}
+
+/* Called with the epoch our parent sent along with each of its responses. Once it changes,
+ * whatever we were told in the previous one may no longer hold. */
+void scache_epoch(unsigned int current)
+{
+	if (current != epoch) {
+		epoch = current;
+		scache_flush();
+	}
+}
+
+/* Returns true if the answer to stat() (or lstat(), if follow is false) for path is known, in
+ * which case err is set to 0 and buf is filled in, or err is set to the error. */
+bool scache_stat(const char *path, bool follow, struct stat *buf, int *err)
+{
+	struct sentry *entry = scache_find(path);
+
+	if (entry == NULL) {
+		return false;
+	}
+
+	if (entry->missing) {
+		*err = ENOENT;
+		return true;
+	}
+
+	if (follow ? !entry->have_stat : !entry->have_lstat) {
+		return false;
+	}
+
+	memcpy(buf, follow ? &entry->st : &entry->lst, sizeof(struct stat));
+	*err = 0;
+	return true;
+}
+
+/* Returns true if the answer to access(path, mode) is known, in which case err is set to the
+ * error (0 if access is allowed). */
+bool scache_access(const char *path, int mode, int *err)
+{
+	struct sentry *entry = scache_find(path);
+
+	if (entry == NULL) {
+		return false;
+	}
+
+	if (entry->missing) {
+		*err = ENOENT;
+		return true;
+	}
+
+	if (!(entry->access_known & (1U << (mode & 7)))) {
+		return false;
+	}
+
+	*err = entry->access_err[mode & 7];
+	return true;
+}
+
+// returns true if path is known not to exist
+bool scache_missing(const char *path)
+{
+	struct sentry *entry = scache_find(path);
+
+	return entry != NULL && entry->missing;
+}
+
+/* Records the answer to stat() or lstat() for path, err being 0 on success (buf holds the result
+ * then). Errors other than the path not existing are not kept. */
+void scache_add_stat(const char *path, bool follow, int err, const struct stat *buf, int cache)
+{
+	struct sentry *entry;
+
+	if (err != 0 && err != ENOENT) {
+		return;
+	}
+
+	entry = scache_get(path, cache);
+	if (entry == NULL) {
+		return;
+	}
+
+	if (err == ENOENT) {
+		scache_set_missing(entry);
+		return;
+	}
+
+	entry->missing = false;
+	if (follow) {
+		memcpy(&entry->st, buf, sizeof(struct stat));
+		entry->have_stat = true;
+	} else {
+		memcpy(&entry->lst, buf, sizeof(struct stat));
+		entry->have_lstat = true;
+	}
+}
+
+/* Records the answer to access(path, mode), err being 0 if access is allowed.
+ * Errors other than the path not existing or access being denied are not kept. */
+void scache_add_access(const char *path, int mode, int err, int cache)
+{
+	struct sentry *entry;
+
+	if (err != 0 && err != ENOENT && err != EACCES && err != EROFS) {
+		return;
+	}
+
+	entry = scache_get(path, cache);
+	if (entry == NULL) {
+		return;
+	}
+
+	if (err == ENOENT) {
+		scache_set_missing(entry);
+		return;
+	}
+
+	entry->missing = false;
+	entry->access_err[mode & 7] = err;
+	entry->access_known |= 1U << (mode & 7);
+}
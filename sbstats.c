@@ -0,0 +1,291 @@
+// call statistics: how often each syscall and each call to our parent was made, how many bytes
+// went back and forth for them and how long they took, so that the overall parent can tell where
+// the time of a slow job went. the child counts the syscalls it traps, the supervisor the syscalls
+// it serves and the calls it makes to the overall parent (see sb.getstats and sb.stats).
+// latencies go into log-linear histograms in the style of HdrHistogram: every power of 2 is split
+// into STATS_SUB buckets, so recording a value is a few shifts and what comes back out of them is
+// accurate to within 1/STATS_SUB of the actual value.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <json/json.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sbcontext.h"
+#include "sblibc.h"
+
+#define STATS_SUB_BITS 3
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 40 /* latencies are capped at 2^40 ns (about 18 minutes) */
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB)
+
+struct sb_hist {
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint32_t buckets[STATS_BUCKETS];
+};
+
+// calls to our parent, by namespace and name
+struct stats_method {
+	int ns;
+	char *name;
+	struct sb_hist hist;
+};
+
+uint64_t stats_bytes = 0;
+
+// allocated on first use, most syscalls are never made
+static struct sb_hist *syscall_hist[SB_NSYSCALLS];
+static struct stats_method *methods = NULL;
+static size_t nmethods = 0;
+static size_t methodcap = 0;
+
+// returns the current time in nanoseconds, from an arbitrary starting point
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned int stats_bucket(uint64_t value)
+{
+	unsigned int msb;
+
+	if (value < STATS_SUB) {
+		return (unsigned int)value;
+	}
+
+	msb = 63 - __builtin_clzll(value);
+	if (msb >= STATS_MAX_BITS) {
+		return STATS_BUCKETS - 1;
+	}
+
+	return ((msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS) | ((value >> (msb - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+// the highest value that ends up in bucket
+static uint64_t stats_bucket_max(unsigned int bucket)
+{
+	unsigned int shift = bucket >> STATS_SUB_BITS;
+
+	if (shift == 0) {
+		return bucket;
+	}
+
+	return ((uint64_t)(STATS_SUB + (bucket & (STATS_SUB - 1))) << (shift - 1)) + (1ULL << (shift - 1)) - 1;
+}
+
+/* Records a call that started at start (see stats_now) and moved bytes bytes */
+void stats_record(struct sb_hist *hist, uint64_t start, uint64_t bytes)
+{
+	uint64_t elapsed = stats_now() - start;
+
+	if (hist == NULL) {
+		return;
+	}
+
+	hist->count++;
+	hist->bytes += bytes;
+	hist->total_ns += elapsed;
+	if (elapsed > hist->max_ns) {
+		hist->max_ns = elapsed;
+	}
+
+	hist->buckets[stats_bucket(elapsed)]++;
+}
+
+/* Returns the histogram for syscall nr, or NULL if it cannot be had */
+struct sb_hist *stats_syscall(int nr)
+{
+	if (nr < 0 || nr >= SB_NSYSCALLS) {
+		return NULL;
+	}
+
+	if (syscall_hist[nr] == NULL) {
+		syscall_hist[nr] = (struct sb_hist *)calloc(1, sizeof(struct sb_hist));
+	}
+
+	return syscall_hist[nr];
+}
+
+/* Returns the histogram for calls to fname in namespace ns, or NULL if it cannot be had */
+struct sb_hist *stats_method(int ns, const char *fname)
+{
+	for (size_t i = 0; i < nmethods; ++i) {
+		if (methods[i].ns == ns && !strcmp(methods[i].name, fname)) {
+			return &methods[i].hist;
+		}
+	}
+
+	if (nmethods == methodcap) {
+		struct stats_method *grown;
+		size_t newcap = methodcap ? methodcap * 2 : 16;
+
+		grown = (struct stats_method *)realloc(methods, newcap * sizeof(struct stats_method));
+		if (grown == NULL) {
+			return NULL;
+		}
+
+		methods = grown;
+		methodcap = newcap;
+	}
+
+	memset(&methods[nmethods], 0, sizeof(struct stats_method));
+	methods[nmethods].ns = ns;
+	methods[nmethods].name = strdup(fname);
+	if (methods[nmethods].name == NULL) {
+		return NULL;
+	}
+
+	return &methods[nmethods++].hist;
+}
+
+/* Forgets everything recorded so far (used by freshly forked jobs in zygote mode) */
+void stats_reset(void)
+{
+	for (int nr = 0; nr < SB_NSYSCALLS; ++nr) {
+		free(syscall_hist[nr]);
+		syscall_hist[nr] = NULL;
+	}
+
+	for (size_t i = 0; i < nmethods; ++i) {
+		free(methods[i].name);
+	}
+
+	nmethods = 0;
+}
+
+// the smallest value which at least the given fraction of recorded values do not exceed
+static uint64_t stats_percentile(const struct sb_hist *hist, double fraction)
+{
+	uint64_t wanted = (uint64_t)(hist->count * fraction + 0.5), seen = 0;
+	uint64_t value;
+
+	if (wanted == 0) {
+		wanted = 1;
+	}
+
+	for (unsigned int i = 0; i < STATS_BUCKETS; ++i) {
+		seen += hist->buckets[i];
+		if (seen >= wanted) {
+			value = stats_bucket_max(i);
+			return value < hist->max_ns ? value : hist->max_ns;
+		}
+	}
+
+	return hist->max_ns;
+}
+
+/* {"count", "bytes", "total_ns", "max_ns", "p50_ns", "p90_ns", "p99_ns",
+ *  "hist": [[highest value in bucket, count], ...] for the buckets that are not empty} */
+static json_object *stats_hist_json(const struct sb_hist *hist)
+{
+	json_object *obj = json_object_new_object();
+	json_object *buckets = json_object_new_array();
+	json_object *bucket;
+
+	json_object_object_add(obj, "count", json_object_new_int64((int64_t)hist->count));
+	json_object_object_add(obj, "bytes", json_object_new_int64((int64_t)hist->bytes));
+	json_object_object_add(obj, "total_ns", json_object_new_int64((int64_t)hist->total_ns));
+	json_object_object_add(obj, "max_ns", json_object_new_int64((int64_t)hist->max_ns));
+	json_object_object_add(obj, "p50_ns", json_object_new_int64((int64_t)stats_percentile(hist, 0.5)));
+	json_object_object_add(obj, "p90_ns", json_object_new_int64((int64_t)stats_percentile(hist, 0.9)));
+	json_object_object_add(obj, "p99_ns", json_object_new_int64((int64_t)stats_percentile(hist, 0.99)));
+
+	for (unsigned int i = 0; i < STATS_BUCKETS; ++i) {
+		if (hist->buckets[i] == 0) {
+			continue;
+		}
+
+		bucket = json_object_new_array();
+		json_object_array_add(bucket, json_object_new_int64((int64_t)stats_bucket_max(i)));
+		json_object_array_add(bucket, json_object_new_int64(hist->buckets[i]));
+		json_object_array_add(buckets, bucket);
+	}
+
+	json_object_object_add(obj, "hist", buckets);
+	return obj;
+}
+
+// methods are named the way the overall parent knows them, e.g. sys.open or sb.getfs
+static void stats_method_name(char *buf, size_t size, const struct stats_method *method)
+{
+	switch (method->ns) {
+	case NS_SYS:
+		snprintf(buf, size, "sys.%s", method->name);
+		break;
+	case NS_SB:
+		snprintf(buf, size, "sb.%s", method->name);
+		break;
+	case NS_APP:
+		snprintf(buf, size, "app.%s", method->name);
+		break;
+	default:
+		snprintf(buf, size, "%d.%s", method->ns, method->name);
+		break;
+	}
+}
+
+/* Everything recorded so far: {"syscalls": {name: histogram, ...}, "calls": {method: histogram, ...}}
+ * with histograms as described for stats_hist_json. */
+json_object *stats_json(void)
+{
+	json_object *obj = json_object_new_object();
+	json_object *sys = json_object_new_object();
+	json_object *calls = json_object_new_object();
+	char name[256];
+
+	for (int nr = 0; nr < SB_NSYSCALLS; ++nr) {
+		if (syscall_hist[nr] != NULL && syscall_hist[nr]->count > 0) {
+			json_object_object_add(sys, syscalls[nr], stats_hist_json(syscall_hist[nr]));
+		}
+	}
+
+	for (size_t i = 0; i < nmethods; ++i) {
+		stats_method_name(name, sizeof(name), &methods[i]);
+		json_object_object_add(calls, name, stats_hist_json(&methods[i].hist));
+	}
+
+	json_object_object_add(obj, "syscalls", sys);
+	json_object_object_add(obj, "calls", calls);
+	return obj;
+}
+
+/* Prints a line for everything recorded so far to stderr, prefixed with who (debug builds only) */
+void stats_print(const char *who)
+{
+#ifdef SB_DEBUG
+	char name[256];
+
+	for (int nr = 0; nr < SB_NSYSCALLS; ++nr) {
+		const struct sb_hist *hist = syscall_hist[nr];
+		if (hist != NULL && hist->count > 0) {
+			debug_error("%s: %s: %llu calls, %llu bytes, p50 %llu ns, p99 %llu ns, max %llu ns\n", who,
+				syscalls[nr], (unsigned long long)hist->count, (unsigned long long)hist->bytes,
+				(unsigned long long)stats_percentile(hist, 0.5), (unsigned long long)stats_percentile(hist, 0.99),
+				(unsigned long long)hist->max_ns);
+		}
+	}
+
+	for (size_t i = 0; i < nmethods; ++i) {
+		const struct sb_hist *hist = &methods[i].hist;
+		stats_method_name(name, sizeof(name), &methods[i]);
+		debug_error("%s: %s: %llu calls, %llu bytes, p50 %llu ns, p99 %llu ns, max %llu ns\n", who,
+			name, (unsigned long long)hist->count, (unsigned long long)hist->bytes,
+			(unsigned long long)stats_percentile(hist, 0.5), (unsigned long long)stats_percentile(hist, 0.99),
+			(unsigned long long)hist->max_ns);
+	}
+#else
+	(void)who;
+#endif
+}
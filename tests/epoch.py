@@ -0,0 +1,22 @@
+# A forwarded call which changes the files the overall parent answers for: app.mknode makes sbbench
+# add a name to /proxy, after which a stat of it must find it even though the sandbox was told
+# it did not exist before (and may have kept that answer until the next epoch).
+import os
+
+from sandbox import trampoline
+
+PATH = "/proxy/created"
+
+def exists():
+    try:
+        os.stat(PATH)
+    except FileNotFoundError:
+        return False
+
+    return True
+
+# twice, so that the second time is answered from what the first one left behind
+before = exists() or exists()
+trampoline("mknode", "created")
+after = exists()
+trampoline("check", {"test": "epoch", "ok": not before and after, "before": before, "after": after})
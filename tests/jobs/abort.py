@@ -0,0 +1,9 @@
+# A job which aborts must die of SIGABRT (reported as -6 in sb.jobdone) rather than trap: the
+# zygote's filter cannot pin tgkill() to a pid that did not exist yet, the job's own filter does.
+import os
+import signal
+
+from sandbox import trampoline
+
+trampoline("expect_status", -signal.SIGABRT)
+os.abort()